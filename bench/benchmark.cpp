@@ -0,0 +1,362 @@
+/**
+ * @file benchmark.cpp
+ * @brief Headless, deterministic benchmark for the full frame loop.
+ *
+ * Runs a scripted scenario without opening a window: a fixed seed, a recorded
+ * (or generated) input track, a number of radial lights, a bullet rate, a grid
+ * size and a camera view size. Lighting and readback only cover the chunks the
+ * camera sees, as in the game. Each frame drives update_player,
+ * update_bullets, ParticleSystem::update, update_radial_light_movers,
+ * update_grid_lighting and the grid readback that render_grid performs (or,
+ * with --render=framebuffer|device, the framebuffer shading and the diff
+ * against the previous frame, without drawing), on a fixed 60 Hz timestep, and
+ * the per-phase and total frame times are reported as percentiles. With
+ * --occlusion=shadowmap the scene is also lit with both occlusion modes every
+ * OCCLUSION_REPORT_INTERVAL frames (outside the timed phases) and the
+ * shadow-map error is reported.
+ *
+ * Build from the repository root with every game source except program.cpp, e.g.
+ *     skm g++ bench/benchmark.cpp $(ls *.cpp | grep -v program.cpp) -lOpenCL -o benchmark
+ * and run it from the root so lighting_kernels.cl is found:
+ *     ./benchmark --frames=600 --seed=1 --lights=5 --bullets-per-second=20 --grid=150x150
+ *                 [--warmup=60] [--static-lights=0] [--backend=auto|opencl|cpu|flood] [--lighting-update=full|incremental]
+ *                 [--lighting-pipeline=sync|async] [--occlusion=raycast|shadowmap] [--input=track.txt] [--csv=out.csv]
+ *                 [--render=cells|framebuffer|device] [--view=150x150] [--cl-profile=trace.json|trace.csv]
+ * Input tracks can be recorded from the game with --record-input=track.txt.
+ * With --cl-profile the OpenCL commands of the timed frames are summed per
+ * frame and every command is written to the trace file.
+ * backend_startup_ms covers device setup and the kernel build, which is much
+ * shorter once the OpenCL program binary is in kernel_cache/.
+ */
+
+#include "../include/types.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <numeric>
+
+namespace {
+
+const double FIXED_DELTA_TIME = 1.0 / 60.0;
+const int OCCLUSION_REPORT_INTERVAL = 60;
+
+struct Scenario {
+    int frames = 600;
+    int warmup = 60;
+    unsigned int seed = 1;
+    int lights = DEFAULT_RADIAL_LIGHTS;
+    int static_lights = 0;
+    double bullets_per_second = 20.0;
+    int grid_width = GRID_WIDTH;
+    int grid_height = GRID_HEIGHT;
+    int view_width = SCREEN_WIDTH / CELL_SIZE;
+    int view_height = SCREEN_HEIGHT / CELL_SIZE;
+    std::string backend = "auto";
+    bool incremental = false;
+    bool pipelined = false;
+    std::string occlusion = "raycast";
+    std::string render = "cells";
+    std::string input_path;
+    std::string csv_path;
+    std::string profile_path;
+};
+
+enum Phase {
+    PHASE_PLAYER,
+    PHASE_BULLETS,
+    PHASE_PARTICLES,
+    PHASE_LIGHT_MOVERS,
+    PHASE_LIGHTING,
+    PHASE_READBACK,
+    PHASE_TOTAL,
+    PHASE_COUNT
+};
+
+const char* PHASE_NAMES[PHASE_COUNT] = {
+    "player", "bullets", "particles", "light_movers", "lighting", "readback", "total"
+};
+
+struct PhaseSummary {
+    double mean;
+    double p50;
+    double p90;
+    double p99;
+    double max;
+};
+
+/**
+ * @brief Parses "--name=value" arguments into the scenario.
+ */
+Scenario parse_scenario(int argc, char* argv[]) {
+    Scenario scenario;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        size_t equals = arg.find('=');
+        if (arg.rfind("--", 0) != 0 || equals == std::string::npos) {
+            throw std::invalid_argument("Unrecognised argument: " + arg);
+        }
+        std::string name = arg.substr(2, equals - 2);
+        std::string value = arg.substr(equals + 1);
+
+        if (name == "frames") scenario.frames = std::stoi(value);
+        else if (name == "warmup") scenario.warmup = std::stoi(value);
+        else if (name == "seed") scenario.seed = static_cast<unsigned int>(std::stoul(value));
+        else if (name == "lights") scenario.lights = std::stoi(value);
+        else if (name == "static-lights") scenario.static_lights = std::stoi(value);
+        else if (name == "bullets-per-second") scenario.bullets_per_second = std::stod(value);
+        else if (name == "backend") scenario.backend = value;
+        else if (name == "lighting-update") scenario.incremental = value == "incremental";
+        else if (name == "lighting-pipeline") scenario.pipelined = value == "async";
+        else if (name == "occlusion") scenario.occlusion = value;
+        else if (name == "render") scenario.render = value;
+        else if (name == "input") scenario.input_path = value;
+        else if (name == "csv") scenario.csv_path = value;
+        else if (name == "cl-profile") scenario.profile_path = value;
+        else if (name == "grid" || name == "view") {
+            size_t x = value.find('x');
+            if (x == std::string::npos) {
+                throw std::invalid_argument("Size must be WxH: " + value);
+            }
+            (name == "grid" ? scenario.grid_width : scenario.view_width) = std::stoi(value.substr(0, x));
+            (name == "grid" ? scenario.grid_height : scenario.view_height) = std::stoi(value.substr(x + 1));
+        } else {
+            throw std::invalid_argument("Unrecognised argument: " + arg);
+        }
+    }
+    return scenario;
+}
+
+/**
+ * @brief Generates a repeatable input track: the mouse orbits the centre of the
+ * world while the player strafes through each direction in turn.
+ */
+std::vector<InputState> generate_input_track(int frames, int grid_width, int grid_height) {
+    std::vector<InputState> track;
+    for (int frame = 0; frame < frames; ++frame) {
+        double angle = 2.0 * PI * frame / 240.0;
+        InputState input = {};
+        input.mouse = {grid_width * CELL_SIZE / 2.0 + std::cos(angle) * 300.0, grid_height * CELL_SIZE / 2.0 + std::sin(angle) * 300.0};
+        switch ((frame / 60) % 4) {
+            case 0: input.up = true; break;
+            case 1: input.right = true; break;
+            case 2: input.down = true; break;
+            default: input.left = true; break;
+        }
+        track.push_back(input);
+    }
+    return track;
+}
+
+/**
+ * @brief Summarises a set of samples using nearest-rank percentiles.
+ */
+PhaseSummary summarise(std::vector<double> samples) {
+    PhaseSummary summary = {0, 0, 0, 0, 0};
+    if (samples.empty()) {
+        return summary;
+    }
+    std::sort(samples.begin(), samples.end());
+    auto percentile = [&](double p) {
+        size_t rank = static_cast<size_t>(std::ceil(p * samples.size()));
+        return samples[std::min(samples.size() - 1, rank > 0 ? rank - 1 : 0)];
+    };
+    summary.mean = std::accumulate(samples.begin(), samples.end(), 0.0) / samples.size();
+    summary.p50 = percentile(0.50);
+    summary.p90 = percentile(0.90);
+    summary.p99 = percentile(0.99);
+    summary.max = samples.back();
+    return summary;
+}
+
+double elapsed_ms(std::chrono::high_resolution_clock::time_point from, std::chrono::high_resolution_clock::time_point to) {
+    return std::chrono::duration<double, std::milli>(to - from).count();
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+    try {
+        Scenario scenario = parse_scenario(argc, argv);
+
+        auto startup_begin = std::chrono::high_resolution_clock::now();
+        std::unique_ptr<LightingBackend> lightingBackend = create_lighting_backend(parse_lighting_backend_type(scenario.backend));
+        double startup_ms = elapsed_ms(startup_begin, std::chrono::high_resolution_clock::now());
+        LightingOptions lightingOptions;
+        lightingOptions.incremental = scenario.incremental;
+        lightingOptions.pipelined = scenario.pipelined;
+        lightingOptions.occlusion = parse_occlusion_mode(scenario.occlusion);
+        lightingOptions.profiling = !scenario.profile_path.empty();
+        lightingBackend->setOptions(lightingOptions);
+        DeviceProfiler* deviceProfiler = lightingOptions.profiling ? lightingBackend->getDeviceProfiler() : nullptr;
+        if (lightingOptions.profiling && !deviceProfiler) {
+            std::cerr << "--cl-profile ignored: " << lightingBackend->getName() << " has no device commands to profile" << std::endl;
+        }
+        if (deviceProfiler) {
+            deviceProfiler->openTrace(scenario.profile_path);
+        }
+
+        std::mt19937 rng(scenario.seed);
+        Grid initialGrid = create_grid(scenario.grid_width, scenario.grid_height, rng());
+        lightingBackend->initializeGrid(initialGrid);
+
+        std::vector<RadialLight> radial_lights = create_radial_lights(scenario.lights, scenario.static_lights, scenario.grid_width, scenario.grid_height, rng());
+        std::vector<InputState> track = scenario.input_path.empty()
+                ? generate_input_track(scenario.warmup + scenario.frames, scenario.grid_width, scenario.grid_height)
+                : load_input_track(scenario.input_path);
+        if (track.empty()) {
+            throw std::runtime_error("Input track is empty");
+        }
+
+        Player player = {{scenario.grid_width / 2.0, scenario.grid_height / 2.0}, {0, 0}, 0, 100, 0};
+        Torch torch = {{player.position.x, player.position.y}, {1, 0}, TORCH_RADIUS, TORCH_RADIUS};
+        Camera camera = create_camera(scenario.view_width, scenario.view_height);
+        std::vector<Bullet> bullets;
+        ParticleSystem particles;
+        std::vector<uint8_t> lightLevels;
+        RenderMode renderMode = parse_render_mode(scenario.render);
+        GridFramebuffer framebuffer;
+        std::uniform_real_distribution<> spread_dist(-0.3, 0.3);
+        double bullet_accumulator = 0.0;
+        bool torch_on = true;
+        long total_hits = 0;
+        long updated_cells = 0;
+        long redrawn_cells = 0;
+        OcclusionErrorReport occlusion_error;
+        int occlusion_samples = 0;
+
+        std::vector<std::vector<double>> samples(PHASE_COUNT);
+        for (auto& phase : samples) {
+            phase.reserve(scenario.frames);
+        }
+
+        for (int frame = 0; frame < scenario.warmup + scenario.frames; ++frame) {
+            const InputState& input = track[frame % track.size()];
+            double total_time = frame * FIXED_DELTA_TIME;
+
+            auto t0 = std::chrono::high_resolution_clock::now();
+            update_player(player, input, *lightingBackend);
+            update_camera(camera, player, scenario.grid_width, scenario.grid_height);
+            GridRect activeRect = camera_active_rect(camera, scenario.grid_width, scenario.grid_height);
+            lightingBackend->setActiveRect(activeRect);
+            update_torch(torch, player, total_time);
+
+            auto t1 = std::chrono::high_resolution_clock::now();
+            bullet_accumulator += scenario.bullets_per_second * FIXED_DELTA_TIME;
+            while (bullet_accumulator >= 1.0) {
+                Player shooter = player;
+                shooter.heading += spread_dist(rng);
+                create_bullet(bullets, shooter);
+                bullet_accumulator -= 1.0;
+            }
+            if (input.fire && player.cooldown == 0) {
+                create_bullet(bullets, player);
+            }
+            total_hits += update_bullets(bullets, particles, rng, *lightingBackend);
+
+            auto t2 = std::chrono::high_resolution_clock::now();
+            particles.update();
+
+            auto t3 = std::chrono::high_resolution_clock::now();
+            update_radial_light_movers(radial_lights, lightingBackend->getGridWidth(), lightingBackend->getGridHeight(), FIXED_DELTA_TIME);
+            if (input.toggle_torch) {
+                torch_on = !torch_on;
+            }
+
+            auto t4 = std::chrono::high_resolution_clock::now();
+            update_grid_lighting(radial_lights, torch, torch_on, *lightingBackend);
+
+            auto t5 = std::chrono::high_resolution_clock::now();
+            if (renderMode == RenderMode::CELLS) {
+                lightingBackend->readLightLevelRect(lightLevels, activeRect);
+            } else {
+                framebuffer.shadeFrom(*lightingBackend, activeRect, renderMode == RenderMode::DEVICE_FRAMEBUFFER);
+                framebuffer.collectChangedRuns();
+            }
+
+            auto t6 = std::chrono::high_resolution_clock::now();
+
+            if (frame < scenario.warmup) {
+                continue;
+            }
+            if (frame == scenario.warmup && deviceProfiler) {
+                deviceProfiler->clearTotals();
+            }
+            updated_cells += lightingBackend->getLastUpdatedCellCount();
+            redrawn_cells += renderMode == RenderMode::CELLS ? static_cast<long>(lightLevels.size()) : framebuffer.getChangedCellCount();
+            samples[PHASE_PLAYER].push_back(elapsed_ms(t0, t1));
+            samples[PHASE_BULLETS].push_back(elapsed_ms(t1, t2));
+            samples[PHASE_PARTICLES].push_back(elapsed_ms(t2, t3));
+            samples[PHASE_LIGHT_MOVERS].push_back(elapsed_ms(t3, t4));
+            samples[PHASE_LIGHTING].push_back(elapsed_ms(t4, t5));
+            samples[PHASE_READBACK].push_back(elapsed_ms(t5, t6));
+            samples[PHASE_TOTAL].push_back(elapsed_ms(t0, t6));
+
+            if (lightingOptions.occlusion == OcclusionMode::SHADOW_MAP && (frame - scenario.warmup) % OCCLUSION_REPORT_INTERVAL == 0) {
+                OcclusionErrorReport report = compare_occlusion_modes(lightingBackend->getCollisionGrid(), radial_lights, torch, torch_on);
+                occlusion_error.cells += report.cells;
+                occlusion_error.mismatched_cells += report.mismatched_cells;
+                occlusion_error.over_lit_cells += report.over_lit_cells;
+                occlusion_error.under_lit_cells += report.under_lit_cells;
+                occlusion_error.max_level_error = std::max(occlusion_error.max_level_error, report.max_level_error);
+                occlusion_error.mean_abs_error += report.mean_abs_error * report.cells;
+                ++occlusion_samples;
+            }
+        }
+
+        lightingBackend->readLightLevels(lightLevels);
+        long lit_cells = std::count_if(lightLevels.begin(), lightLevels.end(), [](uint8_t level) { return level > 0; });
+        std::printf("backend=%s update=%s pipeline=%s occlusion=%s render=%s grid=%dx%d view=%dx%d lights=%d static=%d bullets/s=%.1f seed=%u frames=%d warmup=%d\n",
+                    lightingBackend->getName().c_str(), scenario.incremental ? "incremental" : "full",
+                    scenario.pipelined ? "async" : "sync", scenario.occlusion.c_str(), scenario.render.c_str(),
+                    scenario.grid_width, scenario.grid_height, scenario.view_width, scenario.view_height, scenario.lights, scenario.static_lights,
+                    scenario.bullets_per_second, scenario.seed, scenario.frames, scenario.warmup);
+        std::printf("hits=%ld lit_cells=%ld live_particles=%d avg_updated_cells=%.0f avg_redrawn_cells=%.0f\n", total_hits, lit_cells,
+                    particles.getCount(), scenario.frames > 0 ? static_cast<double>(updated_cells) / scenario.frames : 0.0,
+                    scenario.frames > 0 ? static_cast<double>(redrawn_cells) / scenario.frames : 0.0);
+        std::printf("backend_startup_ms=%.1f\n\n", startup_ms);
+        if (occlusion_samples > 0) {
+            std::printf("occlusion error vs raycast (%d samples): mismatched=%.3f%% over_lit=%ld under_lit=%ld max_level_error=%d mean_abs_error=%.4f\n\n",
+                        occlusion_samples, 100.0 * occlusion_error.mismatched_cells / occlusion_error.cells,
+                        occlusion_error.over_lit_cells, occlusion_error.under_lit_cells, occlusion_error.max_level_error,
+                        occlusion_error.mean_abs_error / occlusion_error.cells);
+        }
+        std::printf("%-14s %10s %10s %10s %10s %10s\n", "phase (ms)", "mean", "p50", "p90", "p99", "max");
+
+        std::vector<PhaseSummary> summaries;
+        for (int phase = 0; phase < PHASE_COUNT; ++phase) {
+            PhaseSummary s = summarise(samples[phase]);
+            summaries.push_back(s);
+            std::printf("%-14s %10.3f %10.3f %10.3f %10.3f %10.3f\n", PHASE_NAMES[phase], s.mean, s.p50, s.p90, s.p99, s.max);
+        }
+
+        if (deviceProfiler) {
+            deviceProfiler->closeTrace();
+            double frames = std::max<long>(deviceProfiler->getTotalFrameCount(), 1);
+            std::printf("\n%-22s %10s %10s %10s %12s\n", "device command", "per frame", "ms/frame", "wait ms", "bytes/frame");
+            for (const auto& command : deviceProfiler->getTotals()) {
+                std::printf("%-22s %10.2f %10.3f %10.3f %12.0f\n", command.name.c_str(), command.count / frames,
+                            command.device_ms / frames, command.waiting_ms / frames, command.bytes / frames);
+            }
+        }
+
+        if (!scenario.csv_path.empty()) {
+            std::ofstream csv(scenario.csv_path);
+            csv << "backend,update,pipeline,occlusion,render,grid_width,grid_height,lights,static_lights,bullets_per_second,seed,frames,phase,mean_ms,p50_ms,p90_ms,p99_ms,max_ms\n";
+            for (int phase = 0; phase < PHASE_COUNT; ++phase) {
+                const PhaseSummary& s = summaries[phase];
+                csv << lightingBackend->getName() << ',' << (scenario.incremental ? "incremental" : "full") << ','
+                    << (scenario.pipelined ? "async" : "sync") << ',' << scenario.occlusion << ',' << scenario.render << ',' << scenario.grid_width << ',' << scenario.grid_height << ','
+                    << scenario.lights << ',' << scenario.static_lights << ',' << scenario.bullets_per_second << ',' << scenario.seed << ','
+                    << scenario.frames << ',' << PHASE_NAMES[phase] << ',' << s.mean << ',' << s.p50 << ','
+                    << s.p90 << ',' << s.p99 << ',' << s.max << '\n';
+            }
+        }
+    } catch (const std::exception& e) {
+        std::cerr << "Benchmark failed: " << e.what() << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
@@ -18,7 +18,6 @@
  */
 void create_bullet(std::vector<Bullet>& bullets, Player& player) {
     Bullet new_bullet;
-    play_sound_effect("gunshot", 1, 0.5);
     new_bullet.position = player.position;
     new_bullet.velocity = {
             cos(player.heading) * BULLET_SPEED,
@@ -32,55 +31,51 @@ void create_bullet(std::vector<Bullet>& bullets, Player& player) {
 /**
  * @brief Updates the state of all bullets and handles collisions.
  *
+ * All bullets are traced against the grid in one batched raycast, then
+ * resolved in order: bullets that hit a wall spawn particles and destroy the
+ * cell, the rest advance and expire when out of lifetime or bounds.
+ *
  * @param bullets The vector of bullets to update.
- * @param particles The vector of particles to add collision effects to.
- * @param openclWrapper The OpenCL wrapper for collision detection.
+ * @param particles The particle system to add collision effects to.
+ * @param rng Random generator used for the hit particles.
+ * @param lightingBackend The lighting backend used for collision detection.
+ * @return The number of bullets that hit a wall this frame.
  */
-void update_bullets(std::vector<Bullet>& bullets, std::vector<Particle>& particles, OpenCLWrapper& openclWrapper) {
-    for (auto it = bullets.begin(); it != bullets.end();) {
-        Vector2D start = it->position;
-        Vector2D end = {
-                it->position.x + it->velocity.x,
-                it->position.y + it->velocity.y
-        };
-
-        Vector2D hit_point;
-        openclWrapper.getCollisionPoint(start, end, hit_point);
-        bool collision = hit_point.x >= 0;
+int update_bullets(std::vector<Bullet>& bullets, ParticleSystem& particles, std::mt19937& rng, LightingBackend& lightingBackend) {
+    std::vector<RaySegment> segments;
+    segments.reserve(bullets.size());
+    for (const auto& bullet : bullets) {
+        segments.push_back({bullet.position, {bullet.position.x + bullet.velocity.x, bullet.position.y + bullet.velocity.y}});
+    }
 
-        if (collision) {
-            play_sound_effect("hit");
-            Vector2D normal;
-            int hit_x = static_cast<int>(hit_point.x);
-            int hit_y = static_cast<int>(hit_point.y);
+    std::vector<RayHit> rayHits;
+    lightingBackend.castRays(segments, rayHits);
 
-            double dx = hit_point.x - start.x;
-            double dy = hit_point.y - start.y;
+    int hits = 0;
+    size_t kept = 0;
+    for (size_t i = 0; i < bullets.size(); ++i) {
+        Bullet& bullet = bullets[i];
+        const RayHit& rayHit = rayHits[i];
 
-            if (std::abs(dx) > std::abs(dy)) {
-                normal.x = (dx > 0) ? -1.0 : 1.0;
-                normal.y = 0.0;
-            } else {
-                normal.x = 0.0;
-                normal.y = (dy > 0) ? -1.0 : 1.0;
-            }
+        if (rayHit.hit) {
+            hits++;
+            particles.emit(rayHit.point, rayHit.normal, PARTICLES_PER_HIT, rng);
+            lightingBackend.addCollisionPoint(rayHit.cell_x, rayHit.cell_y);
+            continue;
+        }
 
-            create_particles(particles, hit_point, normal, 30);
-            openclWrapper.addCollisionPoint(hit_x, hit_y);
-            it = bullets.erase(it);
-        } else {
-            it->position = end;
-            it->lifetime--;
+        bullet.position = segments[i].end;
+        bullet.lifetime--;
 
-            if (it->lifetime <= 0 ||
-                it->position.x < 0 || it->position.x >= openclWrapper.getGridWidth() ||
-                it->position.y < 0 || it->position.y >= openclWrapper.getGridHeight()) {
-                it = bullets.erase(it);
-            } else {
-                ++it;
-            }
+        if (bullet.lifetime <= 0 ||
+            bullet.position.x < 0 || bullet.position.x >= lightingBackend.getGridWidth() ||
+            bullet.position.y < 0 || bullet.position.y >= lightingBackend.getGridHeight()) {
+            continue;
         }
+        bullets[kept++] = bullet;
     }
+    bullets.resize(kept);
+    return hits;
 }
 
 /**
@@ -0,0 +1,62 @@
+/**
+ * @file camera.cpp
+ * @brief Implements the camera that follows the player across the world.
+ *
+ * Drawing code works in world pixels (cells x CELL_SIZE); apply_camera moves
+ * the SplashKit camera so those land in the right place on screen, and HUD
+ * elements are drawn with option_to_screen(). update_camera only does the
+ * arithmetic, so the simulation thread can run it without touching SplashKit.
+ */
+
+#include "./include/types.h"
+#include <algorithm>
+
+/**
+ * @brief Creates a camera at the world origin.
+ * @param view_width The width of the view in cells.
+ * @param view_height The height of the view in cells.
+ * @return The new camera.
+ */
+Camera create_camera(int view_width, int view_height) {
+    return {0.0, 0.0, view_width, view_height};
+}
+
+/**
+ * @brief Centres the camera on the player, keeping the view inside the world.
+ *
+ * @param camera The camera to move.
+ * @param player The player to follow.
+ * @param world_width The width of the world in cells.
+ * @param world_height The height of the world in cells.
+ */
+void update_camera(Camera& camera, const Player& player, int world_width, int world_height) {
+    camera.x = std::max(0.0, std::min(player.position.x - camera.view_width / 2.0, static_cast<double>(world_width - camera.view_width)));
+    camera.y = std::max(0.0, std::min(player.position.y - camera.view_height / 2.0, static_cast<double>(world_height - camera.view_height)));
+}
+
+/**
+ * @brief Points the SplashKit camera at the camera's view.
+ * @param camera The camera.
+ */
+void apply_camera(const Camera& camera) {
+    set_camera_position(point_at(camera.x * CELL_SIZE, camera.y * CELL_SIZE));
+}
+
+/**
+ * @brief Returns the chunks the view overlaps, as one rectangle of cells.
+ *
+ * The rectangle only changes when the view crosses a chunk boundary, so
+ * lighting and rendering can keep their results between small camera moves.
+ *
+ * @param camera The camera.
+ * @param world_width The width of the world in cells.
+ * @param world_height The height of the world in cells.
+ * @return The active cells, clamped to the world.
+ */
+GridRect camera_active_rect(const Camera& camera, int world_width, int world_height) {
+    int x0 = static_cast<int>(std::floor(camera.x)) / WORLD_CHUNK_SIZE * WORLD_CHUNK_SIZE;
+    int y0 = static_cast<int>(std::floor(camera.y)) / WORLD_CHUNK_SIZE * WORLD_CHUNK_SIZE;
+    int x1 = (static_cast<int>(std::ceil(camera.x)) + camera.view_width + WORLD_CHUNK_SIZE - 1) / WORLD_CHUNK_SIZE * WORLD_CHUNK_SIZE;
+    int y1 = (static_cast<int>(std::ceil(camera.y)) + camera.view_height + WORLD_CHUNK_SIZE - 1) / WORLD_CHUNK_SIZE * WORLD_CHUNK_SIZE;
+    return {std::max(x0, 0), std::max(y0, 0), std::min(x1, world_width), std::min(y1, world_height)};
+}
@@ -0,0 +1,277 @@
+/**
+ * @file collision_grid.cpp
+ * @brief Implements the CollisionGrid host mirror and its segment queries.
+ *
+ * castRay walks the cells of the segment's Bresenham line, but first scans the
+ * segment's bounding rows a 64-bit word at a time; segments through open
+ * floor, the common case for bullets and player moves, are rejected without
+ * stepping through individual cells.
+ */
+
+#include "./include/types.h"
+#include <algorithm>
+
+CollisionGrid::CollisionGrid() : width(0), height(0), wordsPerRow(0), levelWidths(), levelHeights(), levelOffsets() {}
+
+/**
+ * @brief Copies the heights of a grid and builds the solid-cell mask and height pyramid.
+ * @param grid The grid to mirror.
+ */
+void CollisionGrid::initialize(const Grid& grid) {
+    width = grid.width;
+    height = grid.height;
+    wordsPerRow = (width + 63) / 64;
+    heights.assign(width * height, static_cast<uint8_t>(HeightLevel::FLOOR));
+    solidMask.assign(wordsPerRow * height, 0);
+    // setHeight leaves the pyramid alone while it is empty; it is built in one pass below.
+    pyramid.clear();
+
+    for (int y = 0; y < height; ++y) {
+        for (int x = 0; x < width; ++x) {
+            setHeight(x, y, grid.cells[y * width + x].height);
+        }
+    }
+
+    pyramid.assign(layoutPyramid(), 0);
+    for (int level = 1; level <= HEIGHT_PYRAMID_LEVELS; ++level) {
+        for (int by = 0; by < levelHeights[level]; ++by) {
+            for (int bx = 0; bx < levelWidths[level]; ++bx) {
+                updatePyramid(level, bx << level, by << level);
+            }
+        }
+    }
+}
+
+/**
+ * @brief Makes the grid all floor, ready for rectangles of heights to be loaded into it.
+ * @param gridWidth The width of the grid in cells.
+ * @param gridHeight The height of the grid in cells.
+ */
+void CollisionGrid::reset(int gridWidth, int gridHeight) {
+    width = gridWidth;
+    height = gridHeight;
+    wordsPerRow = (width + 63) / 64;
+    heights.assign(width * height, static_cast<uint8_t>(HeightLevel::FLOOR));
+    solidMask.assign(wordsPerRow * height, 0);
+    pyramid.assign(layoutPyramid(), static_cast<uint8_t>(HeightLevel::FLOOR));
+}
+
+/**
+ * @brief Copies the heights of a rectangle of cells, such as a level chunk, and updates its solid bits and pyramid blocks.
+ *
+ * @param source The heights of rect, row by row.
+ * @param pitch The distance between the rows of source, in bytes.
+ * @param rect The cells to overwrite, inside the grid.
+ */
+void CollisionGrid::loadRect(const uint8_t* source, int pitch, const GridRect& rect) {
+    for (int y = rect.y0; y < rect.y1; ++y) {
+        const uint8_t* row = source + static_cast<size_t>(y - rect.y0) * pitch;
+        std::copy(row, row + (rect.x1 - rect.x0), &heights[y * width + rect.x0]);
+        for (int x = rect.x0; x < rect.x1; ++x) {
+            uint64_t bit = uint64_t(1) << (x & 63);
+            uint64_t& word = solidMask[y * wordsPerRow + (x >> 6)];
+            word = row[x - rect.x0] > static_cast<uint8_t>(HeightLevel::FLOOR) ? word | bit : word & ~bit;
+        }
+    }
+    for (int level = 1; level <= HEIGHT_PYRAMID_LEVELS; ++level) {
+        for (int by = rect.y0 >> level; by <= (rect.y1 - 1) >> level; ++by) {
+            for (int bx = rect.x0 >> level; bx <= (rect.x1 - 1) >> level; ++bx) {
+                updatePyramid(level, bx << level, by << level);
+            }
+        }
+    }
+}
+
+/**
+ * @brief Works out the size and offset of every pyramid level for the current grid size.
+ * @return The number of bytes the pyramid needs.
+ */
+size_t CollisionGrid::layoutPyramid() {
+    levelWidths[0] = width;
+    levelHeights[0] = height;
+    size_t pyramidSize = 0;
+    for (int level = 1; level <= HEIGHT_PYRAMID_LEVELS; ++level) {
+        levelWidths[level] = (width + (1 << level) - 1) >> level;
+        levelHeights[level] = (height + (1 << level) - 1) >> level;
+        levelOffsets[level] = static_cast<int>(pyramidSize);
+        pyramidSize += levelWidths[level] * levelHeights[level];
+    }
+    return pyramidSize;
+}
+
+/**
+ * @brief Recomputes the block of one pyramid level that holds a cell, from the level below.
+ * @param level The level to update, 1..HEIGHT_PYRAMID_LEVELS.
+ * @param x The x-coordinate of a cell in the block.
+ * @param y The y-coordinate of a cell in the block.
+ */
+void CollisionGrid::updatePyramid(int level, int x, int y) {
+    int bx = x >> level;
+    int by = y >> level;
+    const uint8_t* below = level == 1 ? heights.data() : &pyramid[levelOffsets[level - 1]];
+    int belowWidth = levelWidths[level - 1];
+
+    uint8_t blockMax = 0;
+    for (int cy = 2 * by; cy < std::min(2 * by + 2, levelHeights[level - 1]); ++cy) {
+        for (int cx = 2 * bx; cx < std::min(2 * bx + 2, belowWidth); ++cx) {
+            blockMax = std::max(blockMax, below[cy * belowWidth + cx]);
+        }
+    }
+    pyramid[levelOffsets[level] + by * levelWidths[level] + bx] = blockMax;
+}
+
+/**
+ * @brief Sets the height of one cell and updates its solid bit and pyramid blocks.
+ * @param x The x-coordinate of the cell.
+ * @param y The y-coordinate of the cell.
+ * @param level The new height.
+ * @return True if the cell was inside the grid and its height changed.
+ */
+bool CollisionGrid::setHeight(int x, int y, HeightLevel level) {
+    if (x < 0 || x >= width || y < 0 || y >= height) {
+        return false;
+    }
+
+    uint8_t value = static_cast<uint8_t>(level);
+    int index = y * width + x;
+    if (heights[index] == value) {
+        return false;
+    }
+    heights[index] = value;
+
+    uint64_t bit = uint64_t(1) << (x & 63);
+    uint64_t& word = solidMask[y * wordsPerRow + (x >> 6)];
+    if (value > static_cast<uint8_t>(HeightLevel::FLOOR)) {
+        word |= bit;
+    } else {
+        word &= ~bit;
+    }
+
+    if (!pyramid.empty()) {
+        for (int level = 1; level <= HEIGHT_PYRAMID_LEVELS; ++level) {
+            updatePyramid(level, x, y);
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief Checks whether any cell in a row span is solid, a 64-bit word at a time.
+ * @param y The row to scan.
+ * @param x0 The first column of the span (inclusive).
+ * @param x1 The last column of the span (inclusive).
+ * @return True if a solid cell lies in the span.
+ */
+bool CollisionGrid::spanHasSolid(int y, int x0, int x1) const {
+    x0 = std::max(x0, 0);
+    x1 = std::min(x1, width - 1);
+    if (y < 0 || y >= height || x0 > x1) {
+        return false;
+    }
+
+    const uint64_t* row = &solidMask[y * wordsPerRow];
+    int firstWord = x0 >> 6;
+    int lastWord = x1 >> 6;
+    for (int w = firstWord; w <= lastWord; ++w) {
+        uint64_t word = row[w];
+        if (w == firstWord) word &= ~uint64_t(0) << (x0 & 63);
+        if (w == lastWord) word &= ~uint64_t(0) >> (63 - (x1 & 63));
+        if (word) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * @brief Copies the heights of a rectangle of cells, row by row.
+ * @param out Receives (x1 - x0) * (y1 - y0) heights.
+ * @param rect The cells to copy; must lie inside the grid.
+ */
+void CollisionGrid::readHeightRect(std::vector<uint8_t>& out, const GridRect& rect) const {
+    int rectWidth = rect.x1 - rect.x0;
+    out.resize(static_cast<size_t>(rectWidth) * (rect.y1 - rect.y0));
+    for (int y = rect.y0; y < rect.y1; ++y) {
+        std::copy_n(&heights[y * width + rect.x0], rectWidth, &out[(y - rect.y0) * rectWidth]);
+    }
+}
+
+/**
+ * @brief Finds the first solid cell along a segment.
+ * @param segment The segment to test, in grid coordinates.
+ * @return The hit, with the normal of the face the segment entered through.
+ */
+RayHit CollisionGrid::castRay(const RaySegment& segment) const {
+    float sx = static_cast<float>(segment.start.x);
+    float sy = static_cast<float>(segment.start.y);
+    float ex = static_cast<float>(segment.end.x);
+    float ey = static_cast<float>(segment.end.y);
+
+    float dx = std::fabs(ex - sx);
+    float dy = std::fabs(ey - sy);
+    int x = static_cast<int>(sx);
+    int y = static_cast<int>(sy);
+    int n = 1 + static_cast<int>(dx + dy);
+    int x_inc = (ex > sx) ? 1 : -1;
+    int y_inc = (ey > sy) ? 1 : -1;
+
+    float lx = ex - sx;
+    float ly = ey - sy;
+    RayHit miss = {false, {-1, -1}, -1, -1, {0, 0}, std::sqrt(lx * lx + ly * ly)};
+
+    // The walk takes at most ceil(dx) steps along x and ceil(dy) along y, so if
+    // the rows of that box hold no solid bits the whole segment is clear.
+    int reachX = static_cast<int>(std::ceil(dx)) + 1;
+    int reachY = static_cast<int>(std::ceil(dy)) + 1;
+    int minX = std::min(x, x + x_inc * reachX);
+    int maxX = std::max(x, x + x_inc * reachX);
+    int minY = std::max(std::min(y, y + y_inc * reachY), 0);
+    int maxY = std::min(std::max(y, y + y_inc * reachY), height - 1);
+    bool anySolid = false;
+    for (int row = minY; row <= maxY && !anySolid; ++row) {
+        anySolid = spanHasSolid(row, minX, maxX);
+    }
+    if (!anySolid) {
+        return miss;
+    }
+
+    float error = dx - dy;
+    Vector2D normal = (dx > dy) ? Vector2D{static_cast<double>(-x_inc), 0.0} : Vector2D{0.0, static_cast<double>(-y_inc)};
+    dx *= 2;
+    dy *= 2;
+
+    for (; n > 0; --n) {
+        if (x >= 0 && x < width && y >= 0 && y < height && isSolid(x, y)) {
+            float hx = static_cast<float>(x) - sx;
+            float hy = static_cast<float>(y) - sy;
+            return {true, {static_cast<double>(x), static_cast<double>(y)}, x, y, normal, std::sqrt(hx * hx + hy * hy)};
+        }
+
+        if (error > 0) {
+            x += x_inc;
+            error -= dy;
+            normal = {static_cast<double>(-x_inc), 0.0};
+        } else {
+            y += y_inc;
+            error += dx;
+            normal = {0.0, static_cast<double>(-y_inc)};
+        }
+    }
+
+    return miss;
+}
+
+/**
+ * @brief Builds a Grid holding the current heights.
+ * @return A grid the same size as the mirror.
+ */
+Grid CollisionGrid::toGrid() const {
+    Grid grid;
+    grid.width = width;
+    grid.height = height;
+    grid.cells.reserve(heights.size());
+    for (uint8_t value : heights) {
+        grid.cells.push_back({static_cast<HeightLevel>(value), 0});
+    }
+    return grid;
+}
@@ -0,0 +1,368 @@
+/**
+ * @file cpu_lighting.cpp
+ * @brief Implements the CPULightingEngine, a native port of lighting_kernels.cl.
+ *
+ * This file mirrors calculate_lighting and has_clear_path on the host so the
+ * game can run without an OpenCL GPU device; collision queries come from the
+ * shared CollisionGrid. Arithmetic follows the kernels (single precision after
+ * the same casts) so both backends produce the same light levels.
+ */
+
+#include "./include/types.h"
+#include <algorithm>
+#include <cstdlib>
+#include <iostream>
+
+namespace {
+    const int ROWS_PER_TASK = 4;
+
+    /**
+     * @brief Port of steps_to_leave_block in lighting_kernels.cl.
+     *
+     * Counts the steps, from the current cell, until a Bresenham walk leaves the
+     * block of the given size, and the x- and y-steps taken on the way.
+     */
+    int steps_to_leave_block(int x, int y, int x_inc, int y_inc, int error, int dx2, int dy2, int size,
+                             int& x_steps, int& y_steps) {
+        const int never = 0x3fffffff;
+        int ax = x_inc > 0 ? size - (x & (size - 1)) : (x & (size - 1)) + 1;
+        int ay = y_inc > 0 ? size - (y & (size - 1)) : (y & (size - 1)) + 1;
+
+        int need = (ax - 1) * dy2 - error;
+        int by_x = need < 0 ? 0 : (dx2 == 0 ? never : need / dx2 + 1);
+        need = error + (ay - 1) * dx2;
+        int bx_y = need <= 0 ? 0 : (dy2 == 0 ? never : (need + dy2 - 1) / dy2);
+
+        if (by_x == never && bx_y == never) {
+            x_steps = 0;
+            y_steps = 0;
+            return never;
+        }
+        if (bx_y == never || (by_x != never && ax + by_x < bx_y + ay)) {
+            x_steps = ax;
+            y_steps = by_x;
+            return ax + by_x;
+        }
+        x_steps = bx_y;
+        y_steps = ay;
+        return bx_y + ay;
+    }
+}
+
+/**
+ * @brief Constructs the engine and starts its worker threads.
+ * @param threadCount Number of threads to use; 0 uses the hardware concurrency.
+ */
+CPULightingEngine::CPULightingEngine(unsigned int threadCount) : workerPool(threadCount) {}
+
+/**
+ * @brief Reports the engine in use; the CPU engine has no device to set up.
+ */
+void CPULightingEngine::initialize() {
+    std::cout << "Using device: " << getName() << std::endl;
+}
+
+/**
+ * @brief Sets up the host grid. The engine reads heights straight from the CollisionGrid.
+ * @param initialGrid The initial grid state.
+ */
+void CPULightingEngine::initializeGrid(const Grid& initialGrid) {
+    initializeHostGrid(initialGrid);
+    staticLevels.assign(gridWidth * gridHeight, 0);
+    lightLevels.assign(gridWidth * gridHeight, 0);
+}
+
+/**
+ * @brief Sets up the host grid to stream from a level file.
+ * @param level The level; it must stay open while the engine uses it.
+ */
+void CPULightingEngine::initializeLevel(const LevelFile& level) {
+    initializeHostLevel(level);
+    staticLevels.assign(gridWidth * gridHeight, 0);
+    lightLevels.assign(gridWidth * gridHeight, 0);
+}
+
+/**
+ * @brief Calculates lighting on the worker threads.
+ *
+ * Static lights are baked into staticLevels, which is only rebuilt in the
+ * regions collectLightingRegions reports for it. The dynamic lights and the
+ * torch are then evaluated on top of that layer, over the whole grid unless
+ * incremental mode is on, in which case only the dirty regions are.
+ *
+ * @param lights The radial lights in the scene.
+ * @param torch The player's torch.
+ * @param torch_on Whether the torch is turned on.
+ */
+void CPULightingEngine::calculateLighting(const std::vector<RadialLight>& lights, const Torch& torch, bool torch_on) {
+    std::vector<GridRect> regions = collectLightingRegions(lights, torch, torch_on);
+    calculatePass(staticRegions, staticLights, torch, false, nullptr, staticLevels);
+    calculatePass(regions, dynamicLights, torch, torch_on, &staticLevels, lightLevels);
+}
+
+/**
+ * @brief Computes one layer over a set of regions, each split into bands of rows.
+ *
+ * The pass's lights are binned over the active rectangle first, and in
+ * shadow-map mode their profiles are built.
+ *
+ * @param regions The cells to compute.
+ * @param lights The radial lights to evaluate.
+ * @param torch The player's torch.
+ * @param torch_on Whether the torch is evaluated.
+ * @param baseLevels Levels to start each cell from, or null to start from darkness.
+ * @param levels Receives the computed levels.
+ */
+void CPULightingEngine::calculatePass(const std::vector<GridRect>& regions, const std::vector<RadialLight>& lights, const Torch& torch, bool torch_on,
+                                      const std::vector<uint8_t>* baseLevels, std::vector<uint8_t>& levels) {
+    std::vector<GridRect> bands;
+    for (const auto& region : regions) {
+        for (int y = region.y0; y < region.y1; y += ROWS_PER_TASK) {
+            bands.push_back({region.x0, y, region.x1, std::min(y + ROWS_PER_TASK, region.y1)});
+        }
+    }
+
+    if (bands.empty()) {
+        return;
+    }
+    lightBins.build(lights, torch, torch_on, activeRect);
+    pack_lights(lights, packedLights);
+    PackedTorch packedTorch = pack_torch(torch);
+    if (options.occlusion == OcclusionMode::SHADOW_MAP) {
+        shadowMap.layout(lights, torch, torch_on);
+        shadowMap.build(collisionGrid, workerPool);
+    }
+
+    workerPool.parallelFor(0, static_cast<int>(bands.size()), 1, [&](int begin, int end) {
+        for (int i = begin; i < end; ++i) {
+            calculateRegion(bands[i], packedLights, packedTorch, torch_on, baseLevels, levels);
+        }
+    });
+}
+
+/**
+ * @brief Computes the radial and torch light levels for a rectangle of cells.
+ *
+ * Each row is walked tile by tile, and only the lights binned to a tile are
+ * evaluated over its cells, and the torch only over the cells it can reach.
+ * Each light first fills a per-row scratch array
+ * with distances and ellipse factors in a straight loop; the occlusion test
+ * then only runs on cells that can still raise the cell's light level.
+ *
+ * @param region The cells to compute.
+ * @param lights The radial lights to evaluate, packed as for the device.
+ * @param torch The player's torch, packed as for the device.
+ * @param torch_on Whether the torch is evaluated.
+ * @param baseLevels Levels to start each cell from, or null to start from darkness.
+ * @param levels Receives the computed levels.
+ */
+void CPULightingEngine::calculateRegion(const GridRect& region, const std::vector<PackedLight>& lights, const PackedTorch& torch, bool torch_on,
+                                        const std::vector<uint8_t>* baseLevels, std::vector<uint8_t>& levels) {
+    const int x0 = region.x0;
+    const int span = region.x1 - region.x0;
+    std::vector<float> distanceSquared(span);
+    std::vector<float> ellipseFactor(span);
+    std::vector<float> rotatedX(span);
+    std::vector<float> rotatedY(span);
+
+    const float current_radius = torch.radius;
+    const float max_torch_radius = current_radius * 2.0f;
+    const float direction_x = torch.direction_x;
+    const float direction_y = torch.direction_y;
+    const float ellipse_distance = current_radius * 1.2f;
+    const float ellipse_width = current_radius * 1.2f;
+    const float ellipse_height = current_radius * 0.8f;
+    const float max_angle = std::atan2(ellipse_height / 2, ellipse_distance) + 0.05f;
+    const int32_t* offsets = lightBins.getOffsets().data();
+    const int32_t* indices = lightBins.getIndices().data();
+
+    for (int y = region.y0; y < region.y1; ++y) {
+        const uint8_t* heights = &collisionGrid.getHeights()[y * gridWidth + x0];
+        uint8_t* row = &levels[y * gridWidth + x0];
+        if (baseLevels) {
+            std::copy_n(&(*baseLevels)[y * gridWidth + x0], span, row);
+        } else {
+            std::fill(row, row + span, 0);
+        }
+
+        for (int tile_x0 = x0; tile_x0 < region.x1; tile_x0 = (tile_x0 / LIGHT_TILE_SIZE + 1) * LIGHT_TILE_SIZE) {
+            const int first = tile_x0 - x0;
+            const int last = std::min((tile_x0 / LIGHT_TILE_SIZE + 1) * LIGHT_TILE_SIZE, region.x1) - x0;
+            const int bin = lightBins.getBin(tile_x0, y);
+            for (int k = offsets[bin]; k < offsets[bin + 1]; ++k) {
+                const int l = indices[k];
+                const PackedLight& light = lights[l];
+                const float dy = static_cast<float>(y) - light.y;
+
+                for (int i = first; i < last; ++i) {
+                    const float dx = static_cast<float>(x0 + i) - light.x;
+                    distanceSquared[i] = dx * dx + dy * dy;
+                }
+
+                for (int i = first; i < last; ++i) {
+                    if (distanceSquared[i] > light.radius_squared || row[i] >= light.level) {
+                        continue;
+                    }
+                    if (isVisible(l, x0 + i, y, heights[i], light.cell_x, light.cell_y, light.height)) {
+                        row[i] = static_cast<uint8_t>(light.level);
+                    }
+                }
+            }
+        }
+
+        // Only the columns of the torch's reach can pass its distance test.
+        const GridRect& reach = lightBins.getTorchReach();
+        if (!torch_on || y < reach.y0 || y >= reach.y1) {
+            continue;
+        }
+        const int torch_first = std::max(reach.x0 - x0, 0);
+        const int torch_last = std::min(reach.x1 - x0, span);
+
+        const float dy = static_cast<float>(y) - torch.y;
+        for (int i = torch_first; i < torch_last; ++i) {
+            const float dx = static_cast<float>(x0 + i) - torch.x;
+            const float rotated_dx = dx * direction_x + dy * direction_y;
+            const float rotated_dy = -dx * direction_y + dy * direction_x;
+            const float ex = rotated_dx - ellipse_distance;
+            rotatedX[i] = rotated_dx;
+            rotatedY[i] = rotated_dy;
+            distanceSquared[i] = dx * dx + dy * dy;
+            ellipseFactor[i] = ex * ex / ((ellipse_width / 2) * (ellipse_width / 2))
+                             + rotated_dy * rotated_dy / ((ellipse_height / 2) * (ellipse_height / 2));
+        }
+
+        for (int i = torch_first; i < torch_last; ++i) {
+            if (distanceSquared[i] > max_torch_radius * max_torch_radius || row[i] >= LIGHT_LEVELS) {
+                continue;
+            }
+
+            const float rotated_dx = rotatedX[i];
+            const float rotated_dy = rotatedY[i];
+            int torch_light_level = 0;
+            bool is_lit = false;
+
+            if (ellipseFactor[i] <= 1.1f) {
+                torch_light_level = LIGHT_LEVELS;
+                is_lit = true;
+            } else if (std::sqrt(distanceSquared[i]) <= current_radius && rotated_dx >= 0) {
+                float angle = std::atan2(std::fabs(rotated_dy), rotated_dx);
+                if (angle <= max_angle) {
+                    torch_light_level = heights[i] <= static_cast<int>(HeightLevel::PLAYER) ? LIGHT_LEVELS / 2 : LIGHT_LEVELS;
+                    is_lit = true;
+                }
+            }
+
+            if (is_lit && torch_light_level > row[i] &&
+                isVisible(static_cast<int>(lights.size()), x0 + i, y, heights[i], torch.cell_x, torch.cell_y, static_cast<int>(HeightLevel::TORCH))) {
+                row[i] = static_cast<uint8_t>(torch_light_level);
+            }
+        }
+    }
+}
+
+/**
+ * @brief Tests whether a cell can see a light using the current occlusion mode.
+ * @param source Index of the light's shadow profile; the torch follows the radial lights.
+ */
+bool CPULightingEngine::isVisible(int source, int x1, int y1, int z1, int x2, int y2, int z2) const {
+    if (options.occlusion == OcclusionMode::SHADOW_MAP) {
+        return shadowMap.isLit(source, x1, y1, z1);
+    }
+    return hasClearPath(x1, y1, z1, x2, y2, z2);
+}
+
+/**
+ * @brief Walks the grid between two points and checks that no cell rises above the line of sight.
+ *
+ * Port of has_clear_path in lighting_kernels.cl, including the skips over
+ * blocks of the CollisionGrid's max-height pyramid.
+ */
+bool CPULightingEngine::hasClearPath(int x1, int y1, int z1, int x2, int y2, int z2) const {
+    int dx = std::abs(x2 - x1);
+    int dy = std::abs(y2 - y1);
+    int dz = z2 - z1;
+    int x = x1;
+    int y = y1;
+    float z_start = static_cast<float>(z1) + 0.1f;
+    int n = 1 + dx + dy;
+    int x_inc = (x2 > x1) ? 1 : -1;
+    int y_inc = (y2 > y1) ? 1 : -1;
+    float z_inc = static_cast<float>(dz) / n;
+    int error = dx - dy;
+    dx *= 2;
+    dy *= 2;
+
+    int i = 0;
+    while (i < n) {
+        if (x >= 0 && x < gridWidth && y >= 0 && y < gridHeight) {
+            float z = z_start + static_cast<float>(i) * z_inc;
+            int skip = 0;
+            int skip_x = 0;
+            int skip_y = 0;
+            for (int level = 1; level <= HEIGHT_PYRAMID_LEVELS; ++level) {
+                int x_steps, y_steps;
+                int steps = steps_to_leave_block(x, y, x_inc, y_inc, error, dx, dy, 1 << level, x_steps, y_steps);
+                float z_low = z_inc >= 0.0f ? z : z_start + static_cast<float>(std::min(i + steps, n) - 1) * z_inc;
+                if (z_low < collisionGrid.getBlockMax(level, x, y)) {
+                    break;
+                }
+                skip = steps;
+                skip_x = x_steps;
+                skip_y = y_steps;
+            }
+
+            if (skip > 0) {
+                if (skip >= n - i) {
+                    return true;
+                }
+                x += skip_x * x_inc;
+                y += skip_y * y_inc;
+                error += skip_y * dx - skip_x * dy;
+                i += skip;
+                continue;
+            }
+            if (z < collisionGrid.getHeightAt(x, y)) {
+                return false;
+            }
+        }
+
+        if (error > 0) {
+            x += x_inc;
+            error -= dy;
+        } else {
+            y += y_inc;
+            error += dx;
+        }
+        ++i;
+    }
+
+    return true;
+}
+
+/**
+ * @brief Reads the current light levels.
+ * @param levels Vector to store the light levels.
+ */
+void CPULightingEngine::readLightLevels(std::vector<uint8_t>& levels) const {
+    levels = lightLevels;
+}
+
+/**
+ * @brief Copies the light levels of a rectangle of cells.
+ * @param levels Receives the levels of rect, row by row.
+ * @param rect The cells to read.
+ */
+void CPULightingEngine::readLightLevelRect(std::vector<uint8_t>& levels, const GridRect& rect) const {
+    int width = rect.x1 - rect.x0;
+    levels.resize(width * (rect.y1 - rect.y0));
+    for (int y = rect.y0; y < rect.y1; ++y) {
+        std::copy_n(&lightLevels[y * gridWidth + rect.x0], width, &levels[(y - rect.y0) * width]);
+    }
+}
+
+/**
+ * @brief Describes the engine and its thread count.
+ */
+std::string CPULightingEngine::getName() const {
+    return "CPU (" + std::to_string(workerPool.getThreadCount()) + " threads)";
+}
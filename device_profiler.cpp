@@ -0,0 +1,208 @@
+/**
+ * @file device_profiler.cpp
+ * @brief Implements the DeviceProfiler and its CSV and trace output.
+ */
+
+#include "./include/types.h"
+#include <algorithm>
+#include <stdexcept>
+
+namespace {
+    /**
+     * @brief Adds a command to the summary of its name.
+     */
+    void add_to_summary(std::vector<DeviceCommandSummary>& summaries, const DeviceCommandRecord& record) {
+        auto it = std::find_if(summaries.begin(), summaries.end(), [&](const DeviceCommandSummary& s) { return s.name == record.name; });
+        if (it == summaries.end()) {
+            summaries.push_back({record.name, record.kind});
+            it = summaries.end() - 1;
+        }
+        ++it->count;
+        it->device_ms += (record.ended - record.started) * 1e-6;
+        it->waiting_ms += (record.started - record.queued) * 1e-6;
+        it->bytes += record.bytes;
+    }
+
+    /**
+     * @brief Writes a string as a JSON string literal.
+     */
+    void write_json_string(std::ostream& out, const std::string& text) {
+        out << '"';
+        for (char c : text) {
+            if (c == '"' || c == '\\') {
+                out << '\\';
+            }
+            out << c;
+        }
+        out << '"';
+    }
+}
+
+/**
+ * @brief Names a command kind for the CSV and trace output.
+ */
+const char* device_command_kind_name(DeviceCommandKind kind) {
+    switch (kind) {
+        case DeviceCommandKind::KERNEL: return "kernel";
+        case DeviceCommandKind::WRITE: return "write";
+        case DeviceCommandKind::READ: return "read";
+        case DeviceCommandKind::COPY: return "copy";
+    }
+    return "unknown";
+}
+
+/**
+ * @brief Starts tracking a command about to be enqueued.
+ *
+ * @param name What the command is, such as the kernel name.
+ * @param kind The kind of command.
+ * @param queue Which queue it goes to.
+ * @param bytes The bytes it moves between host and device or between buffers.
+ * @return The event to pass to the enqueue call, or null when profiling is off.
+ */
+cl::Event* DeviceProfiler::record(const char* name, DeviceCommandKind kind, int queue, size_t bytes) {
+    if (!enabled) {
+        return nullptr;
+    }
+    pending.push_back({{name, kind, queue, frame, bytes, 0, 0, 0, 0}, cl::Event()});
+    return &pending.back().event;
+}
+
+/**
+ * @brief Starts a new frame and resolves the commands of the frame before last.
+ *
+ * By then the device has finished them, so waiting on their events is free.
+ */
+void DeviceProfiler::beginFrame() {
+    ++frame;
+    resolveBefore(frame - 1);
+}
+
+/**
+ * @brief Waits for every recorded command and resolves it, ending the current frame.
+ */
+void DeviceProfiler::finish() {
+    resolveBefore(frame + 1);
+    ++frame;
+}
+
+/**
+ * @brief Restarts the run totals from the current frame, such as after a warmup.
+ */
+void DeviceProfiler::clearTotals() {
+    totals.clear();
+    totalsFrom = frame;
+}
+
+/**
+ * @brief Reads the timestamps of every command recorded before a frame.
+ *
+ * The last of those frames becomes the one reported by getLastFrame.
+ *
+ * @param frameLimit The first frame to leave pending.
+ */
+void DeviceProfiler::resolveBefore(long frameLimit) {
+    if (frameLimit <= resolvedFrames) {
+        return;
+    }
+
+    std::vector<DeviceCommandSummary> frameSummary;
+    while (!pending.empty() && pending.front().record.frame < frameLimit) {
+        PendingCommand& command = pending.front();
+        DeviceCommandRecord& record = command.record;
+        if (command.event() == nullptr) {
+            // The enqueue call failed, so the command never ran.
+            pending.pop_front();
+            continue;
+        }
+        command.event.wait();
+        record.queued = command.event.getProfilingInfo<CL_PROFILING_COMMAND_QUEUED>();
+        record.submitted = command.event.getProfilingInfo<CL_PROFILING_COMMAND_SUBMIT>();
+        record.started = command.event.getProfilingInfo<CL_PROFILING_COMMAND_START>();
+        record.ended = command.event.getProfilingInfo<CL_PROFILING_COMMAND_END>();
+
+        if (record.frame == frameLimit - 1) {
+            add_to_summary(frameSummary, record);
+        }
+        if (record.frame >= totalsFrom) {
+            add_to_summary(totals, record);
+        }
+        if (traceFile.is_open()) {
+            writeRecord(record);
+        }
+        pending.pop_front();
+    }
+    lastFrame = frameSummary;
+    resolvedFrames = frameLimit;
+}
+
+/**
+ * @brief Starts writing every command resolved from now on to a file.
+ *
+ * A path ending in .csv gets one CSV row per command; anything else gets the
+ * Trace Event JSON format, where each queue is a thread of one process and
+ * each command a complete event spanning its execution, with the time it
+ * spent queued in its arguments. Times are in microseconds from the first
+ * command.
+ *
+ * @param path The file to write.
+ * @throws std::runtime_error If the file cannot be opened.
+ */
+void DeviceProfiler::openTrace(const std::string& path) {
+    closeTrace();
+    traceFile.open(path);
+    if (!traceFile.is_open()) {
+        throw std::runtime_error("Failed to open device profile file: " + path);
+    }
+    traceCsv = path.size() >= 4 && path.compare(path.size() - 4, 4, ".csv") == 0;
+    tracedCommands = 0;
+    tracedQueues = 0;
+    traceFile << (traceCsv ? "frame,name,kind,queue,bytes,queued_ns,submit_ns,start_ns,end_ns\n" : "{\"traceEvents\":[");
+}
+
+/**
+ * @brief Resolves every recorded command, writes it and closes the trace file.
+ */
+void DeviceProfiler::closeTrace() {
+    if (!traceFile.is_open()) {
+        return;
+    }
+    finish();
+    if (!traceCsv) {
+        traceFile << "\n]}\n";
+    }
+    traceFile.close();
+}
+
+/**
+ * @brief Appends one resolved command to the trace file.
+ */
+void DeviceProfiler::writeRecord(const DeviceCommandRecord& record) {
+    if (traceCsv) {
+        traceFile << record.frame << ',' << record.name << ',' << device_command_kind_name(record.kind) << ',' << record.queue << ','
+                  << record.bytes << ',' << record.queued << ',' << record.submitted << ',' << record.started << ',' << record.ended << '\n';
+        return;
+    }
+
+    if (tracedCommands == 0) {
+        traceOrigin = record.queued;
+    }
+    for (; tracedQueues <= record.queue; ++tracedQueues) {
+        int q = tracedQueues;
+        std::string name = q == 0 ? "main queue" : q == 1 ? "transfer queue" : "band queue " + std::to_string(q - 1);
+        traceFile << (tracedCommands > 0 || q > 0 ? ",\n" : "\n") << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << q
+                  << ",\"args\":{\"name\":";
+        write_json_string(traceFile, name);
+        traceFile << "}}";
+    }
+    // Band queues may run on other devices, whose clocks can start before the first command's.
+    double start_us = (static_cast<double>(record.started) - static_cast<double>(traceOrigin)) * 1e-3;
+    traceFile << ",\n{\"name\":";
+    write_json_string(traceFile, record.name);
+    traceFile << ",\"cat\":\"" << device_command_kind_name(record.kind) << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << record.queue
+              << ",\"ts\":" << start_us << ",\"dur\":" << (record.ended - record.started) * 1e-3
+              << ",\"args\":{\"frame\":" << record.frame << ",\"bytes\":" << record.bytes
+              << ",\"queued_us\":" << (record.started - record.queued) * 1e-3
+              << ",\"submit_us\":" << (record.started - record.submitted) * 1e-3 << "}}";
+    ++tracedCommands;
+}
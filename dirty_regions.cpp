@@ -0,0 +1,251 @@
+/**
+ * @file dirty_regions.cpp
+ * @brief Implements the LightingDirtyTracker used by incremental lighting.
+ *
+ * A light contributes to a cell only through the radius test (which uses its
+ * exact position) and the occlusion test (which uses its integer cell, its
+ * height and the heights along the ray). The tracker marks tiles so that
+ * every cell whose result could change is recomputed:
+ *  - a light that changed cell, height or intensity dirties its old and new discs;
+ *  - a light that only moved within its cell or changed radius dirties the
+ *    ring where the two circles can disagree;
+ *  - the torch dirties its old and new reach whenever any of its inputs change;
+ *  - a changed cell dirties its own tile and the discs of the lights that reach it.
+ */
+
+#include "./include/types.h"
+#include <algorithm>
+#include <cmath>
+
+LightingDirtyTracker::LightingDirtyTracker()
+        : width(0), height(0), tilesX(0), tilesY(0), previousTorch({0, 0, 0, 0, 0, false}) {}
+
+/**
+ * @brief Sizes the tracker for a grid and marks every tile dirty.
+ * @param gridWidth The width of the grid in cells.
+ * @param gridHeight The height of the grid in cells.
+ */
+void LightingDirtyTracker::reset(int gridWidth, int gridHeight) {
+    width = gridWidth;
+    height = gridHeight;
+    tilesX = (width + LIGHT_TILE_SIZE - 1) / LIGHT_TILE_SIZE;
+    tilesY = (height + LIGHT_TILE_SIZE - 1) / LIGHT_TILE_SIZE;
+    dirtyTiles.assign(tilesX * tilesY, 1);
+    previousLights.clear();
+    previousTorch = {0, 0, 0, 0, 0, false};
+}
+
+/**
+ * @brief Forces the next pass to recompute the whole grid.
+ */
+void LightingDirtyTracker::markAll() {
+    std::fill(dirtyTiles.begin(), dirtyTiles.end(), 1);
+}
+
+/**
+ * @brief Marks the tiles that overlap a rectangle of cells.
+ * @param rect The cells to mark, clamped to the grid.
+ */
+void LightingDirtyTracker::markRect(const GridRect& rect) {
+    if (rect.x0 >= rect.x1 || rect.y0 >= rect.y1) {
+        return;
+    }
+    int txEnd = std::min(tilesX, (std::min(rect.x1, width) + LIGHT_TILE_SIZE - 1) / LIGHT_TILE_SIZE);
+    int tyEnd = std::min(tilesY, (std::min(rect.y1, height) + LIGHT_TILE_SIZE - 1) / LIGHT_TILE_SIZE);
+    for (int ty = std::max(rect.y0, 0) / LIGHT_TILE_SIZE; ty < tyEnd; ++ty) {
+        for (int tx = std::max(rect.x0, 0) / LIGHT_TILE_SIZE; tx < txEnd; ++tx) {
+            dirtyTiles[ty * tilesX + tx] = 1;
+        }
+    }
+}
+
+LightingDirtyTracker::LightState LightingDirtyTracker::captureLight(const RadialLight& light) {
+    return {light.position.x, light.position.y, light.radius, light.intensity, light.height};
+}
+
+LightingDirtyTracker::TorchState LightingDirtyTracker::captureTorch(const Torch& torch, bool torch_on) {
+    return {torch.position.x, torch.position.y, torch.direction.x, torch.direction.y, torch.current_radius, torch_on};
+}
+
+/**
+ * @brief Marks the tiles that intersect a disc.
+ */
+void LightingDirtyTracker::markDisc(double cx, double cy, double radius) {
+    markRing(cx, cy, -1.0, radius);
+}
+
+/**
+ * @brief Marks the tiles that hold cells at a distance between innerRadius and outerRadius from (cx, cy).
+ *
+ * One cell of slack is added on both sides to cover single-precision rounding in the kernels.
+ */
+void LightingDirtyTracker::markRing(double cx, double cy, double innerRadius, double outerRadius) {
+    double reach = outerRadius + 1.0;
+    int txBegin = std::max(0, static_cast<int>(std::floor(cx - reach)) / LIGHT_TILE_SIZE);
+    int txEnd = std::min(tilesX - 1, std::max(0, static_cast<int>(std::ceil(cx + reach))) / LIGHT_TILE_SIZE);
+    int tyBegin = std::max(0, static_cast<int>(std::floor(cy - reach)) / LIGHT_TILE_SIZE);
+    int tyEnd = std::min(tilesY - 1, std::max(0, static_cast<int>(std::ceil(cy + reach))) / LIGHT_TILE_SIZE);
+
+    for (int ty = tyBegin; ty <= tyEnd; ++ty) {
+        double y0 = ty * LIGHT_TILE_SIZE;
+        double y1 = std::min((ty + 1) * LIGHT_TILE_SIZE, height) - 1;
+        double nearY = std::max({y0 - cy, 0.0, cy - y1});
+        double farY = std::max(std::fabs(y0 - cy), std::fabs(y1 - cy));
+
+        for (int tx = txBegin; tx <= txEnd; ++tx) {
+            double x0 = tx * LIGHT_TILE_SIZE;
+            double x1 = std::min((tx + 1) * LIGHT_TILE_SIZE, width) - 1;
+            double nearX = std::max({x0 - cx, 0.0, cx - x1});
+            double farX = std::max(std::fabs(x0 - cx), std::fabs(x1 - cx));
+
+            double nearest = std::sqrt(nearX * nearX + nearY * nearY);
+            double farthest = std::sqrt(farX * farX + farY * farY);
+            if (nearest <= outerRadius + 1.0 && farthest >= innerRadius - 1.0) {
+                dirtyTiles[ty * tilesX + tx] = 1;
+            }
+        }
+    }
+}
+
+/**
+ * @brief Marks the tiles affected by one light changing between frames.
+ */
+void LightingDirtyTracker::markLightChange(const LightState& before, const LightState& after) {
+    if (before.x == after.x && before.y == after.y && before.radius == after.radius &&
+        before.intensity == after.intensity && before.height == after.height) {
+        return;
+    }
+
+    bool sameCell = static_cast<int>(before.x) == static_cast<int>(after.x) &&
+                    static_cast<int>(before.y) == static_cast<int>(after.y);
+    bool sameLevel = static_cast<int>(before.intensity) == static_cast<int>(after.intensity);
+    if (sameCell && sameLevel && before.height == after.height) {
+        // Occlusion is unchanged; only cells near the circle's edge can flip.
+        double shift = std::hypot(after.x - before.x, after.y - before.y);
+        markRing(after.x, after.y,
+                 std::min(before.radius, after.radius) - shift,
+                 std::max(before.radius, after.radius) + shift);
+        return;
+    }
+
+    markDisc(before.x, before.y, before.radius);
+    markDisc(after.x, after.y, after.radius);
+}
+
+/**
+ * @brief Compares this frame's inputs against the previous frame and marks dirty tiles.
+ * @param lights The radial lights in the scene.
+ * @param torch The player's torch.
+ * @param torch_on Whether the torch is turned on.
+ * @param changedCells Cells whose height changed since the previous frame.
+ */
+void LightingDirtyTracker::update(const std::vector<RadialLight>& lights, const Torch& torch, bool torch_on,
+                                  const std::vector<std::pair<int, int>>& changedCells) {
+    std::vector<LightState> currentLights;
+    currentLights.reserve(lights.size());
+    for (const auto& light : lights) {
+        currentLights.push_back(captureLight(light));
+    }
+
+    size_t count = std::max(previousLights.size(), currentLights.size());
+    for (size_t i = 0; i < count; ++i) {
+        if (i >= currentLights.size()) {
+            markDisc(previousLights[i].x, previousLights[i].y, previousLights[i].radius);
+        } else if (i >= previousLights.size()) {
+            markDisc(currentLights[i].x, currentLights[i].y, currentLights[i].radius);
+        } else {
+            markLightChange(previousLights[i], currentLights[i]);
+        }
+    }
+
+    TorchState currentTorch = captureTorch(torch, torch_on);
+    bool torchChanged = currentTorch.on != previousTorch.on ||
+                        (currentTorch.on && (currentTorch.x != previousTorch.x || currentTorch.y != previousTorch.y ||
+                                             currentTorch.direction_x != previousTorch.direction_x ||
+                                             currentTorch.direction_y != previousTorch.direction_y ||
+                                             currentTorch.radius != previousTorch.radius));
+    if (torchChanged) {
+        if (previousTorch.on) markDisc(previousTorch.x, previousTorch.y, torchReach(previousTorch));
+        if (currentTorch.on) markDisc(currentTorch.x, currentTorch.y, torchReach(currentTorch));
+    }
+
+    if (!changedCells.empty()) {
+        std::vector<uint8_t> lightMarked(currentLights.size(), 0);
+        bool torchMarked = !currentTorch.on;
+        for (const auto& cell : changedCells) {
+            if (cell.first < 0 || cell.first >= width || cell.second < 0 || cell.second >= height) {
+                continue;
+            }
+            dirtyTiles[(cell.second / LIGHT_TILE_SIZE) * tilesX + cell.first / LIGHT_TILE_SIZE] = 1;
+
+            for (size_t i = 0; i < currentLights.size(); ++i) {
+                const LightState& light = currentLights[i];
+                if (!lightMarked[i] && std::hypot(cell.first - light.x, cell.second - light.y) <= light.radius + 1.0) {
+                    markDisc(light.x, light.y, light.radius);
+                    lightMarked[i] = 1;
+                }
+            }
+            if (!torchMarked && std::hypot(cell.first - currentTorch.x, cell.second - currentTorch.y) <= torchReach(currentTorch) + 1.0) {
+                markDisc(currentTorch.x, currentTorch.y, torchReach(currentTorch));
+                torchMarked = true;
+            }
+        }
+    }
+
+    previousLights = std::move(currentLights);
+    previousTorch = currentTorch;
+}
+
+/**
+ * @brief Merges the dirty tiles into rectangles and clears them.
+ *
+ * Runs of dirty tiles in a tile row become one rectangle, and rectangles with
+ * the same columns in consecutive tile rows are joined.
+ *
+ * @return Rectangles in cell coordinates, clamped to the grid.
+ */
+std::vector<GridRect> LightingDirtyTracker::takeDirtyRects() {
+    std::vector<GridRect> rects;
+    std::vector<size_t> openRects;
+
+    for (int ty = 0; ty < tilesY; ++ty) {
+        std::vector<size_t> rowRects;
+        int tx = 0;
+        while (tx < tilesX) {
+            if (!dirtyTiles[ty * tilesX + tx]) {
+                ++tx;
+                continue;
+            }
+            int runStart = tx;
+            while (tx < tilesX && dirtyTiles[ty * tilesX + tx]) {
+                dirtyTiles[ty * tilesX + tx] = 0;
+                ++tx;
+            }
+
+            int x0 = runStart * LIGHT_TILE_SIZE;
+            int x1 = std::min(tx * LIGHT_TILE_SIZE, width);
+            int y1 = std::min((ty + 1) * LIGHT_TILE_SIZE, height);
+
+            auto above = std::find_if(openRects.begin(), openRects.end(), [&](size_t index) {
+                return rects[index].x0 == x0 && rects[index].x1 == x1;
+            });
+            if (above != openRects.end()) {
+                rects[*above].y1 = y1;
+                rowRects.push_back(*above);
+            } else {
+                rects.push_back({x0, ty * LIGHT_TILE_SIZE, x1, y1});
+                rowRects.push_back(rects.size() - 1);
+            }
+        }
+        openRects = std::move(rowRects);
+    }
+
+    return rects;
+}
+
+/**
+ * @brief Counts the tiles currently marked dirty.
+ */
+int LightingDirtyTracker::getDirtyTileCount() const {
+    return static_cast<int>(std::count(dirtyTiles.begin(), dirtyTiles.end(), 1));
+}
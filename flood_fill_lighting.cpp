@@ -0,0 +1,171 @@
+/**
+ * @file flood_fill_lighting.cpp
+ * @brief Implements the FloodFillLightingEngine.
+ *
+ * The engine keeps one level per cell for the whole grid. Each pass lets the
+ * LightPropagation catch up with the lights and the terrain, copies the
+ * levels of the cells it touched, restores the cells the torch lit last
+ * frame and lays the torch on top again. The active rectangle is not needed:
+ * a pass already only touches the cells whose light can have changed.
+ */
+
+#include "./include/types.h"
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+
+/**
+ * @brief Reports the engine in use; the engine has no device to set up.
+ */
+void FloodFillLightingEngine::initialize() {
+    std::cout << "Using device: " << getName() << std::endl;
+}
+
+/**
+ * @brief Sets up the host grid and empty light fields.
+ * @param initialGrid The initial grid state.
+ */
+void FloodFillLightingEngine::initializeGrid(const Grid& initialGrid) {
+    initializeHostGrid(initialGrid);
+    propagation.reset(gridWidth, gridHeight, LIGHT_LEVELS);
+    lightLevels.assign(gridWidth * gridHeight, 0);
+    torchRect = {0, 0, 0, 0};
+}
+
+/**
+ * @brief Sets up the host grid to stream from a level file, with empty light fields.
+ * @param level The level; it must stay open while the engine uses it.
+ */
+void FloodFillLightingEngine::initializeLevel(const LevelFile& level) {
+    initializeHostLevel(level);
+    propagation.reset(gridWidth, gridHeight, LIGHT_LEVELS);
+    lightLevels.assign(gridWidth * gridHeight, 0);
+    torchRect = {0, 0, 0, 0};
+}
+
+/**
+ * @brief Queues the solid cells of a newly loaded chunk as changed, so light is re-spread around them.
+ * @param rect The cells of the chunk.
+ */
+void FloodFillLightingEngine::uploadLevelChunk(const GridRect& rect, const uint8_t*) {
+    for (int y = rect.y0; y < rect.y1; ++y) {
+        for (int x = rect.x0; x < rect.x1; ++x) {
+            if (collisionGrid.isSolid(x, y)) {
+                changedCells.emplace_back(x, y);
+            }
+        }
+    }
+}
+
+/**
+ * @brief Updates the light fields and the torch.
+ *
+ * The queued changed cells are consumed by the propagation, which un-spreads
+ * and re-spreads light only around them.
+ *
+ * @param lights The radial lights in the scene.
+ * @param torch The player's torch.
+ * @param torch_on Whether the torch is turned on.
+ */
+void FloodFillLightingEngine::calculateLighting(const std::vector<RadialLight>& lights, const Torch& torch, bool torch_on) {
+    propagation.update(lights, changedCells, collisionGrid);
+    changedCells.clear();
+
+    for (int y = torchRect.y0; y < torchRect.y1; ++y) {
+        for (int x = torchRect.x0; x < torchRect.x1; ++x) {
+            lightLevels[y * gridWidth + x] = static_cast<uint8_t>(propagation.getLevel(y * gridWidth + x));
+        }
+    }
+    for (int index : propagation.getTouchedCells()) {
+        lightLevels[index] = static_cast<uint8_t>(propagation.getLevel(index));
+    }
+    lastUpdatedCellCount = static_cast<int>(propagation.getTouchedCells().size()) +
+                           (torchRect.x1 - torchRect.x0) * (torchRect.y1 - torchRect.y0);
+
+    torchRect = {0, 0, 0, 0};
+    if (torch_on) {
+        applyTorch(torch);
+        lastUpdatedCellCount += (torchRect.x1 - torchRect.x0) * (torchRect.y1 - torchRect.y0);
+    }
+}
+
+/**
+ * @brief Floods the torch over its reach and raises the cells it lights.
+ *
+ * The torch keeps the shape the other backends give it, a bright ellipse ahead
+ * of the player inside a dimmer cone, but a cell is only lit when light from
+ * the torch's cell can get to it within twice the torch's radius.
+ *
+ * @param torch The player's torch.
+ */
+void FloodFillLightingEngine::applyTorch(const Torch& torch) {
+    const PackedTorch packed = pack_torch(torch);
+    if (torch.position.x < 0 || torch.position.y < 0 || packed.cell_x >= gridWidth || packed.cell_y >= gridHeight) {
+        return;
+    }
+
+    const float current_radius = packed.radius;
+    const float max_torch_radius = current_radius * 2.0f;
+    const float ellipse_distance = current_radius * 1.2f;
+    const float ellipse_width = current_radius * 1.2f;
+    const float ellipse_height = current_radius * 0.8f;
+    const float max_angle = std::atan2(ellipse_height / 2, ellipse_distance) + 0.05f;
+
+    const int reach = static_cast<int>(std::ceil(max_torch_radius)) + 1;
+    torchRect = {std::max(packed.cell_x - reach, 0), std::max(packed.cell_y - reach, 0),
+                 std::min(packed.cell_x + reach + 1, gridWidth), std::min(packed.cell_y + reach + 1, gridHeight)};
+    flood_distances(collisionGrid, packed.cell_x, packed.cell_y, torchRect,
+                    static_cast<int>(std::ceil(max_torch_radius * PROPAGATION_STRAIGHT_STEP)), torchDistances, torchQueue);
+
+    const int rectWidth = torchRect.x1 - torchRect.x0;
+    for (int y = torchRect.y0; y < torchRect.y1; ++y) {
+        for (int x = torchRect.x0; x < torchRect.x1; ++x) {
+            if (torchDistances[(y - torchRect.y0) * rectWidth + (x - torchRect.x0)] == UINT16_MAX) {
+                continue;
+            }
+            const float dx = static_cast<float>(x) - packed.x;
+            const float dy = static_cast<float>(y) - packed.y;
+            const float distance_squared = dx * dx + dy * dy;
+            if (distance_squared > max_torch_radius * max_torch_radius) {
+                continue;
+            }
+
+            const float rotated_dx = dx * packed.direction_x + dy * packed.direction_y;
+            const float rotated_dy = -dx * packed.direction_y + dy * packed.direction_x;
+            const float ex = rotated_dx - ellipse_distance;
+            const float ellipse_factor = ex * ex / ((ellipse_width / 2) * (ellipse_width / 2))
+                                       + rotated_dy * rotated_dy / ((ellipse_height / 2) * (ellipse_height / 2));
+            int torch_light_level = 0;
+            if (ellipse_factor <= 1.1f) {
+                torch_light_level = LIGHT_LEVELS;
+            } else if (std::sqrt(distance_squared) <= current_radius && rotated_dx >= 0 &&
+                       std::atan2(std::fabs(rotated_dy), rotated_dx) <= max_angle) {
+                torch_light_level = collisionGrid.getHeightAt(x, y) <= static_cast<int>(HeightLevel::PLAYER) ? LIGHT_LEVELS / 2 : LIGHT_LEVELS;
+            }
+
+            uint8_t& cell_level = lightLevels[y * gridWidth + x];
+            cell_level = std::max(cell_level, static_cast<uint8_t>(torch_light_level));
+        }
+    }
+}
+
+/**
+ * @brief Reads the current light levels.
+ * @param levels Vector to store the light levels.
+ */
+void FloodFillLightingEngine::readLightLevels(std::vector<uint8_t>& levels) const {
+    levels = lightLevels;
+}
+
+/**
+ * @brief Copies the light levels of a rectangle of cells.
+ * @param levels Receives the levels of rect, row by row.
+ * @param rect The cells to read.
+ */
+void FloodFillLightingEngine::readLightLevelRect(std::vector<uint8_t>& levels, const GridRect& rect) const {
+    int width = rect.x1 - rect.x0;
+    levels.resize(width * (rect.y1 - rect.y0));
+    for (int y = rect.y0; y < rect.y1; ++y) {
+        std::copy_n(&lightLevels[y * gridWidth + rect.x0], width, &levels[(y - rect.y0) * width]);
+    }
+}
@@ -0,0 +1,174 @@
+/**
+ * @file frame_telemetry.cpp
+ * @brief Implements the latency histograms and the frame telemetry export.
+ */
+
+#include "./include/types.h"
+#include <algorithm>
+#include <fstream>
+
+/**
+ * @brief Adds one duration to the histogram.
+ *
+ * Bucket 0 holds everything under a microsecond; bucket i above it covers
+ * [2^((i - 1) / 16), 2^(i / 16)) microseconds.
+ *
+ * @param ms The duration in milliseconds.
+ */
+void LatencyHistogram::record(double ms) {
+    double us = ms * 1000.0;
+    int bucket = 0;
+    if (us >= 1.0) {
+        bucket = std::min(1 + static_cast<int>(std::log2(us) * HISTOGRAM_BUCKETS_PER_DOUBLING), BUCKETS - 1);
+    }
+    ++counts[bucket];
+    ++count;
+    total += ms;
+    max = std::max(max, ms);
+}
+
+/**
+ * @brief Forgets every recorded duration.
+ */
+void LatencyHistogram::clear() {
+    counts.fill(0);
+    count = 0;
+    total = 0.0;
+    max = 0.0;
+}
+
+/**
+ * @brief Returns the duration that the given share of samples does not exceed.
+ *
+ * The answer is the upper edge of the bucket holding that sample, capped at
+ * the largest sample seen.
+ *
+ * @param percentile The share of samples, from 0 to 100.
+ * @return The duration in milliseconds, or 0 if nothing was recorded.
+ */
+double LatencyHistogram::getPercentile(double percentile) const {
+    if (count == 0) {
+        return 0.0;
+    }
+    long rank = std::max(1L, static_cast<long>(std::ceil(percentile / 100.0 * count)));
+    long seen = 0;
+    for (int bucket = 0; bucket < BUCKETS; ++bucket) {
+        seen += counts[bucket];
+        if (seen >= rank) {
+            double upper_us = std::exp2(static_cast<double>(bucket) / HISTOGRAM_BUCKETS_PER_DOUBLING);
+            return std::min(upper_us / 1000.0, max);
+        }
+    }
+    return max;
+}
+
+/**
+ * @brief Adds the samples of another histogram to this one.
+ * @param other The histogram to add.
+ */
+void LatencyHistogram::merge(const LatencyHistogram& other) {
+    for (int bucket = 0; bucket < BUCKETS; ++bucket) {
+        counts[bucket] += other.counts[bucket];
+    }
+    count += other.count;
+    total += other.total;
+    max = std::max(max, other.max);
+}
+
+/**
+ * @brief Names a phase for the HUD and the export.
+ */
+const char* frame_phase_name(FramePhase phase) {
+    switch (phase) {
+        case FramePhase::EVENTS: return "process_events";
+        case FramePhase::PLAYER: return "update_player";
+        case FramePhase::BULLETS: return "update_bullets";
+        case FramePhase::PARTICLES: return "update_particles";
+        case FramePhase::LIGHT_MOVERS: return "update_light_movers";
+        case FramePhase::LIGHTING: return "update_grid_lighting";
+        case FramePhase::SNAPSHOT: return "publish_snapshot";
+        case FramePhase::RENDER: return "render_frame";
+        case FramePhase::PRESENT: return "refresh_screen";
+        case FramePhase::TICK: return "tick_interval";
+        case FramePhase::INPUT_LATENCY: return "input_latency";
+        case FramePhase::FRAME: return "frame";
+        case FramePhase::COUNT: break;
+    }
+    return "unknown";
+}
+
+/**
+ * @brief Records how long a phase took this frame.
+ * @param phase The phase.
+ * @param ms The duration in milliseconds.
+ */
+void FrameTelemetry::record(FramePhase phase, double ms) {
+    run[static_cast<int>(phase)].record(ms);
+    window[static_cast<int>(phase)].record(ms);
+}
+
+/**
+ * @brief Ends a frame; every TELEMETRY_WINDOW_FRAMES frames the window becomes the last window.
+ */
+void FrameTelemetry::endFrame() {
+    if (++windowFrames < TELEMETRY_WINDOW_FRAMES) {
+        return;
+    }
+    lastWindow = window;
+    for (auto& histogram : window) {
+        histogram.clear();
+    }
+    windowFrames = 0;
+}
+
+/**
+ * @brief Summarizes every phase over the last complete window of frames.
+ */
+std::array<LatencySummary, FRAME_PHASE_COUNT> FrameTelemetry::summarizeLastWindow() const {
+    std::array<LatencySummary, FRAME_PHASE_COUNT> summaries;
+    for (int phase = 0; phase < FRAME_PHASE_COUNT; ++phase) {
+        const LatencyHistogram& histogram = lastWindow[phase];
+        summaries[phase] = {histogram.getCount(), histogram.getMean(), histogram.getPercentile(50),
+                            histogram.getPercentile(95), histogram.getPercentile(99), histogram.getMax()};
+    }
+    return summaries;
+}
+
+/**
+ * @brief Adds the whole-run samples of another telemetry, such as the simulation thread's, to this one.
+ * @param other The telemetry to add.
+ */
+void FrameTelemetry::mergeRun(const FrameTelemetry& other) {
+    for (int phase = 0; phase < FRAME_PHASE_COUNT; ++phase) {
+        run[phase].merge(other.run[phase]);
+    }
+}
+
+/**
+ * @brief Writes one CSV row of whole-run statistics per phase.
+ * @param out The stream to write to.
+ */
+void FrameTelemetry::writeCsv(std::ostream& out) const {
+    out << "phase,samples,mean_ms,p50_ms,p95_ms,p99_ms,max_ms\n";
+    for (int phase = 0; phase < FRAME_PHASE_COUNT; ++phase) {
+        const LatencyHistogram& histogram = run[phase];
+        out << frame_phase_name(static_cast<FramePhase>(phase)) << ',' << histogram.getCount() << ',' << histogram.getMean() << ','
+            << histogram.getPercentile(50) << ',' << histogram.getPercentile(95) << ',' << histogram.getPercentile(99) << ','
+            << histogram.getMax() << '\n';
+    }
+}
+
+/**
+ * @brief Writes the whole-run statistics of every phase to a CSV file.
+ *
+ * @param telemetry The telemetry to write.
+ * @param path The file to write.
+ * @throws std::runtime_error If the file cannot be written.
+ */
+void write_frame_telemetry(const FrameTelemetry& telemetry, const std::string& path) {
+    std::ofstream out(path);
+    if (!out.is_open()) {
+        throw std::runtime_error("Failed to open frame telemetry file: " + path);
+    }
+    telemetry.writeCsv(out);
+}
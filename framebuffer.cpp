@@ -0,0 +1,206 @@
+/**
+ * @file framebuffer.cpp
+ * @brief Implements the ShadeTable and GridFramebuffer rendering path.
+ *
+ * Shading is one table lookup per cell. SplashKit has no call to upload raw
+ * pixels to a bitmap, so present() writes the buffer into a persistent
+ * offscreen bitmap as horizontal runs of equal colour, one fill per run, and
+ * draws that bitmap to the window in a single call. A copy of the last
+ * presented buffer is kept next to it, so only runs that differ from it are
+ * repainted and the cost of a frame follows how much of the scene changed.
+ */
+
+#include "./include/types.h"
+#include <algorithm>
+
+static_assert(ShadeTable::LEVELS == LIGHT_LEVELS + 1, "ShadeTable must cover every light level");
+
+/**
+ * @brief Precomputes the lit colour of every height and light level.
+ */
+ShadeTable::ShadeTable() : entries(256 * LEVELS) {
+    for (int height = 0; height < 256; ++height) {
+        color base_color = height_to_color(static_cast<HeightLevel>(height));
+        for (int level = 0; level < LEVELS; ++level) {
+            color lit = apply_lighting(base_color, level);
+            entries[height * LEVELS + level] = static_cast<uint32_t>(red_of(lit)) << 24 |
+                                               static_cast<uint32_t>(green_of(lit)) << 16 |
+                                               static_cast<uint32_t>(blue_of(lit)) << 8 | 0xFF;
+        }
+    }
+}
+
+/**
+ * @brief Parses a render mode name as given on the command line.
+ *
+ * @param name "cells" (the default), "framebuffer" or "device".
+ * @return The matching render mode.
+ * @throws std::invalid_argument If the name is not recognised.
+ */
+RenderMode parse_render_mode(const std::string& name) {
+    if (name.empty() || name == "cells") return RenderMode::CELLS;
+    if (name == "framebuffer") return RenderMode::FRAMEBUFFER;
+    if (name == "device") return RenderMode::DEVICE_FRAMEBUFFER;
+    throw std::invalid_argument("Unknown render mode: " + name);
+}
+
+GridFramebuffer::GridFramebuffer() : area({0, 0, 0, 0}), width(0), height(0), changedCells(0), target(nullptr) {}
+
+GridFramebuffer::~GridFramebuffer() {
+    if (target) {
+        free_bitmap(target);
+    }
+}
+
+/**
+ * @brief Points the buffer at a rectangle of cells.
+ *
+ * Moving the rectangle repaints the whole bitmap on the next present; changing
+ * its size also recreates the bitmap.
+ *
+ * @param rect The cells to shade and present.
+ */
+void GridFramebuffer::setArea(const GridRect& rect) {
+    if (rect.x0 == area.x0 && rect.y0 == area.y0 && rect.x1 == area.x1 && rect.y1 == area.y1) {
+        return;
+    }
+    area = rect;
+    presented.clear();
+    if (rect.x1 - rect.x0 == width && rect.y1 - rect.y0 == height) {
+        return;
+    }
+    width = rect.x1 - rect.x0;
+    height = rect.y1 - rect.y0;
+    pixels.assign(width * height, 0);
+    if (target) {
+        free_bitmap(target);
+        target = nullptr;
+    }
+}
+
+/**
+ * @brief Shades and presents the backend's current lighting over a rectangle of cells.
+ *
+ * @param lightingBackend The backend to read heights and light levels from.
+ * @param rect The cells to render.
+ * @param onDevice Whether to let the backend shade on its device.
+ */
+void GridFramebuffer::render(const LightingBackend& lightingBackend, const GridRect& rect, bool onDevice) {
+    shadeFrom(lightingBackend, rect, onDevice);
+    present();
+}
+
+/**
+ * @brief Fills the pixel buffer from the backend's current lighting.
+ *
+ * @param lightingBackend The backend to read heights and light levels from.
+ * @param rect The cells to shade.
+ * @param onDevice Whether to let the backend shade on its device; falls back
+ *                 to host shading when it cannot.
+ */
+void GridFramebuffer::shadeFrom(const LightingBackend& lightingBackend, const GridRect& rect, bool onDevice) {
+    setArea(rect);
+    if (!onDevice || !lightingBackend.shadeOnDevice(table.getEntries(), area, pixels)) {
+        lightingBackend.readLightLevelRect(levelScratch, area);
+        shade(lightingBackend.getCollisionGrid(), levelScratch);
+    }
+}
+
+/**
+ * @brief Shades and presents a rectangle of cells from copies of their heights and light levels.
+ *
+ * @param rect The cells to render.
+ * @param heights The height of each cell of the rectangle, row by row.
+ * @param levels The light level of each cell of the rectangle, row by row.
+ */
+void GridFramebuffer::render(const GridRect& rect, const std::vector<uint8_t>& heights, const std::vector<uint8_t>& levels) {
+    setArea(rect);
+    shadeRows(heights.data(), width, levels);
+    present();
+}
+
+/**
+ * @brief Shades every cell of the area through the colour table.
+ * @param terrain The heights of the whole grid.
+ * @param levels The light level of each cell of the area, row by row.
+ */
+void GridFramebuffer::shade(const CollisionGrid& terrain, const std::vector<uint8_t>& levels) {
+    shadeRows(terrain.getHeights().data() + area.y0 * terrain.getWidth() + area.x0, terrain.getWidth(), levels);
+}
+
+/**
+ * @brief Shades every cell of the area from rows of heights.
+ * @param heights The height of the area's first cell.
+ * @param heightStride The distance between rows of heights.
+ * @param levels The light level of each cell of the area, row by row.
+ */
+void GridFramebuffer::shadeRows(const uint8_t* heights, int heightStride, const std::vector<uint8_t>& levels) {
+    for (int y = 0; y < height; ++y) {
+        const uint8_t* heightRow = &heights[y * heightStride];
+        const uint8_t* levelRow = &levels[y * width];
+        uint32_t* pixelRow = &pixels[y * width];
+        for (int x = 0; x < width; ++x) {
+            pixelRow[x] = table.lookup(heightRow[x], levelRow[x]);
+        }
+    }
+}
+
+/**
+ * @brief Compares the pixel buffer with what was last presented and records the differences.
+ *
+ * Runs of changed cells with the same colour are merged, and unchanged rows are
+ * skipped with one comparison. Afterwards the buffer counts as presented.
+ *
+ * @return The changed runs, valid until the next call.
+ */
+const std::vector<PixelRun>& GridFramebuffer::collectChangedRuns() {
+    changedRuns.clear();
+    changedCells = 0;
+    bool repaintAll = presented.size() != pixels.size();
+    if (repaintAll) {
+        presented.assign(pixels.size(), 0);
+    }
+
+    for (int y = 0; y < height; ++y) {
+        const uint32_t* row = &pixels[y * width];
+        uint32_t* previous = &presented[y * width];
+        if (!repaintAll && std::equal(row, row + width, previous)) {
+            continue;
+        }
+
+        int x = 0;
+        while (x < width) {
+            if (!repaintAll && row[x] == previous[x]) {
+                ++x;
+                continue;
+            }
+            int runStart = x;
+            uint32_t pixel = row[x];
+            while (x < width && row[x] == pixel && (repaintAll || previous[x] != pixel)) {
+                previous[x] = pixel;
+                ++x;
+            }
+            changedRuns.push_back({runStart, y, x - runStart, pixel});
+            changedCells += x - runStart;
+        }
+    }
+    return changedRuns;
+}
+
+/**
+ * @brief Repaints the changed cells of the offscreen bitmap and draws it at the area's place in the world.
+ */
+void GridFramebuffer::present() {
+    if (!target) {
+        target = create_bitmap("grid_framebuffer", width * CELL_SIZE, height * CELL_SIZE);
+        presented.clear();
+    }
+
+    for (const PixelRun& run : collectChangedRuns()) {
+        uint32_t pixel = run.pixel;
+        fill_rectangle_on_bitmap(target, rgba_color(pixel >> 24, (pixel >> 16) & 0xFF, (pixel >> 8) & 0xFF, pixel & 0xFF),
+                                 run.x * CELL_SIZE, run.y * CELL_SIZE, run.length * CELL_SIZE, CELL_SIZE);
+    }
+
+    draw_bitmap(target, area.x0 * CELL_SIZE, area.y0 * CELL_SIZE);
+}
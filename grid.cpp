@@ -14,28 +14,31 @@
 /**
  * @brief Creates a new grid with randomly placed obstacles.
  *
+ * The number of obstacles grows with the area, so larger worlds keep the
+ * density of the default GRID_WIDTH x GRID_HEIGHT map.
+ *
  * @param width The width of the grid.
  * @param height The height of the grid.
+ * @param seed Seed for the obstacle layout; the same seed always yields the same grid.
  * @return The newly created grid.
  */
-Grid create_grid(int width, int height) {
+Grid create_grid(int width, int height, unsigned int seed) {
     Grid grid;
     grid.width = width;
     grid.height = height;
-    grid.cells.resize(width * height, {HeightLevel::FLOOR, 0, height_to_color(HeightLevel::FLOOR)});
+    grid.cells.resize(width * height, {HeightLevel::FLOOR, 0});
 
-    std::random_device rd;
-    std::mt19937 gen(rd());
+    std::mt19937 gen(seed);
     std::uniform_int_distribution<> x_dist(0, width - 1);
     std::uniform_int_distribution<> y_dist(0, height - 1);
     std::uniform_int_distribution<> height_dist(0, 2);
     HeightLevel square_height;
 
-    const int num_squares = 100;
+    const long num_squares = 100L * width * height / (GRID_WIDTH * GRID_HEIGHT);
     const int square_size = 5;
     std::set<std::pair<int, int>> square_positions;
 
-    for (int i = 0; i < num_squares; ++i) {
+    for (long i = 0; i < num_squares; ++i) {
         int sx, sy;
         do {
             sx = x_dist(gen);
@@ -60,7 +63,6 @@ Grid create_grid(int width, int height) {
         for (int y = sy; y < std::min(sy + square_size, height); ++y) {
             for (int x = sx; x < std::min(sx + square_size, width); ++x) {
                 grid.cells[y * width + x].height = square_height;
-                grid.cells[y * width + x].base_color = height_to_color(square_height);
             }
         }
     }
@@ -69,25 +71,32 @@ Grid create_grid(int width, int height) {
 }
 
 /**
- * @brief Renders the grid with lighting effects applied.
+ * @brief Renders a rectangle of the grid with lighting effects applied.
  *
- * @param openclWrapper The OpenCL wrapper containing grid data.
+ * @param lightingBackend The lighting backend containing grid data.
+ * @param rect The cells to draw, usually the camera's active chunks.
  */
-void render_grid(const OpenCLWrapper& openclWrapper) {
-    int gridWidth = openclWrapper.getGridWidth();
-    int gridHeight = openclWrapper.getGridHeight();
-
-    std::vector<int> gridHeights;
-    std::vector<int> lightLevels;
-    openclWrapper.readGridHeights(gridHeights);
-    openclWrapper.readLightLevels(lightLevels);
+void render_grid(const LightingBackend& lightingBackend, const GridRect& rect) {
+    std::vector<uint8_t> heights;
+    std::vector<uint8_t> lightLevels;
+    lightingBackend.getCollisionGrid().readHeightRect(heights, rect);
+    lightingBackend.readLightLevelRect(lightLevels, rect);
+    render_grid(heights, lightLevels, rect);
+}
 
-    for (int y = 0; y < gridHeight; ++y) {
-        for (int x = 0; x < gridWidth; ++x) {
-            int index = y * gridWidth + x;
-            HeightLevel height = static_cast<HeightLevel>(gridHeights[index]);
-            color base_color = height_to_color(height);
-            color final_color = apply_lighting(base_color, lightLevels[index]);
+/**
+ * @brief Renders a rectangle of cells from copies of their heights and light levels.
+ *
+ * @param heights The height of each cell of the rectangle, row by row.
+ * @param lightLevels The light level of each cell of the rectangle, row by row.
+ * @param rect The cells to draw.
+ */
+void render_grid(const std::vector<uint8_t>& heights, const std::vector<uint8_t>& lightLevels, const GridRect& rect) {
+    int rectWidth = rect.x1 - rect.x0;
+    for (int y = rect.y0; y < rect.y1; ++y) {
+        for (int x = rect.x0; x < rect.x1; ++x) {
+            int index = (y - rect.y0) * rectWidth + (x - rect.x0);
+            color final_color = apply_lighting(height_to_color(static_cast<HeightLevel>(heights[index])), lightLevels[index]);
             fill_rectangle(final_color, x * CELL_SIZE, y * CELL_SIZE, CELL_SIZE, CELL_SIZE);
         }
     }
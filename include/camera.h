@@ -0,0 +1,37 @@
+/**
+ * @file camera.h
+ * @brief Defines the camera that scrolls the window over a world larger than the screen.
+ *
+ * The world is divided into WORLD_CHUNK_SIZE x WORLD_CHUNK_SIZE chunks. Each
+ * frame the camera centres on the player, and the chunks it overlaps form the
+ * active rectangle: lighting is only computed and the grid only rendered
+ * there, so the per-frame cost follows the view rather than the world.
+ */
+
+#ifndef CAMERA_H
+#define CAMERA_H
+
+#include "dirty_regions.h"
+
+struct Player;
+
+const int WORLD_CHUNK_SIZE = 64;
+
+static_assert(WORLD_CHUNK_SIZE % LIGHT_TILE_SIZE == 0, "Chunks must be made of whole lighting tiles");
+
+/**
+ * @brief The part of the world shown in the window.
+ */
+struct Camera {
+    double x;         // Left edge of the view, in cells.
+    double y;         // Top edge of the view, in cells.
+    int view_width;   // Width of the view, in cells.
+    int view_height;  // Height of the view, in cells.
+};
+
+Camera create_camera(int view_width, int view_height);
+void update_camera(Camera& camera, const Player& player, int world_width, int world_height);
+void apply_camera(const Camera& camera);
+GridRect camera_active_rect(const Camera& camera, int world_width, int world_height);
+
+#endif // CAMERA_H
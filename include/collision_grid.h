@@ -0,0 +1,72 @@
+/**
+ * @file collision_grid.h
+ * @brief Defines the host-resident mirror of the grid heights used for collision queries.
+ *
+ * The CollisionGrid is the authoritative copy of the terrain on the host, one
+ * byte per cell. Next to the heights it keeps a 1-bit-per-cell mask of solid cells (taller than
+ * FLOOR), packed into 64-bit words per row, so segment queries for the player
+ * and bullets never have to touch the lighting device.
+ *
+ * It also keeps a max-height pyramid: level l holds, for every 2^l x 2^l block
+ * of cells, the height of its tallest cell. Line-of-sight walks use it to cross
+ * whole blocks of low terrain at once. The layout matches the height_pyramid
+ * buffer in lighting_kernels.cl: levels 1..HEIGHT_PYRAMID_LEVELS back to back,
+ * each row-major.
+ */
+
+#ifndef COLLISION_GRID_H
+#define COLLISION_GRID_H
+
+#include <cstdint>
+#include <vector>
+
+struct Grid;
+struct RaySegment;
+struct RayHit;
+struct GridRect;
+enum class HeightLevel : uint8_t;
+
+const int HEIGHT_PYRAMID_LEVELS = 4;
+
+class CollisionGrid {
+public:
+    CollisionGrid();
+
+    void initialize(const Grid& grid);
+    void reset(int gridWidth, int gridHeight);
+    void loadRect(const uint8_t* source, int pitch, const GridRect& rect);
+    bool setHeight(int x, int y, HeightLevel height);
+    int getHeightAt(int x, int y) const { return heights[y * width + x]; }
+    bool isSolid(int x, int y) const { return (solidMask[y * wordsPerRow + (x >> 6)] >> (x & 63)) & 1; }
+    bool spanHasSolid(int y, int x0, int x1) const;
+    RayHit castRay(const RaySegment& segment) const;
+    void readHeightRect(std::vector<uint8_t>& out, const GridRect& rect) const;
+    Grid toGrid() const;
+
+    int getBlockMax(int level, int x, int y) const {
+        return pyramid[levelOffsets[level] + (y >> level) * levelWidths[level] + (x >> level)];
+    }
+    const std::vector<uint8_t>& getPyramid() const { return pyramid; }
+    int getLevelWidth(int level) const { return levelWidths[level]; }
+    int getLevelOffset(int level) const { return levelOffsets[level]; }
+
+    const std::vector<uint8_t>& getHeights() const { return heights; }
+    int getWidth() const { return width; }
+    int getHeight() const { return height; }
+
+private:
+    int width;
+    int height;
+    int wordsPerRow;
+    std::vector<uint8_t> heights;
+    std::vector<uint64_t> solidMask;
+    std::vector<uint8_t> pyramid;
+    int levelWidths[HEIGHT_PYRAMID_LEVELS + 1];
+    int levelHeights[HEIGHT_PYRAMID_LEVELS + 1];
+    int levelOffsets[HEIGHT_PYRAMID_LEVELS + 1];
+
+    size_t layoutPyramid();
+    void updatePyramid(int level, int x, int y);
+};
+
+#endif // COLLISION_GRID_H
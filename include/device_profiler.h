@@ -0,0 +1,102 @@
+/**
+ * @file device_profiler.h
+ * @brief Defines the recorder for OpenCL command timings.
+ *
+ * When profiling is on, the OpenCL backend creates its queues with
+ * CL_QUEUE_PROFILING_ENABLE and hands every kernel launch, write, read and
+ * copy an event from the profiler, along with a name and the bytes it moves.
+ * Events are resolved a frame late, once the device has long finished them,
+ * so recording never stalls the pipeline. Resolved commands are summed per
+ * frame for an on-screen breakdown and, when a trace file is open, written to
+ * it as CSV or as JSON for chrome://tracing and Perfetto. Commands are written
+ * as they resolve rather than kept, so a long session holds no more than the
+ * last two frames of commands in memory.
+ */
+
+#ifndef DEVICE_PROFILER_H
+#define DEVICE_PROFILER_H
+
+#include <cstddef>
+#include <deque>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <CL/opencl.hpp>
+
+enum class DeviceCommandKind {
+    KERNEL,
+    WRITE,
+    READ,
+    COPY
+};
+
+/**
+ * @brief One command as the device ran it. Timestamps are device nanoseconds.
+ */
+struct DeviceCommandRecord {
+    std::string name;
+    DeviceCommandKind kind;
+    int queue;       // 0 is the main queue, 1 the transfer queue, 2 and up the band queues.
+    long frame;
+    size_t bytes;
+    cl_ulong queued;
+    cl_ulong submitted;
+    cl_ulong started;
+    cl_ulong ended;
+};
+
+/**
+ * @brief The commands of one name, summed over a frame or a run.
+ */
+struct DeviceCommandSummary {
+    std::string name;
+    DeviceCommandKind kind;
+    int count = 0;
+    double device_ms = 0.0;   // Time spent running.
+    double waiting_ms = 0.0;  // Time from being queued to starting.
+    size_t bytes = 0;
+};
+
+class DeviceProfiler {
+public:
+    void setEnabled(bool on) { enabled = on; }
+    bool isEnabled() const { return enabled; }
+
+    cl::Event* record(const char* name, DeviceCommandKind kind, int queue, size_t bytes = 0);
+    void beginFrame();
+    void finish();
+    void clearTotals();
+
+    void openTrace(const std::string& path);
+    void closeTrace();
+
+    const std::vector<DeviceCommandSummary>& getLastFrame() const { return lastFrame; }
+    const std::vector<DeviceCommandSummary>& getTotals() const { return totals; }
+    long getTotalFrameCount() const { return resolvedFrames - totalsFrom; }
+
+private:
+    struct PendingCommand {
+        DeviceCommandRecord record;
+        cl::Event event;
+    };
+
+    void resolveBefore(long frameLimit);
+    void writeRecord(const DeviceCommandRecord& record);
+
+    bool enabled = false;
+    long frame = 0;
+    long resolvedFrames = 0;
+    long totalsFrom = 0;
+    std::deque<PendingCommand> pending;
+    std::ofstream traceFile;
+    bool traceCsv = false;
+    long tracedCommands = 0;
+    int tracedQueues = 0;     // Queues named in the JSON trace so far.
+    cl_ulong traceOrigin = 0;  // The queued time of the first traced command; JSON times count from it.
+    std::vector<DeviceCommandSummary> lastFrame;
+    std::vector<DeviceCommandSummary> totals;
+};
+
+const char* device_command_kind_name(DeviceCommandKind kind);
+
+#endif // DEVICE_PROFILER_H
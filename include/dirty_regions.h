@@ -0,0 +1,81 @@
+/**
+ * @file dirty_regions.h
+ * @brief Defines the tile-based tracker that drives incremental lighting.
+ *
+ * The grid is split into LIGHT_TILE_SIZE x LIGHT_TILE_SIZE tiles. Each frame
+ * the tracker compares the lights and torch against the previous frame and
+ * looks at the cells whose height changed, marks every tile whose light
+ * level could differ from a full recompute, and hands the marked tiles back
+ * as a small list of rectangles.
+ */
+
+#ifndef DIRTY_REGIONS_H
+#define DIRTY_REGIONS_H
+
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+struct RadialLight;
+struct Torch;
+
+const int LIGHT_TILE_SIZE = 16;
+
+/**
+ * @brief A half-open rectangle of grid cells, [x0, x1) x [y0, y1).
+ */
+struct GridRect {
+    int x0;
+    int y0;
+    int x1;
+    int y1;
+};
+
+class LightingDirtyTracker {
+public:
+    LightingDirtyTracker();
+
+    void reset(int gridWidth, int gridHeight);
+    void markAll();
+    void markRect(const GridRect& rect);
+    void update(const std::vector<RadialLight>& lights, const Torch& torch, bool torch_on,
+                const std::vector<std::pair<int, int>>& changedCells);
+    std::vector<GridRect> takeDirtyRects();
+    int getDirtyTileCount() const;
+    int getTileCount() const { return tilesX * tilesY; }
+
+private:
+    struct LightState {
+        double x;
+        double y;
+        double radius;
+        double intensity;
+        int height;
+    };
+
+    struct TorchState {
+        double x;
+        double y;
+        double direction_x;
+        double direction_y;
+        double radius;
+        bool on;
+    };
+
+    void markDisc(double cx, double cy, double radius);
+    void markRing(double cx, double cy, double innerRadius, double outerRadius);
+    void markLightChange(const LightState& before, const LightState& after);
+    static LightState captureLight(const RadialLight& light);
+    static TorchState captureTorch(const Torch& torch, bool torch_on);
+    static double torchReach(const TorchState& torch) { return torch.radius * 2.0; }
+
+    int width;
+    int height;
+    int tilesX;
+    int tilesY;
+    std::vector<uint8_t> dirtyTiles;
+    std::vector<LightState> previousLights;
+    TorchState previousTorch;
+};
+
+#endif // DIRTY_REGIONS_H
@@ -0,0 +1,100 @@
+/**
+ * @file framebuffer.h
+ * @brief Defines the framebuffer rendering path for the lit grid.
+ *
+ * Instead of shading and drawing every cell with its own fill_rectangle, the
+ * grid is shaded into one packed RGBA pixel per cell through a precomputed
+ * (height x light level) colour table, and the pixels are presented through
+ * a single offscreen bitmap.
+ *
+ * The bitmap persists between frames and remembers what it holds, so present
+ * only repaints the cells whose colour changed; overlays are drawn on the
+ * window on top of it and never touch the bitmap.
+ */
+
+#ifndef FRAMEBUFFER_H
+#define FRAMEBUFFER_H
+
+#include "splashkit.h"
+#include "dirty_regions.h"
+#include <cstdint>
+#include <string>
+#include <vector>
+
+class LightingBackend;
+class CollisionGrid;
+
+/**
+ * @brief How render_frame draws the grid.
+ */
+enum class RenderMode {
+    CELLS,              // One fill_rectangle per cell (render_grid).
+    FRAMEBUFFER,        // Shade into a pixel buffer on the host and present it as one bitmap.
+    DEVICE_FRAMEBUFFER  // As FRAMEBUFFER, but shade on the lighting device when it supports it.
+};
+
+/**
+ * @brief Colour of every (height, light level) pair, packed as 0xRRGGBBAA.
+ *
+ * Entries match apply_lighting(height_to_color(height), level) exactly.
+ */
+class ShadeTable {
+public:
+    static const int LEVELS = 6;  // LIGHT_LEVELS + 1
+
+    ShadeTable();
+
+    uint32_t lookup(uint8_t height, uint8_t level) const { return entries[height * LEVELS + level]; }
+    const std::vector<uint32_t>& getEntries() const { return entries; }
+
+private:
+    std::vector<uint32_t> entries;
+};
+
+/**
+ * @brief A horizontal run of changed cells that share one colour.
+ */
+struct PixelRun {
+    int x;
+    int y;
+    int length;
+    uint32_t pixel;
+};
+
+class GridFramebuffer {
+public:
+    GridFramebuffer();
+    ~GridFramebuffer();
+
+    GridFramebuffer(const GridFramebuffer&) = delete;
+    GridFramebuffer& operator=(const GridFramebuffer&) = delete;
+
+    void render(const LightingBackend& lightingBackend, const GridRect& rect, bool onDevice);
+    void render(const GridRect& rect, const std::vector<uint8_t>& heights, const std::vector<uint8_t>& levels);
+    void shadeFrom(const LightingBackend& lightingBackend, const GridRect& rect, bool onDevice);
+    void shade(const CollisionGrid& terrain, const std::vector<uint8_t>& levels);
+    const std::vector<PixelRun>& collectChangedRuns();
+    void present();
+
+    void setArea(const GridRect& rect);
+    const std::vector<uint32_t>& getPixels() const { return pixels; }
+    long getChangedCellCount() const { return changedCells; }
+
+private:
+    void shadeRows(const uint8_t* heights, int heightStride, const std::vector<uint8_t>& levels);
+
+    ShadeTable table;
+    GridRect area;  // The cells the buffer covers.
+    int width;
+    int height;
+    std::vector<uint32_t> pixels;
+    std::vector<uint32_t> presented;  // What the bitmap holds; empty when it must be repainted in full.
+    std::vector<PixelRun> changedRuns;
+    long changedCells;
+    std::vector<uint8_t> levelScratch;
+    bitmap target;
+};
+
+RenderMode parse_render_mode(const std::string& name);
+
+#endif // FRAMEBUFFER_H
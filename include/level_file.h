@@ -0,0 +1,111 @@
+/**
+ * @file level_file.h
+ * @brief Defines the binary level format and its memory-mapped reader.
+ *
+ * A level file holds a LevelFileHeader, the level's static lights and then its
+ * heights, one byte per cell, cut into LEVEL_CHUNK_SIZE x LEVEL_CHUNK_SIZE
+ * chunks. Each chunk is stored row by row in one page-aligned block, so a
+ * chunk is a single page of the mapping, and chunks past the right and bottom
+ * edges are padded with floor. Values are stored in the host's byte order,
+ * which is little-endian on every platform the game runs on. Static lights
+ * must lie on the grid and reach no further than LEVEL_MAX_LIGHT_RADIUS.
+ *
+ * LevelFile maps the file read-only and hands out pointers to chunks, so
+ * opening a level only reads the header: the operating system pages in a
+ * chunk the first time it is touched. Lighting backends load the chunks
+ * around the camera as it moves; see LightingBackend::initializeLevel.
+ */
+
+#ifndef LEVEL_FILE_H
+#define LEVEL_FILE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "dirty_regions.h"
+
+struct Grid;
+struct RadialLight;
+struct Vector2D;
+enum class LightingBackendType;
+
+const char LEVEL_FILE_MAGIC[4] = {'S', 'K', 'L', 'V'};
+const uint32_t LEVEL_FILE_VERSION = 1;
+// A multiple of 64 and of 2^HEIGHT_PYRAMID_LEVELS, so chunks fill whole solid-mask words and pyramid blocks.
+const int LEVEL_CHUNK_SIZE = 64;
+const int LEVEL_CHUNK_BYTES = LEVEL_CHUNK_SIZE * LEVEL_CHUNK_SIZE;
+const int LEVEL_FILE_ALIGNMENT = 4096;
+// Caps each side so that cell counts, pyramid offsets and chunk indices all fit in an int.
+const int LEVEL_MAX_SIZE = 32768;
+// Static lights reach at most one chunk, so loading a chunk only changes the lighting of its neighbours.
+const float LEVEL_MAX_LIGHT_RADIUS = static_cast<float>(LEVEL_CHUNK_SIZE);
+
+/**
+ * @brief The start of a level file.
+ */
+struct LevelFileHeader {
+    char magic[4];
+    uint32_t version;
+    int32_t width;
+    int32_t height;
+    int32_t chunk_size;
+    int32_t chunks_x;
+    int32_t chunks_y;
+    int32_t light_count;
+    uint64_t lights_offset;
+    uint64_t chunks_offset;  // A multiple of LEVEL_FILE_ALIGNMENT.
+    float spawn_x;           // Where the player starts, in cells.
+    float spawn_y;
+    uint32_t seed;           // The seed the level was generated from, or 0 if it was authored.
+    uint32_t backend;        // The LightingBackendType to light the level with; AUTO leaves it to the player.
+};
+static_assert(sizeof(LevelFileHeader) == 64, "LevelFileHeader is part of the level format");
+
+/**
+ * @brief One static light as stored in a level file.
+ */
+struct LevelLight {
+    float x;
+    float y;
+    float radius;
+    int32_t intensity;
+    int32_t height;
+    int32_t reserved[3];
+};
+static_assert(sizeof(LevelLight) == 32, "LevelLight is part of the level format");
+
+class LevelFile {
+public:
+    LevelFile() = default;
+    ~LevelFile();
+
+    LevelFile(const LevelFile&) = delete;
+    LevelFile& operator=(const LevelFile&) = delete;
+
+    void open(const std::string& path);
+    void close();
+    void readLights(std::vector<RadialLight>& lights) const;
+    GridRect getChunkRect(int chunkX, int chunkY) const;
+    const uint8_t* getChunk(int chunkX, int chunkY) const;
+
+    bool isOpen() const { return data != nullptr; }
+    const LevelFileHeader& getHeader() const { return *header; }
+    LightingBackendType getBackend() const;
+    int getWidth() const { return header->width; }
+    int getHeight() const { return header->height; }
+    int getChunksX() const { return header->chunks_x; }
+    int getChunksY() const { return header->chunks_y; }
+
+private:
+    const uint8_t* data = nullptr;
+    size_t size = 0;
+    const LevelFileHeader* header = nullptr;
+    mutable std::unordered_map<int, std::vector<uint8_t>> clampedChunks;  // Copies of chunks that held heights out of range.
+};
+
+void write_level_file(const std::string& path, const Grid& grid, const std::vector<RadialLight>& lights, const Vector2D& spawn,
+                      uint32_t seed, LightingBackendType backend);
+
+#endif // LEVEL_FILE_H
@@ -0,0 +1,62 @@
+/**
+ * @file light_bins.h
+ * @brief Defines the per-tile light lists used to cull radial lights.
+ *
+ * Before a lighting pass, every light is binned into the LIGHT_TILE_SIZE
+ * tiles its radius can reach. A cell then only evaluates the lights of its
+ * own tile, so the cost of a pass follows how many lights overlap each tile
+ * rather than how many lights are in the scene. The lists are stored flat,
+ * as offsets into one index array, so they upload to the device as two
+ * buffers.
+ *
+ * The bins also record the cells the torch can reach, so a pass can split
+ * its regions into lit tiles, which some light may reach, and dark tiles,
+ * which only take the base level. Lighting work is then only launched over
+ * the lit tiles, and the cost of a pass follows the lit area.
+ */
+
+#ifndef LIGHT_BINS_H
+#define LIGHT_BINS_H
+
+#include <cstdint>
+#include <vector>
+#include "dirty_regions.h"
+
+struct RadialLight;
+struct Torch;
+
+static_assert(sizeof(GridRect) == 4 * sizeof(int32_t), "GridRect must match the int4 tiles in lighting_kernels.cl");
+
+class LightBins {
+public:
+    void build(const std::vector<RadialLight>& lights, const Torch& torch, bool torch_on, const GridRect& rect);
+    size_t collectTiles(const std::vector<GridRect>& regions, std::vector<GridRect>& tiles) const;
+
+    /**
+     * @brief Returns the bin of the tile holding a cell; the cell must lie in the binned rectangle.
+     */
+    int getBin(int x, int y) const {
+        return (y / LIGHT_TILE_SIZE - tileY0) * tilesX + (x / LIGHT_TILE_SIZE - tileX0);
+    }
+
+    const std::vector<int32_t>& getOffsets() const { return offsets; }
+    const std::vector<int32_t>& getIndices() const { return indices; }
+    int getTileX0() const { return tileX0; }
+    int getTileY0() const { return tileY0; }
+    int getTilesX() const { return tilesX; }
+    // The cells the torch can light, clipped to the binned rectangle; empty when it is off.
+    const GridRect& getTorchReach() const { return torchReach; }
+
+private:
+    int tileX0 = 0;
+    int tileY0 = 0;
+    int tilesX = 0;
+    int tilesY = 0;
+    GridRect torchReach = {0, 0, 0, 0};
+    // Bin b holds indices[offsets[b]] to indices[offsets[b + 1] - 1].
+    std::vector<int32_t> offsets;
+    std::vector<int32_t> indices;
+    std::vector<int32_t> order;
+};
+
+#endif // LIGHT_BINS_H
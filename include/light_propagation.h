@@ -0,0 +1,89 @@
+/**
+ * @file light_propagation.h
+ * @brief Defines the flood-fill light field used by the propagation engine.
+ *
+ * Instead of testing a line of sight from every cell to every light, light is
+ * spread outward from each source through passable cells, losing
+ * PROPAGATION_STRAIGHT_STEP per straight step and PROPAGATION_DIAGONAL_STEP
+ * per diagonal one, so it bends around corners and fades with path length.
+ * Solid cells are lit but do not pass light on.
+ *
+ * There is one field per light level. A light of level L seeds level k's
+ * field with a strength that shrinks as k grows, so a light is brightest
+ * around its cell and dims to level 1 at its radius; a cell's level is the
+ * highest level whose field reaches it. Fields combine sources with max, so
+ * they are kept up to date incrementally: a light that changes or goes away,
+ * and a cell whose height changes, is un-propagated by clearing every cell
+ * that may have depended on it, and the cleared area is refilled from its
+ * lit boundary and the remaining sources. The cost of an update follows the
+ * area the change affects, not the number of lights.
+ */
+
+#ifndef LIGHT_PROPAGATION_H
+#define LIGHT_PROPAGATION_H
+
+#include <cstdint>
+#include <deque>
+#include <utility>
+#include <vector>
+
+struct RadialLight;
+struct GridRect;
+class CollisionGrid;
+
+const int PROPAGATION_STRAIGHT_STEP = 2;
+const int PROPAGATION_DIAGONAL_STEP = 3;  // About sqrt(2) straight steps, so fields spread as octagons.
+const int PROPAGATION_MAX_STRENGTH = 255;
+
+class LightPropagation {
+public:
+    void reset(int gridWidth, int gridHeight, int levels);
+    void update(const std::vector<RadialLight>& lights, const std::vector<std::pair<int, int>>& changedCells, const CollisionGrid& terrain);
+
+    /**
+     * @brief Returns the light level of a cell: the highest level whose field reaches it.
+     */
+    int getLevel(int index) const {
+        for (int level = static_cast<int>(fields.size()); level > 0; --level) {
+            if (fields[level - 1][index] > 0) {
+                return level;
+            }
+        }
+        return 0;
+    }
+    // The cells whose field values may have changed in the last update.
+    const std::vector<int>& getTouchedCells() const { return touchedCells; }
+
+private:
+    struct Source {
+        int index;     // The light's cell, or -1 when it lies off the grid.
+        int level;
+        int strength;  // The field value at the light's cell on level 1's field.
+
+        bool operator==(const Source& other) const {
+            return index == other.index && level == other.level && strength == other.strength;
+        }
+    };
+
+    static Source captureSource(const RadialLight& light, int gridWidth, int gridHeight);
+    int getSeed(const Source& source, int level) const;
+    bool spreads(int index, const CollisionGrid& terrain) const;
+    void touch(int index);
+    void unpropagate(std::vector<uint8_t>& field);
+    void propagate(std::vector<uint8_t>& field, const CollisionGrid& terrain);
+
+    int width = 0;
+    int height = 0;
+    std::vector<std::vector<uint8_t>> fields;  // One per level, row-major; fields[k] is level k + 1.
+    std::vector<Source> sources;
+    std::vector<uint16_t> sourceCounts;  // Sources per cell; a source's cell spreads light even when solid.
+    std::vector<std::pair<int, int>> removeQueue;  // Cells to clear, with the value each held.
+    std::deque<int> fillQueue;
+    std::vector<uint8_t> touchedMask;
+    std::vector<int> touchedCells;
+};
+
+void flood_distances(const CollisionGrid& terrain, int x, int y, const GridRect& rect, int maxDistance,
+                     std::vector<uint16_t>& distances, std::vector<int>& queue);
+
+#endif // LIGHT_PROPAGATION_H
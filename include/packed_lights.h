@@ -0,0 +1,61 @@
+/**
+ * @file packed_lights.h
+ * @brief Defines the fp32 layouts of the lights as the lighting passes read them.
+ *
+ * RadialLight and Torch hold doubles for the simulation. Before a pass, each
+ * backend packs them into these structs: positions and radii rounded to
+ * float, the integer parts the occlusion walks start from, and the squared
+ * radius the distance test compares against. Both are a whole number of
+ * float4s, so the kernels can read a light in two 16-byte loads, and their
+ * layouts are checked at compile time here and in lighting_kernels.cl. The
+ * CPU engine evaluates the same packed values, so both backends do the same
+ * fp32 arithmetic.
+ */
+
+#ifndef PACKED_LIGHTS_H
+#define PACKED_LIGHTS_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+struct RadialLight;
+struct Torch;
+
+/**
+ * @brief A radial light packed for the lighting passes. Mirrors PackedLight in lighting_kernels.cl.
+ */
+struct alignas(16) PackedLight {
+    float x;               // Position, in cells.
+    float y;
+    float radius;
+    float radius_squared;
+    int32_t level;         // The intensity as a light level.
+    int32_t cell_x;        // The cell holding the light, where occlusion walks end.
+    int32_t cell_y;
+    int32_t height;
+};
+static_assert(sizeof(PackedLight) == 32, "PackedLight must match lighting_kernels.cl");
+static_assert(offsetof(PackedLight, level) == 16, "PackedLight must match lighting_kernels.cl");
+
+/**
+ * @brief The torch packed for the lighting passes. Mirrors PackedTorch in lighting_kernels.cl.
+ */
+struct alignas(16) PackedTorch {
+    float x;              // Position, in cells.
+    float y;
+    float direction_x;
+    float direction_y;
+    float radius;         // The current, breathing radius.
+    int32_t cell_x;
+    int32_t cell_y;
+    int32_t padding;
+};
+static_assert(sizeof(PackedTorch) == 32, "PackedTorch must match lighting_kernels.cl");
+static_assert(offsetof(PackedTorch, radius) == 16, "PackedTorch must match lighting_kernels.cl");
+
+PackedLight pack_light(const RadialLight& light);
+void pack_lights(const std::vector<RadialLight>& lights, std::vector<PackedLight>& packed);
+PackedTorch pack_torch(const Torch& torch);
+
+#endif // PACKED_LIGHTS_H
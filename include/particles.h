@@ -0,0 +1,58 @@
+/**
+ * @file particles.h
+ * @brief Defines the pooled particle system used for bullet hit sparks.
+ *
+ * Particles live in fixed-capacity structure-of-arrays storage: one array per
+ * field, so the update is a straight loop over floats the compiler can
+ * vectorise. Expired particles are removed by compacting the arrays in the
+ * same pass, and emission past the capacity is dropped, so the per-frame cost
+ * is bounded by the capacity no matter how heavy the firefight.
+ */
+
+#ifndef PARTICLES_H
+#define PARTICLES_H
+
+#include <cstdint>
+#include <random>
+#include <vector>
+
+struct Vector2D;
+
+const int MAX_PARTICLES = 131072;
+const int PARTICLES_PER_HIT = 30;
+const float PARTICLE_VELOCITY_DECAY = 0.7f;  // Fraction of velocity kept each frame.
+const int PARTICLE_FADE_FRAMES = 40;         // Lifetime at which a particle would be fully opaque.
+
+class ParticleSystem {
+public:
+    explicit ParticleSystem(int capacity = MAX_PARTICLES);
+
+    void emit(const Vector2D& hit_point, const Vector2D& normal, int count, std::mt19937& rng);
+    void update();
+    void render() const;
+    void clear() { count = 0; }
+    void copyFrom(const ParticleSystem& other);
+
+    int getCount() const { return count; }
+    int getCapacity() const { return capacity; }
+    long getDroppedCount() const { return dropped; }
+
+private:
+    int capacity;
+    int count;
+    long dropped;
+
+    std::vector<float> positionX;
+    std::vector<float> positionY;
+    std::vector<float> velocityX;
+    std::vector<float> velocityY;
+    std::vector<int16_t> lifetime;
+
+    // Per-pixel scratch for render, so overlapping sparks are drawn once.
+    mutable std::vector<uint32_t> pixelStamp;
+    mutable std::vector<int16_t> pixelLifetime;
+    mutable std::vector<int> drawnPixels;
+    mutable uint32_t renderFrame;
+};
+
+#endif // PARTICLES_H
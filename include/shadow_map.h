@@ -0,0 +1,73 @@
+/**
+ * @file shadow_map.h
+ * @brief Defines the per-light polar shadow profiles used by shadow-map occlusion.
+ *
+ * Instead of walking a Bresenham ray from every cell back to the light, each
+ * light gets a 1D profile per frame: for every angular bucket around the
+ * light's cell, the steepest downward slope to an occluder seen so far at each
+ * distance step. A cell at distance d is lit when that slope is no steeper than
+ * the slope from the light to the cell, so the per-cell test is a lookup and a
+ * light costs O(r^2) instead of O(r^3).
+ */
+
+#ifndef SHADOW_MAP_H
+#define SHADOW_MAP_H
+
+#include <cstdint>
+#include <vector>
+
+struct RadialLight;
+struct Torch;
+class CollisionGrid;
+class WorkerPool;
+
+const int SHADOW_MAP_MIN_BUCKETS = 64;
+
+/**
+ * @brief Where one light's profile lives in the shadow map.
+ *
+ * Mirrors ShadowSource in lighting_kernels.cl; the profile holds buckets x steps
+ * floats starting at offset.
+ */
+struct ShadowSource {
+    int32_t x;
+    int32_t y;
+    int32_t height;
+    int32_t buckets;
+    int32_t steps;
+    int32_t offset;
+    int32_t padding[2];
+};
+static_assert(sizeof(ShadowSource) == 32, "ShadowSource must match lighting_kernels.cl");
+
+class ShadowMap {
+public:
+    int layout(const std::vector<RadialLight>& lights, const Torch& torch, bool torch_on);
+    void build(const CollisionGrid& terrain, WorkerPool& workerPool);
+    bool isLit(int source, int x, int y, int height) const;
+
+    const std::vector<ShadowSource>& getSources() const { return sources; }
+    int getProfileSize() const { return profileSize; }
+
+private:
+    std::vector<ShadowSource> sources;
+    std::vector<float> profiles;
+    int profileSize = 0;
+};
+
+/**
+ * @brief How far shadow-map lighting differs from the Bresenham reference.
+ */
+struct OcclusionErrorReport {
+    long cells = 0;             // Cells compared.
+    long mismatched_cells = 0;  // Cells whose light level differs.
+    long over_lit_cells = 0;    // Cells the shadow map lights brighter than the rays do.
+    long under_lit_cells = 0;   // Cells the shadow map lights darker than the rays do.
+    int max_level_error = 0;
+    double mean_abs_error = 0.0;
+};
+
+OcclusionErrorReport compare_occlusion_modes(const CollisionGrid& terrain, const std::vector<RadialLight>& lights,
+                                             const Torch& torch, bool torch_on);
+
+#endif // SHADOW_MAP_H
@@ -0,0 +1,142 @@
+/**
+ * @file simulation.h
+ * @brief Defines the game world, its fixed-rate simulation thread and the snapshots it publishes.
+ *
+ * With the simulation on its own thread, the world is stepped at a fixed tick
+ * rate no matter how fast frames are drawn. After every tick the thread copies
+ * what the renderer needs into a WorldSnapshot, light levels and heights of
+ * the active rectangle included, and publishes it through a TripleBuffer. The
+ * render thread, which owns the window and SplashKit, draws the newest
+ * snapshot, interpolating the player and camera between the last two ticks,
+ * and hands its input to the simulation through an InputMailbox. The world
+ * and the lighting backend are only touched by the simulation thread while it
+ * runs.
+ */
+
+#ifndef SIMULATION_H
+#define SIMULATION_H
+
+#include "types.h"
+#include "triple_buffer.h"
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <exception>
+#include <mutex>
+#include <ostream>
+#include <thread>
+
+const int DEFAULT_TICK_RATE = 60;
+const int MAX_CATCH_UP_TICKS = 5;  // A tick this late is dropped instead of run back to back.
+
+/**
+ * @brief Everything the simulation steps, apart from the lighting backend.
+ */
+struct GameWorld {
+    int width = 0;
+    int height = 0;
+    Player player;
+    Player previousPlayer;
+    Camera camera;
+    Camera previousCamera;
+    GridRect activeRect = {0, 0, 0, 0};
+    Torch torch;
+    bool torch_on = true;
+    std::vector<RadialLight> radial_lights;
+    std::vector<Bullet> bullets;
+    ParticleSystem particles;
+    std::mt19937 rng;
+    long shots = 0;  // Bullets fired so far, so the renderer knows which sounds to play.
+    long hits = 0;   // Bullets that hit a wall so far.
+};
+
+/**
+ * @brief An immutable copy of the world after one tick, for the render thread.
+ */
+struct WorldSnapshot {
+    long tick = -1;  // -1 until the slot has been published once.
+    std::chrono::steady_clock::time_point publishedAt;
+    std::chrono::steady_clock::time_point inputSampledAt;  // When the input this tick used was read.
+    Player player;
+    Player previousPlayer;
+    Camera camera;
+    Camera previousCamera;
+    Torch torch;
+    bool torch_on = true;
+    std::vector<Bullet> bullets;
+    ParticleSystem particles;
+    std::vector<RadialLight> radial_lights;
+    GridRect rect = {0, 0, 0, 0};  // The active rectangle; heights and levels cover it row by row.
+    std::vector<uint8_t> heights;
+    std::vector<uint8_t> levels;
+    long shots = 0;
+    long hits = 0;
+    std::array<LatencySummary, FRAME_PHASE_COUNT> telemetry;  // The simulation thread's last window.
+    std::vector<DeviceCommandSummary> deviceProfile;
+};
+
+/**
+ * @brief Passes input from the render thread to the simulation thread.
+ *
+ * Held keys and the mouse are taken from the newest sample. Presses that can
+ * fall between two ticks are latched: a click fires on the next tick, and
+ * every torch toggle is delivered, one per tick.
+ */
+class InputMailbox {
+public:
+    void post(const InputState& input, std::chrono::steady_clock::time_point sampledAt);
+    bool take(InputState& input, std::chrono::steady_clock::time_point& sampledAt);
+
+private:
+    std::mutex mutex;
+    bool hasInput = false;
+    InputState latest = {};
+    std::chrono::steady_clock::time_point latestSampledAt;
+    bool fireLatched = false;
+    int pendingToggles = 0;
+};
+
+/**
+ * @brief Runs the simulation of a GameWorld at a fixed tick rate on its own thread.
+ */
+class SimulationThread {
+public:
+    SimulationThread(GameWorld& world, LightingBackend& lightingBackend, int tickRate, std::ostream* inputRecording);
+    ~SimulationThread();
+
+    SimulationThread(const SimulationThread&) = delete;
+    SimulationThread& operator=(const SimulationThread&) = delete;
+
+    void start();
+    void stop();
+    bool isFinished() const { return finished.load(std::memory_order_acquire); }
+
+    InputMailbox& getInput() { return input; }
+    TripleBuffer<WorldSnapshot>& getSnapshots() { return snapshots; }
+    double getTickSeconds() const { return tickSeconds; }
+    // Only safe to read once stop() has returned.
+    const FrameTelemetry& getTelemetry() const { return telemetry; }
+
+private:
+    void run();
+
+    GameWorld& world;
+    LightingBackend& lightingBackend;
+    double tickSeconds;
+    std::ostream* inputRecording;
+    InputMailbox input;
+    TripleBuffer<WorldSnapshot> snapshots;
+    FrameTelemetry telemetry;
+    std::thread thread;
+    std::atomic<bool> stopping{false};
+    std::atomic<bool> finished{false};
+    std::exception_ptr failure;
+};
+
+void step_world(GameWorld& world, LightingBackend& lightingBackend, const InputState& input, double total_time, double delta_time,
+                FrameTelemetry& telemetry);
+void capture_snapshot(const GameWorld& world, const LightingBackend& lightingBackend, WorldSnapshot& snapshot);
+Player interpolate_player(const Player& from, const Player& to, double alpha);
+Camera interpolate_camera(const Camera& from, const Camera& to, double alpha);
+
+#endif // SIMULATION_H
@@ -0,0 +1,68 @@
+/**
+ * @file triple_buffer.h
+ * @brief Defines a lock-free triple buffer for handing values from one thread to another.
+ *
+ * The writer fills its own slot and publishes it by swapping it with the
+ * shared middle slot; the reader swaps the middle slot for its own when a
+ * fresh one is waiting. Each side only ever touches its own slot, neither
+ * side waits for the other, and the reader always gets the newest complete
+ * value, skipping any it was too slow to see. Slots are reused, so values
+ * that hold vectors stop allocating once they have reached their size.
+ */
+
+#ifndef TRIPLE_BUFFER_H
+#define TRIPLE_BUFFER_H
+
+#include <array>
+#include <atomic>
+
+template <typename T>
+class TripleBuffer {
+public:
+    TripleBuffer() = default;
+
+    TripleBuffer(const TripleBuffer&) = delete;
+    TripleBuffer& operator=(const TripleBuffer&) = delete;
+
+    /**
+     * @brief The writer's slot. Only the writing thread may use it.
+     */
+    T& getWriteSlot() { return slots[writeIndex]; }
+
+    /**
+     * @brief Hands the writer's slot to the reader and takes the middle slot to write next.
+     */
+    void publish() {
+        int previous = middle.exchange(writeIndex | FRESH, std::memory_order_acq_rel);
+        writeIndex = previous & INDEX_MASK;
+    }
+
+    /**
+     * @brief Takes the newest published slot if there is one the reader has not seen.
+     * @return True if getReadSlot now returns a newer value.
+     */
+    bool acquire() {
+        if (!(middle.load(std::memory_order_relaxed) & FRESH)) {
+            return false;
+        }
+        int previous = middle.exchange(readIndex, std::memory_order_acq_rel);
+        readIndex = previous & INDEX_MASK;
+        return true;
+    }
+
+    /**
+     * @brief The reader's slot: the newest value acquired. Only the reading thread may use it.
+     */
+    const T& getReadSlot() const { return slots[readIndex]; }
+
+private:
+    static const int INDEX_MASK = 3;
+    static const int FRESH = 4;
+
+    std::array<T, 3> slots;
+    int writeIndex = 0;
+    alignas(64) std::atomic<int> middle{1};
+    alignas(64) int readIndex = 2;
+};
+
+#endif // TRIPLE_BUFFER_H
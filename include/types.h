@@ -3,7 +3,7 @@
  * @brief Defines the data structures and constants used throughout the game.
  *
  * This file contains definitions for game entities such as Player, Bullet, and Grid,
- * as well as the OpenCLWrapper class for handling GPU computations.
+ * as well as the LightingBackend interface with its OpenCL (GPU) and CPU implementations.
  */
 
 #ifndef TYPES_H
@@ -12,13 +12,29 @@
 #define CL_HPP_TARGET_OPENCL_VERSION 200
 
 #include "splashkit.h"
+#include <cstdint>
 #include <vector>
 #include <cmath>
 #include <CL/opencl.hpp>
 #include <string>
 #include <random>
+#include <memory>
+#include <ostream>
+#include "worker_pool.h"
+#include "collision_grid.h"
+#include "dirty_regions.h"
+#include "shadow_map.h"
+#include "light_bins.h"
+#include "light_propagation.h"
+#include "level_file.h"
+#include "packed_lights.h"
+#include "device_profiler.h"
+#include "frame_telemetry.h"
+#include "framebuffer.h"
+#include "particles.h"
+#include "camera.h"
 
-const int MAX_RADIAL_LIGHTS = 5;
+const int DEFAULT_RADIAL_LIGHTS = 5;
 const float PI = 3.14159265358979323846f;
 
 const int SCREEN_WIDTH = 900;
@@ -46,7 +62,7 @@ const double BULLET_SPEED = 10;
 const double BULLET_RADIUS = 3.0;
 const int BULLET_LIFETIME = 60;
 
-enum class HeightLevel {
+enum class HeightLevel : uint8_t {
     BLOCK1 = 5,
     BLOCK2 = 15,
     BLOCK3 = 25,
@@ -64,10 +80,12 @@ struct Vector2D {
     double x, y;
 };
 
+/**
+ * @brief One grid cell, packed into two bytes; its colour is derived from the height.
+ */
 struct Cell {
     HeightLevel height;
-    int light_level;
-    color base_color;
+    uint8_t light_level;
 };
 
 struct Grid {
@@ -97,6 +115,8 @@ struct RadialLight {
     double radius;
     Vector2D velocity;
     int height;
+    // Static lights never move; they are baked into a cached lightmap layer.
+    bool is_static;
 };
 
 struct Bullet {
@@ -105,70 +125,303 @@ struct Bullet {
     int lifetime;
 };
 
-struct Particle {
-    Vector2D position;
-    Vector2D velocity;
-    int lifetime;
-    color particle_color;
-    double velocity_decay;
+/**
+ * @brief A line segment to test against the grid, in grid coordinates.
+ */
+struct RaySegment {
+    Vector2D start;
+    Vector2D end;
+};
+
+/**
+ * @brief Result of testing one RaySegment against the grid.
+ *
+ * On a miss, point and cell are (-1, -1), normal is zero and distance is the
+ * segment length.
+ */
+struct RayHit {
+    bool hit;
+    Vector2D point;
+    int cell_x;
+    int cell_y;
+    Vector2D normal;
+    double distance;
+};
+
+/**
+ * @brief One frame of player input, sampled from SplashKit or replayed from a track.
+ */
+struct InputState {
+    Vector2D mouse;  // In world pixels, so it does not depend on where the camera is.
+    bool up;
+    bool down;
+    bool left;
+    bool right;
+    bool fire;
+    bool toggle_torch;
+};
+
+/**
+ * @brief How the lighting passes decide whether a cell can see a light.
+ */
+enum class OcclusionMode {
+    RAYCAST,    // Walk a Bresenham ray from every cell to the light.
+    SHADOW_MAP  // Look the cell up in a per-light polar shadow profile.
+};
+
+/**
+ * @brief Runtime switches shared by all lighting backends.
+ */
+struct LightingOptions {
+    // Recompute only tiles whose light level can have changed since the last pass.
+    bool incremental = false;
+    // Overlap device work with the host: readLightLevels returns the previous
+    // frame while the current one is computed. Only the OpenCL backend pipelines.
+    bool pipelined = false;
+    OcclusionMode occlusion = OcclusionMode::RAYCAST;
+    // Time every device command with OpenCL events; see DeviceProfiler. Only the OpenCL backend profiles.
+    bool profiling = false;
 };
 
-class OpenCLWrapper {
+enum class LightingBackendType {
+    AUTO,
+    OPENCL,
+    CPU,
+    FLOOD_FILL  // The CPU light-propagation engine; never picked by AUTO.
+};
+
+/**
+ * @brief Common interface for the engines that compute grid lighting.
+ *
+ * Every backend keeps the terrain in a host-side CollisionGrid. Collision
+ * queries and height reads are answered from it, so gameplay code never waits
+ * on the lighting device; backends only push height changes to their own copy.
+ */
+class LightingBackend {
 public:
-    OpenCLWrapper();
-    ~OpenCLWrapper();
+    virtual ~LightingBackend() = default;
 
-    void initialize();
-    void initializeGrid(const Grid& initialGrid);
-    void calculateLighting(const std::vector<RadialLight>& lights, const Torch& torch, bool torch_on);
+    virtual void initialize() = 0;
+    virtual void initializeGrid(const Grid& initialGrid) = 0;
+    virtual void initializeLevel(const LevelFile& level) = 0;
+    virtual void calculateLighting(const std::vector<RadialLight>& lights, const Torch& torch, bool torch_on) = 0;
+    virtual void readLightLevels(std::vector<uint8_t>& levels) const = 0;
+    virtual void readLightLevelRect(std::vector<uint8_t>& levels, const GridRect& rect) const = 0;
+    virtual std::string getName() const = 0;
+    virtual bool shadeOnDevice(const std::vector<uint32_t>& palette, const GridRect& rect, std::vector<uint32_t>& pixels) const;
+    virtual void setOptions(const LightingOptions& newOptions);
+    virtual DeviceProfiler* getDeviceProfiler() const { return nullptr; }
     void addCollisionPoint(int x, int y);
-    void readGridHeights(std::vector<int>& heights) const;
-    void readLightLevels(std::vector<int>& levels) const;
+    void setActiveRect(const GridRect& rect);
+    const GridRect& getActiveRect() const { return activeRect; }
+    const LightingOptions& getOptions() const { return options; }
+    int getLastUpdatedCellCount() const { return lastUpdatedCellCount; }
+    void readGridHeights(std::vector<uint8_t>& heights) const;
+    void castRays(const std::vector<RaySegment>& segments, std::vector<RayHit>& hits) const;
     void getCollisionPoint(const Vector2D& start, const Vector2D& end, Vector2D& hitPoint) const;
+    const CollisionGrid& getCollisionGrid() const { return collisionGrid; }
     int getGridWidth() const { return gridWidth; }
     int getGridHeight() const { return gridHeight; }
 
+protected:
+    void initializeHostGrid(const Grid& initialGrid);
+    void initializeHostLevel(const LevelFile& newLevel);
+    void streamLevelChunks(const GridRect& rect);
+    virtual void uploadLevelChunk(const GridRect& rect, const uint8_t* heights);
+    std::vector<GridRect> collectLightingRegions(const std::vector<RadialLight>& lights, const Torch& torch, bool torch_on);
+
+    CollisionGrid collisionGrid;
+    LightingOptions options;
+    LightingDirtyTracker dirtyTracker;
+    LightingDirtyTracker staticTracker;
+    std::vector<RadialLight> staticLights;
+    std::vector<RadialLight> dynamicLights;
+    std::vector<GridRect> staticRegions;
+    LightBins lightBins;
+    std::vector<std::pair<int, int>> changedCells;
+    // Lighting is only computed inside this rectangle; the whole grid unless a camera narrows it.
+    GridRect activeRect = {0, 0, 0, 0};
+    // The level chunks are streamed from, if the grid came from a level file, and which chunks are in.
+    const LevelFile* levelFile = nullptr;
+    std::vector<uint8_t> loadedChunks;
+    int lastUpdatedCellCount = 0;
+    int gridWidth = 0;
+    int gridHeight = 0;
+};
+
+class OpenCLWrapper : public LightingBackend {
+public:
+    OpenCLWrapper();
+    ~OpenCLWrapper() override;
+
+    void initialize() override;
+    void initializeGrid(const Grid& initialGrid) override;
+    void initializeLevel(const LevelFile& level) override;
+    void calculateLighting(const std::vector<RadialLight>& lights, const Torch& torch, bool torch_on) override;
+    void readLightLevels(std::vector<uint8_t>& levels) const override;
+    void readLightLevelRect(std::vector<uint8_t>& levels, const GridRect& rect) const override;
+    bool shadeOnDevice(const std::vector<uint32_t>& palette, const GridRect& rect, std::vector<uint32_t>& pixels) const override;
+    void setOptions(const LightingOptions& newOptions) override;
+    DeviceProfiler* getDeviceProfiler() const override { return &profiler; }
+    std::string getName() const override { return "OpenCL"; }
+
 private:
+    void createQueues();
+    void finishQueues() const;
+    cl::Program buildProgram();
+    std::vector<GridRect> splitRowBands(const GridRect& rect) const;
     void createBuffers(int width, int height);
     void updateGridHeights();
+    void uploadLevelChunk(const GridRect& rect, const uint8_t* heights) override;
+    void buildShadowProfiles(const std::vector<RadialLight>& lights, const Torch& torch, bool torch_on);
+    void runLightingPass(const std::vector<GridRect>& regions, const std::vector<RadialLight>& passLights,
+                         const Torch& torch, bool torch_on, cl::Buffer& target, bool onStaticLayer);
+    void reclaimSlot(int slot);
+    int presentedSlot() const;
+    void writeBuffer(const cl::Buffer& buffer, const void* data, size_t bytes, const char* name);
+    void reserveBuffer(cl::Buffer& buffer, size_t& capacity, size_t bytes, cl_mem_flags flags);
     std::string readKernelSource(const std::string& filename);
     std::string getOpenCLErrorDescription(cl_int error);
 
+    std::vector<cl::Device> devices;
     cl::Context context;
     cl::CommandQueue queue;
+    cl::CommandQueue transferQueue;
+    // One queue and private light-level buffer per extra device; their row bands are copied into the frame on queue.
+    std::vector<cl::CommandQueue> bandQueues;
+    std::vector<cl::Buffer> bandLevelsBuffers;
+    mutable DeviceProfiler profiler;
     cl::Program program;
-    cl::Kernel torchKernel;
-    cl::Kernel radialKernel;
+    cl::Kernel lightingKernel;
+    cl::Kernel fillBaseKernel;
     cl::Kernel updateHeightsKernel;
-    cl::Kernel raycastKernel;
+    cl::Kernel updatePyramidKernel;
+    cl::Kernel shadowProfileKernel;
+    mutable cl::Kernel shadeKernel;
     cl::Buffer gridHeightsBuffer;
-    cl::Buffer lightLevelsBuffer;
+    cl::Buffer heightPyramidBuffer;
+    // Light levels are double-buffered so a pipelined frame can be read back while the next is computed.
+    cl::Buffer lightLevelsBuffers[2];
+    int currentSlot = 0;
+    bool slotSubmitted[2] = {false, false};
+    cl::Event computeDone[2];
+    cl::Event heightsUpdated;
+    cl::Event readbackDone[2];
+    std::vector<cl_uchar> readbackLevels[2];
+    std::vector<std::vector<unsigned char>> uploadStaging[2];
+    cl::Buffer staticLevelsBuffer;
     cl::Buffer torchBuffer;
+    std::vector<PackedLight> packedLights;
     cl::Buffer radialLightsBuffer;
+    size_t radialLightsCapacity = 0;
+    cl::Buffer binOffsetsBuffer;
+    size_t binOffsetsCapacity = 0;
+    cl::Buffer binIndicesBuffer;
+    size_t binIndicesCapacity = 0;
+    std::vector<GridRect> lightTiles;
+    std::vector<GridRect> bandTiles;
+    cl::Buffer lightTilesBuffer;
+    size_t lightTilesCapacity = 0;
     cl::Buffer collisionBuffer;
+    cl::Buffer shadowSourcesBuffer;
+    size_t shadowSourcesCapacity = 0;
+    cl::Buffer shadowProfilesBuffer;
+    size_t shadowProfileCapacity = 0;
+    ShadowMap shadowMap;
+    mutable cl::Buffer paletteBuffer;
+    mutable std::vector<uint32_t> uploadedPalette;
+    mutable cl::Buffer pixelBuffer;
+    mutable size_t pixelCapacity = 0;
 
-    std::vector<cl_int2> collisionPoints;
-    int gridWidth;
-    int gridHeight;
     static const int MAX_COLLISIONS = 1000;
 };
 
+/**
+ * @brief Native lighting engine that runs the lighting kernels on CPU worker threads.
+ *
+ * Bands of rows are distributed across a WorkerPool. Each row first runs a
+ * branch-free distance test over its cells so the compiler can vectorize it,
+ * and only the cells inside a light's reach go on to the occlusion test.
+ */
+class CPULightingEngine : public LightingBackend {
+public:
+    explicit CPULightingEngine(unsigned int threadCount = 0);
+
+    void initialize() override;
+    void initializeGrid(const Grid& initialGrid) override;
+    void initializeLevel(const LevelFile& level) override;
+    void calculateLighting(const std::vector<RadialLight>& lights, const Torch& torch, bool torch_on) override;
+    void readLightLevels(std::vector<uint8_t>& levels) const override;
+    void readLightLevelRect(std::vector<uint8_t>& levels, const GridRect& rect) const override;
+    std::string getName() const override;
+
+private:
+    void calculatePass(const std::vector<GridRect>& regions, const std::vector<RadialLight>& lights, const Torch& torch, bool torch_on,
+                       const std::vector<uint8_t>* baseLevels, std::vector<uint8_t>& levels);
+    void calculateRegion(const GridRect& region, const std::vector<PackedLight>& lights, const PackedTorch& torch, bool torch_on,
+                         const std::vector<uint8_t>* baseLevels, std::vector<uint8_t>& levels);
+    bool isVisible(int source, int x1, int y1, int z1, int x2, int y2, int z2) const;
+    bool hasClearPath(int x1, int y1, int z1, int x2, int y2, int z2) const;
+
+    WorkerPool workerPool;
+    ShadowMap shadowMap;
+    std::vector<PackedLight> packedLights;
+    std::vector<uint8_t> staticLevels;
+    std::vector<uint8_t> lightLevels;
+};
+
+/**
+ * @brief Lighting engine that floods light through open cells instead of testing lines of sight.
+ *
+ * The radial lights live in a LightPropagation, which is updated
+ * incrementally as lights move and terrain is destroyed, so a frame costs
+ * what changed rather than what is lit. The torch, which moves every frame,
+ * is flooded afresh over its reach and laid on top. Levels differ from the
+ * ray-traced backends by design: light bends around corners, fades with
+ * path length and is blocked by any solid cell, whatever its height.
+ */
+class FloodFillLightingEngine : public LightingBackend {
+public:
+    void initialize() override;
+    void initializeGrid(const Grid& initialGrid) override;
+    void initializeLevel(const LevelFile& level) override;
+    void calculateLighting(const std::vector<RadialLight>& lights, const Torch& torch, bool torch_on) override;
+    void readLightLevels(std::vector<uint8_t>& levels) const override;
+    void readLightLevelRect(std::vector<uint8_t>& levels, const GridRect& rect) const override;
+    std::string getName() const override { return "CPU light propagation"; }
+
+private:
+    void uploadLevelChunk(const GridRect& rect, const uint8_t* heights) override;
+    void applyTorch(const Torch& torch);
+
+    LightPropagation propagation;
+    std::vector<uint8_t> lightLevels;
+    GridRect torchRect = {0, 0, 0, 0};  // The cells the torch lit last frame.
+    std::vector<uint16_t> torchDistances;
+    std::vector<int> torchQueue;
+};
+
 // Function declarations
-Grid create_grid(int width, int height);
-void update_player(Player& player, OpenCLWrapper& openclWrapper);
+std::unique_ptr<LightingBackend> create_lighting_backend(LightingBackendType type);
+LightingBackendType parse_lighting_backend_type(const std::string& name);
+OcclusionMode parse_occlusion_mode(const std::string& name);
+Grid create_grid(int width, int height, unsigned int seed);
+std::vector<RadialLight> create_radial_lights(int num_lights, int num_static, int grid_width, int grid_height, unsigned int seed);
+InputState read_input();
+std::vector<InputState> load_input_track(const std::string& filename);
+void write_input_frame(std::ostream& out, const InputState& input);
+void update_player(Player& player, const InputState& input, LightingBackend& lightingBackend);
 double calculate_breathing_radius(double base_radius, double total_time);
 void update_torch(Torch& torch, const Player& player, double total_time);
-void update_grid_lighting(const std::vector<RadialLight>& lights, const Torch& torch, bool torch_on, OpenCLWrapper& openclWrapper);
-void render_grid(const OpenCLWrapper& openclWrapper);
+void update_grid_lighting(const std::vector<RadialLight>& lights, const Torch& torch, bool torch_on, LightingBackend& lightingBackend);
+void render_grid(const LightingBackend& lightingBackend, const GridRect& rect);
+void render_grid(const std::vector<uint8_t>& heights, const std::vector<uint8_t>& lightLevels, const GridRect& rect);
 void render_player(const Player& player);
 color apply_lighting(color base_color, int light_level);
-void update_bullets(std::vector<Bullet>& bullets, std::vector<Particle>& particles, OpenCLWrapper& openclWrapper);
+int update_bullets(std::vector<Bullet>& bullets, ParticleSystem& particles, std::mt19937& rng, LightingBackend& lightingBackend);
 void create_bullet(std::vector<Bullet>& bullets, Player& player);
 void render_bullets(const std::vector<Bullet>& bullets);
 void update_radial_light_movers(std::vector<RadialLight>& lights, int gridWidth, int gridHeight, double deltaTime);
-void create_particles(std::vector<Particle>& particles, const Vector2D& hit_point, const Vector2D& normal, int count);
-void update_particles(std::vector<Particle>& particles);
-void render_particles(const std::vector<Particle>& particles);
 void draw_crosshair();
 
 inline color height_to_color(HeightLevel height) {
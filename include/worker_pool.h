@@ -0,0 +1,48 @@
+/**
+ * @file worker_pool.h
+ * @brief Defines a small persistent thread pool for row-parallel grid work.
+ *
+ * The pool keeps its worker threads alive for the lifetime of the owner so
+ * that per-frame passes over the grid do not pay thread start-up costs.
+ */
+
+#ifndef WORKER_POOL_H
+#define WORKER_POOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class WorkerPool {
+public:
+    explicit WorkerPool(unsigned int threadCount = 0);
+    ~WorkerPool();
+
+    WorkerPool(const WorkerPool&) = delete;
+    WorkerPool& operator=(const WorkerPool&) = delete;
+
+    void parallelFor(int begin, int end, int chunkSize, const std::function<void(int, int)>& task);
+    unsigned int getThreadCount() const { return static_cast<unsigned int>(workers.size()) + 1; }
+
+private:
+    void workerLoop();
+    void runChunks();
+
+    std::vector<std::thread> workers;
+    std::mutex mutex;
+    std::condition_variable wakeCondition;
+    std::condition_variable doneCondition;
+
+    const std::function<void(int, int)>* currentTask;
+    int rangeEnd;
+    int rangeChunk;
+    std::atomic<int> nextIndex;
+    int activeWorkers;
+    unsigned long generation;
+    bool stopping;
+};
+
+#endif // WORKER_POOL_H
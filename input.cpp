@@ -0,0 +1,90 @@
+/**
+ * @file input.cpp
+ * @brief Implements input sampling and input-track recording for the game.
+ *
+ * Gameplay code reads an InputState instead of querying SplashKit directly,
+ * so a frame's input can come from the live window or from a recorded track.
+ * A track is a text file with one frame per line: "<mouse_x> <mouse_y> <keys>",
+ * with the mouse in world pixels, where keys lists the held buttons as W, A, S, D, F (fire) and T (torch
+ * toggle), or "-" when nothing is pressed.
+ */
+
+#include "./include/types.h"
+#include "splashkit.h"
+#include <fstream>
+#include <sstream>
+
+/**
+ * @brief Samples the current SplashKit input state.
+ *
+ * @return The input for this frame.
+ */
+InputState read_input() {
+    point_2d mouse_pos = to_world(mouse_position());
+    InputState input;
+    input.mouse = {mouse_pos.x, mouse_pos.y};
+    input.up = key_down(W_KEY);
+    input.down = key_down(S_KEY);
+    input.left = key_down(A_KEY);
+    input.right = key_down(D_KEY);
+    input.fire = mouse_down(LEFT_BUTTON);
+    input.toggle_torch = key_typed(T_KEY);
+    return input;
+}
+
+/**
+ * @brief Writes one frame of input in track format.
+ *
+ * @param out The stream to write to.
+ * @param input The input to record.
+ */
+void write_input_frame(std::ostream& out, const InputState& input) {
+    std::string keys;
+    if (input.up) keys += 'W';
+    if (input.left) keys += 'A';
+    if (input.down) keys += 'S';
+    if (input.right) keys += 'D';
+    if (input.fire) keys += 'F';
+    if (input.toggle_torch) keys += 'T';
+    if (keys.empty()) keys = "-";
+    out << input.mouse.x << ' ' << input.mouse.y << ' ' << keys << '\n';
+}
+
+/**
+ * @brief Loads a recorded input track.
+ *
+ * @param filename The track file to read.
+ * @return One InputState per recorded frame.
+ * @throws std::runtime_error If the file cannot be opened or a line is malformed.
+ */
+std::vector<InputState> load_input_track(const std::string& filename) {
+    std::ifstream file(filename);
+    if (!file.is_open()) {
+        throw std::runtime_error("Failed to open input track: " + filename);
+    }
+
+    std::vector<InputState> track;
+    std::string line;
+    int line_number = 0;
+    while (std::getline(file, line)) {
+        line_number++;
+        if (line.empty() || line[0] == '#') {
+            continue;
+        }
+
+        std::istringstream fields(line);
+        InputState input = {};
+        std::string keys;
+        if (!(fields >> input.mouse.x >> input.mouse.y >> keys)) {
+            throw std::runtime_error("Malformed input track line " + std::to_string(line_number) + " in " + filename);
+        }
+        input.up = keys.find('W') != std::string::npos;
+        input.left = keys.find('A') != std::string::npos;
+        input.down = keys.find('S') != std::string::npos;
+        input.right = keys.find('D') != std::string::npos;
+        input.fire = keys.find('F') != std::string::npos;
+        input.toggle_torch = keys.find('T') != std::string::npos;
+        track.push_back(input);
+    }
+    return track;
+}
@@ -0,0 +1,251 @@
+/**
+ * @file level_file.cpp
+ * @brief Implements the level file reader and writer.
+ */
+
+#include "./include/types.h"
+#include <algorithm>
+#include <climits>
+#include <cmath>
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+    uint64_t align_offset(uint64_t offset) {
+        return (offset + LEVEL_FILE_ALIGNMENT - 1) / LEVEL_FILE_ALIGNMENT * LEVEL_FILE_ALIGNMENT;
+    }
+
+    int chunk_count(int cells) {
+        return (cells + LEVEL_CHUNK_SIZE - 1) / LEVEL_CHUNK_SIZE;
+    }
+
+    /**
+     * @brief Tests whether count records of recordSize bytes starting at offset lie inside a file of size bytes.
+     */
+    bool fits(uint64_t offset, uint64_t count, uint64_t recordSize, uint64_t size) {
+        return offset <= size && count <= (size - offset) / recordSize;
+    }
+
+    /**
+     * @brief Tests whether a light can be lit without leaving the grid or the shade tables.
+     */
+    bool valid_light(const LevelLight& light, int width, int height) {
+        return light.intensity >= 1 && light.intensity <= LIGHT_LEVELS &&
+               std::isfinite(light.radius) && light.radius > 0.0f && light.radius <= LEVEL_MAX_LIGHT_RADIUS &&
+               light.x >= 0.0f && light.x < static_cast<float>(width) && light.y >= 0.0f && light.y < static_cast<float>(height) &&
+               light.height >= 0 && light.height <= static_cast<int>(HeightLevel::RADIAL);
+    }
+}
+
+LevelFile::~LevelFile() {
+    close();
+}
+
+/**
+ * @brief Maps a level file and checks its header.
+ *
+ * Only the header is read here; the lights and chunks are paged in when they
+ * are first used. Any level already open is closed first.
+ *
+ * @param path The file to open.
+ * @throws std::runtime_error If the file cannot be mapped, is not a level of this version, or holds
+ *         offsets, sizes, lights or a spawn point that do not fit the level.
+ */
+void LevelFile::open(const std::string& path) {
+    close();
+
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw std::runtime_error("Failed to open level file: " + path);
+    }
+    struct stat status;
+    if (fstat(fd, &status) != 0 || status.st_size < static_cast<off_t>(sizeof(LevelFileHeader))) {
+        ::close(fd);
+        throw std::runtime_error("Level file is too short: " + path);
+    }
+    size = static_cast<size_t>(status.st_size);
+    void* mapping = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (mapping == MAP_FAILED) {
+        size = 0;
+        throw std::runtime_error("Failed to map level file: " + path);
+    }
+    // Chunks are loaded where the camera goes, not in file order.
+    madvise(mapping, size, MADV_RANDOM);
+    data = static_cast<const uint8_t*>(mapping);
+    header = reinterpret_cast<const LevelFileHeader*>(data);
+
+    const char* problem = nullptr;
+    if (std::memcmp(header->magic, LEVEL_FILE_MAGIC, sizeof(LEVEL_FILE_MAGIC)) != 0) {
+        problem = "not a level file";
+    } else if (header->version != LEVEL_FILE_VERSION) {
+        problem = "unsupported version";
+    } else if (header->width <= 0 || header->height <= 0 || header->width > LEVEL_MAX_SIZE || header->height > LEVEL_MAX_SIZE ||
+               header->chunk_size != LEVEL_CHUNK_SIZE ||
+               header->chunks_x != chunk_count(header->width) || header->chunks_y != chunk_count(header->height) ||
+               header->light_count < 0 || header->lights_offset < sizeof(LevelFileHeader) || header->lights_offset % 4 != 0 ||
+               header->chunks_offset % LEVEL_FILE_ALIGNMENT != 0 ||
+               header->backend > static_cast<uint32_t>(LightingBackendType::FLOOD_FILL)) {
+        problem = "bad header";
+    } else if (!fits(header->lights_offset, static_cast<uint64_t>(header->light_count), sizeof(LevelLight), size) ||
+               !fits(header->chunks_offset, static_cast<uint64_t>(header->chunks_x) * header->chunks_y, LEVEL_CHUNK_BYTES, size)) {
+        problem = "truncated";
+    } else if (!std::isfinite(header->spawn_x) || !std::isfinite(header->spawn_y) || header->spawn_x < 0.0f || header->spawn_y < 0.0f ||
+               header->spawn_x >= static_cast<float>(header->width) || header->spawn_y >= static_cast<float>(header->height)) {
+        problem = "spawn off the grid";
+    } else {
+        const LevelLight* lights = reinterpret_cast<const LevelLight*>(data + header->lights_offset);
+        for (int i = 0; i < header->light_count && !problem; ++i) {
+            if (!valid_light(lights[i], header->width, header->height)) {
+                problem = "bad light";
+            }
+        }
+    }
+    if (problem) {
+        close();
+        throw std::runtime_error("Bad level file (" + std::string(problem) + "): " + path);
+    }
+}
+
+/**
+ * @brief Unmaps the file; chunk pointers handed out before become invalid.
+ */
+void LevelFile::close() {
+    if (data) {
+        munmap(const_cast<uint8_t*>(data), size);
+    }
+    data = nullptr;
+    size = 0;
+    header = nullptr;
+    clampedChunks.clear();
+}
+
+/**
+ * @brief Reads the level's static lights, which open has checked.
+ * @param lights Receives the lights, marked static and not moving.
+ */
+void LevelFile::readLights(std::vector<RadialLight>& lights) const {
+    const LevelLight* stored = reinterpret_cast<const LevelLight*>(data + header->lights_offset);
+    lights.clear();
+    lights.reserve(header->light_count);
+    for (int i = 0; i < header->light_count; ++i) {
+        lights.push_back({{stored[i].x, stored[i].y}, static_cast<double>(stored[i].intensity), stored[i].radius, {0, 0},
+                          stored[i].height, true});
+    }
+}
+
+/**
+ * @brief Returns the cells a chunk covers, clipped to the level.
+ */
+GridRect LevelFile::getChunkRect(int chunkX, int chunkY) const {
+    return {chunkX * LEVEL_CHUNK_SIZE, chunkY * LEVEL_CHUNK_SIZE, std::min((chunkX + 1) * LEVEL_CHUNK_SIZE, header->width),
+            std::min((chunkY + 1) * LEVEL_CHUNK_SIZE, header->height)};
+}
+
+/**
+ * @brief Returns a chunk's heights, LEVEL_CHUNK_SIZE rows of LEVEL_CHUNK_SIZE bytes.
+ *
+ * The heights come straight from the mapping unless the chunk holds heights
+ * above HeightLevel::RADIAL, which the shade tables have no row for: such a
+ * chunk is copied once with those heights clamped, and the copy is returned.
+ * The pointer stays valid until the level is closed.
+ */
+const uint8_t* LevelFile::getChunk(int chunkX, int chunkY) const {
+    int index = chunkY * header->chunks_x + chunkX;
+    const uint8_t* heights = data + header->chunks_offset + static_cast<size_t>(index) * LEVEL_CHUNK_BYTES;
+    const uint8_t highest = static_cast<uint8_t>(HeightLevel::RADIAL);
+    if (std::all_of(heights, heights + LEVEL_CHUNK_BYTES, [&](uint8_t value) { return value <= highest; })) {
+        return heights;
+    }
+    auto found = clampedChunks.find(index);
+    if (found == clampedChunks.end()) {
+        std::vector<uint8_t> clamped(heights, heights + LEVEL_CHUNK_BYTES);
+        for (auto& value : clamped) {
+            value = std::min(value, highest);
+        }
+        found = clampedChunks.emplace(index, std::move(clamped)).first;
+    }
+    return found->second.data();
+}
+
+/**
+ * @brief Returns the lighting backend the level asks for; AUTO when it has no preference.
+ */
+LightingBackendType LevelFile::getBackend() const {
+    return static_cast<LightingBackendType>(header->backend);
+}
+
+/**
+ * @brief Writes a grid and its static lights as a level file.
+ *
+ * @param path The file to write.
+ * @param grid The heights to store.
+ * @param lights The scene's lights; only the static ones are stored.
+ * @param spawn Where the player starts.
+ * @param seed The seed the grid was generated from, or 0.
+ * @param backend The lighting backend to light the level with, or AUTO.
+ * @throws std::runtime_error If the level breaks the format's limits or the file cannot be written.
+ */
+void write_level_file(const std::string& path, const Grid& grid, const std::vector<RadialLight>& lights, const Vector2D& spawn,
+                      uint32_t seed, LightingBackendType backend) {
+    if (grid.width <= 0 || grid.height <= 0 || grid.width > LEVEL_MAX_SIZE || grid.height > LEVEL_MAX_SIZE) {
+        throw std::runtime_error("Level is too large to store: " + path);
+    }
+    std::vector<LevelLight> stored;
+    for (const auto& light : lights) {
+        if (light.is_static) {
+            stored.push_back({static_cast<float>(light.position.x), static_cast<float>(light.position.y), static_cast<float>(light.radius),
+                              static_cast<int32_t>(light.intensity), light.height, {0, 0, 0}});
+            if (!valid_light(stored.back(), grid.width, grid.height)) {
+                throw std::runtime_error("Static light cannot be stored in a level file: " + path);
+            }
+        }
+    }
+
+    LevelFileHeader header = {};
+    std::memcpy(header.magic, LEVEL_FILE_MAGIC, sizeof(LEVEL_FILE_MAGIC));
+    header.version = LEVEL_FILE_VERSION;
+    header.width = grid.width;
+    header.height = grid.height;
+    header.chunk_size = LEVEL_CHUNK_SIZE;
+    header.chunks_x = chunk_count(grid.width);
+    header.chunks_y = chunk_count(grid.height);
+    header.light_count = static_cast<int32_t>(stored.size());
+    header.lights_offset = sizeof(LevelFileHeader);
+    header.chunks_offset = align_offset(header.lights_offset + stored.size() * sizeof(LevelLight));
+    header.spawn_x = static_cast<float>(spawn.x);
+    header.spawn_y = static_cast<float>(spawn.y);
+    header.seed = seed;
+    header.backend = static_cast<uint32_t>(backend);
+
+    std::ofstream out(path, std::ios::binary);
+    if (!out.is_open()) {
+        throw std::runtime_error("Failed to open level file: " + path);
+    }
+    out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    out.write(reinterpret_cast<const char*>(stored.data()), stored.size() * sizeof(LevelLight));
+    std::vector<char> padding(header.chunks_offset - header.lights_offset - stored.size() * sizeof(LevelLight), 0);
+    out.write(padding.data(), padding.size());
+
+    std::vector<uint8_t> chunk(LEVEL_CHUNK_BYTES);
+    for (int chunkY = 0; chunkY < header.chunks_y; ++chunkY) {
+        for (int chunkX = 0; chunkX < header.chunks_x; ++chunkX) {
+            std::fill(chunk.begin(), chunk.end(), static_cast<uint8_t>(HeightLevel::FLOOR));
+            for (int y = chunkY * LEVEL_CHUNK_SIZE; y < std::min((chunkY + 1) * LEVEL_CHUNK_SIZE, grid.height); ++y) {
+                for (int x = chunkX * LEVEL_CHUNK_SIZE; x < std::min((chunkX + 1) * LEVEL_CHUNK_SIZE, grid.width); ++x) {
+                    chunk[(y % LEVEL_CHUNK_SIZE) * LEVEL_CHUNK_SIZE + x % LEVEL_CHUNK_SIZE] =
+                        static_cast<uint8_t>(grid.cells[y * grid.width + x].height);
+                }
+            }
+            out.write(reinterpret_cast<const char*>(chunk.data()), chunk.size());
+        }
+    }
+    if (!out) {
+        throw std::runtime_error("Failed to write level file: " + path);
+    }
+}
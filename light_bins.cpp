@@ -0,0 +1,110 @@
+/**
+ * @file light_bins.cpp
+ * @brief Implements the per-tile light lists.
+ */
+
+#include "./include/types.h"
+#include <algorithm>
+#include <numeric>
+
+/**
+ * @brief Bins the lights and the torch's reach into the tiles of a rectangle of cells.
+ *
+ * A light goes into every tile its radius reaches, with one cell of slack for
+ * rounding in the kernels, like the dirty tracker. Each bin lists its lights
+ * from the brightest down, so a cell can stop at the first light that is no
+ * brighter than the level it already has. The bins are filled in two passes
+ * over the lights: one to count, one to write.
+ *
+ * The torch lights cells up to twice its current radius away; its reach gets
+ * the same cell of slack.
+ *
+ * @param lights The lights of the pass; bins hold indices into this vector.
+ * @param torch The player's torch.
+ * @param torch_on Whether the pass evaluates the torch.
+ * @param rect The cells that will be computed.
+ */
+void LightBins::build(const std::vector<RadialLight>& lights, const Torch& torch, bool torch_on, const GridRect& rect) {
+    tileX0 = rect.x0 / LIGHT_TILE_SIZE;
+    tileY0 = rect.y0 / LIGHT_TILE_SIZE;
+    tilesX = std::max(0, (rect.x1 + LIGHT_TILE_SIZE - 1) / LIGHT_TILE_SIZE - tileX0);
+    tilesY = std::max(0, (rect.y1 + LIGHT_TILE_SIZE - 1) / LIGHT_TILE_SIZE - tileY0);
+
+    torchReach = {0, 0, 0, 0};
+    if (torch_on) {
+        double reach = torch.current_radius * 2.0 + 1.0;
+        torchReach = {std::max(static_cast<int>(std::floor(torch.position.x - reach)), rect.x0),
+                      std::max(static_cast<int>(std::floor(torch.position.y - reach)), rect.y0),
+                      std::min(static_cast<int>(std::floor(torch.position.x + reach)) + 1, rect.x1),
+                      std::min(static_cast<int>(std::floor(torch.position.y + reach)) + 1, rect.y1)};
+    }
+
+    order.resize(lights.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(), [&](int32_t a, int32_t b) {
+        return static_cast<int>(lights[a].intensity) > static_cast<int>(lights[b].intensity);
+    });
+
+    offsets.assign(tilesX * tilesY + 1, 0);
+    auto for_each_tile = [&](const RadialLight& light, auto&& visit) {
+        double reach = light.radius + 1.0;
+        int tx0 = std::max(static_cast<int>(std::floor((light.position.x - reach) / LIGHT_TILE_SIZE)), tileX0);
+        int ty0 = std::max(static_cast<int>(std::floor((light.position.y - reach) / LIGHT_TILE_SIZE)), tileY0);
+        int tx1 = std::min(static_cast<int>(std::floor((light.position.x + reach) / LIGHT_TILE_SIZE)), tileX0 + tilesX - 1);
+        int ty1 = std::min(static_cast<int>(std::floor((light.position.y + reach) / LIGHT_TILE_SIZE)), tileY0 + tilesY - 1);
+        for (int ty = ty0; ty <= ty1; ++ty) {
+            double dy = light.position.y - std::max<double>(ty * LIGHT_TILE_SIZE, std::min<double>(light.position.y, (ty + 1) * LIGHT_TILE_SIZE - 1));
+            for (int tx = tx0; tx <= tx1; ++tx) {
+                double dx = light.position.x - std::max<double>(tx * LIGHT_TILE_SIZE, std::min<double>(light.position.x, (tx + 1) * LIGHT_TILE_SIZE - 1));
+                if (std::sqrt(dx * dx + dy * dy) <= reach) {
+                    visit((ty - tileY0) * tilesX + (tx - tileX0));
+                }
+            }
+        }
+    };
+
+    for (int32_t l : order) {
+        for_each_tile(lights[l], [&](int bin) { ++offsets[bin + 1]; });
+    }
+    std::partial_sum(offsets.begin(), offsets.end(), offsets.begin());
+
+    indices.resize(offsets.back());
+    std::vector<int32_t> cursor(offsets.begin(), offsets.end() - 1);
+    for (int32_t l : order) {
+        for_each_tile(lights[l], [&](int bin) { indices[cursor[bin]++] = l; });
+    }
+}
+
+/**
+ * @brief Splits regions of the binned rectangle into their tiles, lit tiles first.
+ *
+ * A tile is lit when its bin holds a light or the torch's reach overlaps it;
+ * every other cell of it keeps its base level. Tiles follow the bin grid and
+ * are clipped to their region, so regions need not start or end on tile edges.
+ *
+ * @param regions The cells of the pass; they must lie inside the binned rectangle.
+ * @param tiles Receives the lit tiles followed by the dark ones.
+ * @return The number of lit tiles.
+ */
+size_t LightBins::collectTiles(const std::vector<GridRect>& regions, std::vector<GridRect>& tiles) const {
+    tiles.clear();
+    size_t darkTiles = 0;
+    for (const auto& region : regions) {
+        for (int y = region.y0; y < region.y1; y = (y / LIGHT_TILE_SIZE + 1) * LIGHT_TILE_SIZE) {
+            for (int x = region.x0; x < region.x1; x = (x / LIGHT_TILE_SIZE + 1) * LIGHT_TILE_SIZE) {
+                GridRect tile = {x, y, std::min((x / LIGHT_TILE_SIZE + 1) * LIGHT_TILE_SIZE, region.x1),
+                                 std::min((y / LIGHT_TILE_SIZE + 1) * LIGHT_TILE_SIZE, region.y1)};
+                int bin = getBin(x, y);
+                bool lit = offsets[bin + 1] > offsets[bin] ||
+                           (tile.x0 < torchReach.x1 && torchReach.x0 < tile.x1 && tile.y0 < torchReach.y1 && torchReach.y0 < tile.y1);
+                tiles.push_back(tile);
+                if (!lit) {
+                    ++darkTiles;
+                } else if (darkTiles > 0) {
+                    std::swap(tiles.back(), tiles[tiles.size() - 1 - darkTiles]);
+                }
+            }
+        }
+    }
+    return tiles.size() - darkTiles;
+}
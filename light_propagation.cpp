@@ -0,0 +1,290 @@
+/**
+ * @file light_propagation.cpp
+ * @brief Implements the incremental flood-fill light fields.
+ */
+
+#include "./include/types.h"
+#include <algorithm>
+#include <cmath>
+
+namespace {
+    const int NEIGHBOURS = 8;
+    const int NEIGHBOUR_DX[NEIGHBOURS] = {1, -1, 0, 0, 1, 1, -1, -1};
+    const int NEIGHBOUR_DY[NEIGHBOURS] = {0, 0, 1, -1, 1, -1, 1, -1};
+}
+
+/**
+ * @brief Sizes the fields for a grid and clears them; the next update seeds every light.
+ * @param gridWidth The width of the grid in cells.
+ * @param gridHeight The height of the grid in cells.
+ * @param levels The number of light levels, and so of fields.
+ */
+void LightPropagation::reset(int gridWidth, int gridHeight, int levels) {
+    width = gridWidth;
+    height = gridHeight;
+    fields.assign(levels, std::vector<uint8_t>(width * height, 0));
+    sources.clear();
+    sourceCounts.assign(width * height, 0);
+    touchedMask.assign(width * height, 0);
+    touchedCells.clear();
+}
+
+/**
+ * @brief Brings the fields up to date with the lights and the terrain.
+ *
+ * Lights are compared with the previous update by position in the list: each
+ * one whose cell, level or radius changed is un-propagated from its old cell,
+ * as is every changed cell, and then every source is re-seeded where its
+ * cell is darker than it, which also seeds new lights. Lights that only
+ * moved within their cell leave the fields untouched.
+ *
+ * @param lights The radial lights in the scene.
+ * @param changedCells Cells whose height changed since the last update.
+ * @param terrain The heights after the changes.
+ */
+void LightPropagation::update(const std::vector<RadialLight>& lights, const std::vector<std::pair<int, int>>& changedCells,
+                              const CollisionGrid& terrain) {
+    for (int index : touchedCells) {
+        touchedMask[index] = 0;
+    }
+    touchedCells.clear();
+
+    std::vector<Source> removed;
+    std::vector<Source> current;
+    current.reserve(lights.size());
+    for (size_t i = 0; i < std::max(lights.size(), sources.size()); ++i) {
+        if (i < lights.size()) {
+            current.push_back(captureSource(lights[i], width, height));
+        }
+        if (i < sources.size() && (i >= current.size() || !(sources[i] == current[i]))) {
+            removed.push_back(sources[i]);
+        }
+    }
+
+    // Update the counts before un-propagating, so a removed light's cell only spreads if another source or the terrain lets it.
+    for (const auto& source : removed) {
+        if (source.index >= 0) {
+            --sourceCounts[source.index];
+        }
+    }
+    for (size_t i = 0; i < current.size(); ++i) {
+        if (current[i].index >= 0 && (i >= sources.size() || !(sources[i] == current[i]))) {
+            ++sourceCounts[current[i].index];
+        }
+    }
+
+    for (size_t level = 0; level < fields.size(); ++level) {
+        std::vector<uint8_t>& field = fields[level];
+        // A removed light's cell may also have passed on other lights' light, whatever the light's own level.
+        for (const auto& source : removed) {
+            if (source.index >= 0 && field[source.index] > 0) {
+                removeQueue.emplace_back(source.index, field[source.index]);
+            }
+        }
+        for (const auto& cell : changedCells) {
+            int index = cell.second * width + cell.first;
+            if (field[index] > 0) {
+                removeQueue.emplace_back(index, field[index]);
+            }
+            // If the cell opened up, its lit neighbours can now spread through it.
+            for (int n = 0; n < NEIGHBOURS; ++n) {
+                int nx = cell.first + NEIGHBOUR_DX[n];
+                int ny = cell.second + NEIGHBOUR_DY[n];
+                if (nx >= 0 && ny >= 0 && nx < width && ny < height) {
+                    fillQueue.push_back(ny * width + nx);
+                }
+            }
+        }
+        for (const auto& entry : removeQueue) {
+            field[entry.first] = 0;
+            touch(entry.first);
+        }
+        unpropagate(field);
+
+        for (size_t i = 0; i < current.size(); ++i) {
+            const Source& source = current[i];
+            if (source.index < 0) {
+                continue;
+            }
+            int seed = getSeed(source, static_cast<int>(level) + 1);
+            if (field[source.index] < seed) {
+                field[source.index] = static_cast<uint8_t>(seed);
+                touch(source.index);
+                fillQueue.push_back(source.index);
+            } else if (i >= sources.size() || !(sources[i] == source)) {
+                // A new light on a solid cell lets the light already there through.
+                fillQueue.push_back(source.index);
+            }
+        }
+        propagate(field, terrain);
+    }
+
+    sources = std::move(current);
+}
+
+/**
+ * @brief Works out a light's cell, level and strength.
+ *
+ * The strength is the radius in straight steps, so level 1's field reaches
+ * as far as the ray-traced light would on open floor.
+ */
+LightPropagation::Source LightPropagation::captureSource(const RadialLight& light, int gridWidth, int gridHeight) {
+    int x = static_cast<int>(light.position.x);
+    int y = static_cast<int>(light.position.y);
+    bool onGrid = light.position.x >= 0 && light.position.y >= 0 && x < gridWidth && y < gridHeight;
+    int strength = std::min(static_cast<int>(std::lround(light.radius * PROPAGATION_STRAIGHT_STEP)), PROPAGATION_MAX_STRENGTH);
+    return {onGrid ? y * gridWidth + x : -1, static_cast<int>(light.intensity), strength};
+}
+
+/**
+ * @brief Returns the value a source seeds into a level's field, or 0 if it is too dim for that level.
+ *
+ * A light of level L reaches level k out to (L - k + 1) / L of its radius.
+ */
+int LightPropagation::getSeed(const Source& source, int level) const {
+    if (level > source.level) {
+        return 0;
+    }
+    return source.strength * (source.level - level + 1) / source.level;
+}
+
+/**
+ * @brief Tests whether light passes on from a cell: it is open floor or a light sits on it.
+ */
+bool LightPropagation::spreads(int index, const CollisionGrid& terrain) const {
+    return sourceCounts[index] > 0 || !terrain.isSolid(index % width, index / width);
+}
+
+/**
+ * @brief Records that a cell's level may have changed.
+ */
+void LightPropagation::touch(int index) {
+    if (!touchedMask[index]) {
+        touchedMask[index] = 1;
+        touchedCells.push_back(index);
+    }
+}
+
+/**
+ * @brief Clears every cell that may have been lit through the cells in removeQueue.
+ *
+ * A neighbour dimmer than the value a cleared cell held may have got its light
+ * through it, so it is cleared too. Brighter neighbours are lit some other way
+ * and are queued to refill the cleared cells. The walk ignores the terrain,
+ * since it must follow wherever light could spread before a height changed;
+ * the extra cells it clears are simply refilled.
+ */
+void LightPropagation::unpropagate(std::vector<uint8_t>& field) {
+    while (!removeQueue.empty()) {
+        std::pair<int, int> entry = removeQueue.back();
+        removeQueue.pop_back();
+        int x = entry.first % width;
+        int y = entry.first / width;
+        for (int n = 0; n < NEIGHBOURS; ++n) {
+            int nx = x + NEIGHBOUR_DX[n];
+            int ny = y + NEIGHBOUR_DY[n];
+            if (nx < 0 || ny < 0 || nx >= width || ny >= height) {
+                continue;
+            }
+            int neighbour = ny * width + nx;
+            int value = field[neighbour];
+            if (value == 0) {
+                continue;
+            }
+            if (value < entry.second) {
+                field[neighbour] = 0;
+                touch(neighbour);
+                removeQueue.emplace_back(neighbour, value);
+            } else {
+                fillQueue.push_back(neighbour);
+            }
+        }
+    }
+}
+
+/**
+ * @brief Spreads light from the cells in fillQueue until no cell can get brighter.
+ *
+ * Diagonal steps need both cells beside them to be open, so light does not
+ * leak between two blocks that touch at a corner.
+ */
+void LightPropagation::propagate(std::vector<uint8_t>& field, const CollisionGrid& terrain) {
+    while (!fillQueue.empty()) {
+        int index = fillQueue.front();
+        fillQueue.pop_front();
+        int value = field[index];
+        if (value <= PROPAGATION_STRAIGHT_STEP || !spreads(index, terrain)) {
+            continue;
+        }
+        int x = index % width;
+        int y = index / width;
+        for (int n = 0; n < NEIGHBOURS; ++n) {
+            int nx = x + NEIGHBOUR_DX[n];
+            int ny = y + NEIGHBOUR_DY[n];
+            if (nx < 0 || ny < 0 || nx >= width || ny >= height) {
+                continue;
+            }
+            bool diagonal = NEIGHBOUR_DX[n] != 0 && NEIGHBOUR_DY[n] != 0;
+            if (diagonal && (terrain.isSolid(nx, y) || terrain.isSolid(x, ny))) {
+                continue;
+            }
+            int neighbour = ny * width + nx;
+            int next = value - (diagonal ? PROPAGATION_DIAGONAL_STEP : PROPAGATION_STRAIGHT_STEP);
+            if (next > field[neighbour]) {
+                field[neighbour] = static_cast<uint8_t>(next);
+                touch(neighbour);
+                fillQueue.push_back(neighbour);
+            }
+        }
+    }
+}
+
+/**
+ * @brief Measures how far light from one cell has to travel to each cell of a rectangle.
+ *
+ * Uses the same steps and the same rules as the light fields, but with a
+ * single source and a limit, for lights that are flooded afresh every frame.
+ *
+ * @param terrain The heights; solid cells are reached but not passed through.
+ * @param x The source cell's column; it spreads light even when solid.
+ * @param y The source cell's row.
+ * @param rect The cells to measure; it must hold the source cell.
+ * @param maxDistance The longest path to follow, in PROPAGATION_STRAIGHT_STEP units per cell.
+ * @param distances Receives the path length of each cell of rect, row by row, or UINT16_MAX if it is not reached.
+ * @param queue Scratch space for the walk.
+ */
+void flood_distances(const CollisionGrid& terrain, int x, int y, const GridRect& rect, int maxDistance,
+                     std::vector<uint16_t>& distances, std::vector<int>& queue) {
+    const int rectWidth = rect.x1 - rect.x0;
+    distances.assign(rectWidth * (rect.y1 - rect.y0), UINT16_MAX);
+    queue.clear();
+
+    const int start = (y - rect.y0) * rectWidth + (x - rect.x0);
+    distances[start] = 0;
+    queue.push_back(start);
+    for (size_t head = 0; head < queue.size(); ++head) {
+        int cell = queue[head];
+        int cx = rect.x0 + cell % rectWidth;
+        int cy = rect.y0 + cell / rectWidth;
+        if (cell != start && terrain.isSolid(cx, cy)) {
+            continue;
+        }
+        for (int n = 0; n < NEIGHBOURS; ++n) {
+            int nx = cx + NEIGHBOUR_DX[n];
+            int ny = cy + NEIGHBOUR_DY[n];
+            if (nx < rect.x0 || ny < rect.y0 || nx >= rect.x1 || ny >= rect.y1) {
+                continue;
+            }
+            bool diagonal = NEIGHBOUR_DX[n] != 0 && NEIGHBOUR_DY[n] != 0;
+            if (diagonal && (terrain.isSolid(nx, cy) || terrain.isSolid(cx, ny))) {
+                continue;
+            }
+            int neighbour = (ny - rect.y0) * rectWidth + (nx - rect.x0);
+            int distance = distances[cell] + (diagonal ? PROPAGATION_DIAGONAL_STEP : PROPAGATION_STRAIGHT_STEP);
+            if (distance <= maxDistance && distance < distances[neighbour]) {
+                distances[neighbour] = static_cast<uint16_t>(distance);
+                queue.push_back(neighbour);
+            }
+        }
+    }
+}
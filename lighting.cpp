@@ -10,6 +10,384 @@
 #include "splashkit.h"
 #include <cmath>
 #include <algorithm>
+#include <iostream>
+
+namespace {
+    /**
+     * @brief Clips rectangles to a bounding rectangle, dropping those left empty.
+     */
+    void clip_rects(std::vector<GridRect>& rects, const GridRect& bounds) {
+        size_t kept = 0;
+        for (const auto& rect : rects) {
+            GridRect clipped = {std::max(rect.x0, bounds.x0), std::max(rect.y0, bounds.y0),
+                                std::min(rect.x1, bounds.x1), std::min(rect.y1, bounds.y1)};
+            if (clipped.x0 < clipped.x1 && clipped.y0 < clipped.y1) {
+                rects[kept++] = clipped;
+            }
+        }
+        rects.resize(kept);
+    }
+
+    /**
+     * @brief Drops the lights whose reach does not touch a rectangle.
+     *
+     * One cell of slack matches the dirty tracker's allowance for rounding in the kernels.
+     */
+    void cull_lights(std::vector<RadialLight>& lights, const GridRect& bounds) {
+        lights.erase(std::remove_if(lights.begin(), lights.end(), [&](const RadialLight& light) {
+            double dx = light.position.x - std::max<double>(bounds.x0, std::min<double>(light.position.x, bounds.x1 - 1));
+            double dy = light.position.y - std::max<double>(bounds.y0, std::min<double>(light.position.y, bounds.y1 - 1));
+            return std::sqrt(dx * dx + dy * dy) > light.radius + 1.0;
+        }), lights.end());
+    }
+
+    /**
+     * @brief Marks the cells of rect that lie outside covered.
+     */
+    void mark_uncovered(LightingDirtyTracker& tracker, const GridRect& rect, const GridRect& covered) {
+        GridRect overlap = {std::max(rect.x0, covered.x0), std::max(rect.y0, covered.y0),
+                            std::min(rect.x1, covered.x1), std::min(rect.y1, covered.y1)};
+        if (overlap.x0 >= overlap.x1 || overlap.y0 >= overlap.y1) {
+            tracker.markRect(rect);
+            return;
+        }
+        tracker.markRect({rect.x0, rect.y0, rect.x1, overlap.y0});
+        tracker.markRect({rect.x0, overlap.y1, rect.x1, rect.y1});
+        tracker.markRect({rect.x0, overlap.y0, overlap.x0, overlap.y1});
+        tracker.markRect({overlap.x1, overlap.y0, rect.x1, overlap.y1});
+    }
+}
+
+/**
+ * @brief Parses a backend name as given on the command line or in LIGHTING_BACKEND.
+ *
+ * @param name One of "auto", "opencl"/"gpu", "cpu" or "flood".
+ * @return The matching backend type.
+ * @throws std::invalid_argument If the name is not recognised.
+ */
+LightingBackendType parse_lighting_backend_type(const std::string& name) {
+    if (name.empty() || name == "auto") return LightingBackendType::AUTO;
+    if (name == "opencl" || name == "gpu") return LightingBackendType::OPENCL;
+    if (name == "cpu") return LightingBackendType::CPU;
+    if (name == "flood") return LightingBackendType::FLOOD_FILL;
+    throw std::invalid_argument("Unknown lighting backend: " + name);
+}
+
+/**
+ * @brief Parses an occlusion mode name as given on the command line.
+ *
+ * @param name "raycast" (the default) or "shadowmap".
+ * @return The matching occlusion mode.
+ * @throws std::invalid_argument If the name is not recognised.
+ */
+OcclusionMode parse_occlusion_mode(const std::string& name) {
+    if (name.empty() || name == "raycast") return OcclusionMode::RAYCAST;
+    if (name == "shadowmap") return OcclusionMode::SHADOW_MAP;
+    throw std::invalid_argument("Unknown occlusion mode: " + name);
+}
+
+/**
+ * @brief Creates and initializes a lighting backend.
+ *
+ * AUTO tries the OpenCL backend first and falls back to the CPU engine when
+ * no usable device is found. The OpenCL devices can be chosen through the
+ * LIGHTING_CL_* environment variables described in opencl_wrapper.cpp.
+ * FLOOD_FILL only has to be asked for, since it lights the world differently.
+ *
+ * @param type The backend to create.
+ * @return The initialized backend.
+ */
+std::unique_ptr<LightingBackend> create_lighting_backend(LightingBackendType type) {
+    if (type == LightingBackendType::FLOOD_FILL) {
+        auto backend = std::make_unique<FloodFillLightingEngine>();
+        backend->initialize();
+        return backend;
+    }
+
+    if (type != LightingBackendType::CPU) {
+        try {
+            auto backend = std::make_unique<OpenCLWrapper>();
+            backend->initialize();
+            return backend;
+        } catch (const std::exception& e) {
+            if (type == LightingBackendType::OPENCL) {
+                throw;
+            }
+            std::cerr << e.what() << " - falling back to CPU lighting" << std::endl;
+        }
+    }
+
+    auto backend = std::make_unique<CPULightingEngine>();
+    backend->initialize();
+    return backend;
+}
+
+/**
+ * @brief Flattens a cell hit by a bullet in the host mirror.
+ *
+ * The cell is also queued for the next lighting pass, which pushes it to the
+ * backend's own copy of the heights and marks the lighting around it dirty.
+ *
+ * @param x The x-coordinate of the collision point.
+ * @param y The y-coordinate of the collision point.
+ */
+void LightingBackend::addCollisionPoint(int x, int y) {
+    if (collisionGrid.setHeight(x, y, HeightLevel::FLOOR)) {
+        changedCells.emplace_back(x, y);
+    }
+}
+
+/**
+ * @brief Changes the lighting options; the next pass recomputes the whole grid and static lightmap.
+ *
+ * @param newOptions The options to use from now on.
+ */
+void LightingBackend::setOptions(const LightingOptions& newOptions) {
+    options = newOptions;
+    dirtyTracker.markAll();
+    staticTracker.markAll();
+}
+
+/**
+ * @brief Sets up the host-side state shared by all backends for a new grid.
+ *
+ * @param initialGrid The initial grid state.
+ */
+void LightingBackend::initializeHostGrid(const Grid& initialGrid) {
+    gridWidth = initialGrid.width;
+    gridHeight = initialGrid.height;
+    collisionGrid.initialize(initialGrid);
+    dirtyTracker.reset(gridWidth, gridHeight);
+    staticTracker.reset(gridWidth, gridHeight);
+    changedCells.clear();
+    activeRect = {0, 0, gridWidth, gridHeight};
+    levelFile = nullptr;
+    loadedChunks.clear();
+}
+
+/**
+ * @brief Sets up the host-side state for a level whose chunks are streamed in as the active rectangle moves.
+ *
+ * The grid starts as all floor and no chunk is loaded, so nothing is read
+ * from the level but its size and the active rectangle starts empty: the
+ * first setActiveRect loads the chunks around it. The level must stay open
+ * for as long as the backend uses it.
+ *
+ * @param newLevel The level to stream from.
+ */
+void LightingBackend::initializeHostLevel(const LevelFile& newLevel) {
+    gridWidth = newLevel.getWidth();
+    gridHeight = newLevel.getHeight();
+    collisionGrid.reset(gridWidth, gridHeight);
+    dirtyTracker.reset(gridWidth, gridHeight);
+    staticTracker.reset(gridWidth, gridHeight);
+    changedCells.clear();
+    activeRect = {0, 0, 0, 0};
+    levelFile = &newLevel;
+    loadedChunks.assign(newLevel.getChunksX() * newLevel.getChunksY(), 0);
+}
+
+/**
+ * @brief Loads the level chunks within LEVEL_CHUNK_SIZE cells of a rectangle that are not in yet.
+ *
+ * The margin keeps the terrain that lights and bullets near the rectangle can
+ * reach loaded before it matters; it is at least LEVEL_MAX_LIGHT_RADIUS, so a
+ * light that can shade the rectangle never looks past the loaded chunks. Each
+ * new chunk goes into the CollisionGrid and through uploadLevelChunk, and the
+ * tiles it can shade are marked dirty in both layers.
+ *
+ * @param rect The cells about to be lit.
+ */
+void LightingBackend::streamLevelChunks(const GridRect& rect) {
+    if (!levelFile || rect.x0 >= rect.x1 || rect.y0 >= rect.y1) {
+        return;
+    }
+    int chunkX1 = std::min((rect.x1 - 1) / LEVEL_CHUNK_SIZE + 1, levelFile->getChunksX() - 1);
+    int chunkY1 = std::min((rect.y1 - 1) / LEVEL_CHUNK_SIZE + 1, levelFile->getChunksY() - 1);
+    for (int chunkY = std::max(rect.y0 / LEVEL_CHUNK_SIZE - 1, 0); chunkY <= chunkY1; ++chunkY) {
+        for (int chunkX = std::max(rect.x0 / LEVEL_CHUNK_SIZE - 1, 0); chunkX <= chunkX1; ++chunkX) {
+            uint8_t& loaded = loadedChunks[chunkY * levelFile->getChunksX() + chunkX];
+            if (loaded) {
+                continue;
+            }
+            loaded = 1;
+            GridRect chunkRect = levelFile->getChunkRect(chunkX, chunkY);
+            const uint8_t* heights = levelFile->getChunk(chunkX, chunkY);
+            collisionGrid.loadRect(heights, LEVEL_CHUNK_SIZE, chunkRect);
+            uploadLevelChunk(chunkRect, heights);
+
+            // Level files cap static lights at LEVEL_MAX_LIGHT_RADIUS and generated lights are shorter,
+            // so any light that shades through the chunk is within that many cells of it.
+            const int margin = static_cast<int>(std::ceil(LEVEL_MAX_LIGHT_RADIUS)) + 1;
+            GridRect reach = {chunkRect.x0 - margin, chunkRect.y0 - margin, chunkRect.x1 + margin, chunkRect.y1 + margin};
+            dirtyTracker.markRect(reach);
+            staticTracker.markRect(reach);
+        }
+    }
+}
+
+/**
+ * @brief Pushes a newly loaded level chunk to the backend's own copy of the heights.
+ *
+ * Backends that light straight from the CollisionGrid have nothing to do.
+ *
+ * @param rect The cells of the chunk.
+ * @param heights The chunk's heights in the level mapping, LEVEL_CHUNK_SIZE bytes per row.
+ */
+void LightingBackend::uploadLevelChunk(const GridRect&, const uint8_t*) {}
+
+/**
+ * @brief Restricts lighting to a rectangle of the grid, such as the chunks a camera can see.
+ *
+ * Cells outside the rectangle keep whatever level they last had. Cells that
+ * become active are marked dirty in both layers, since changes there were not
+ * computed while they were outside. When the grid comes from a level file,
+ * the chunks around the rectangle are loaded first.
+ *
+ * @param rect The cells to light, clamped to the grid.
+ */
+void LightingBackend::setActiveRect(const GridRect& rect) {
+    GridRect clamped = {std::max(rect.x0, 0), std::max(rect.y0, 0), std::min(rect.x1, gridWidth), std::min(rect.y1, gridHeight)};
+    streamLevelChunks(clamped);
+    if (clamped.x0 == activeRect.x0 && clamped.y0 == activeRect.y0 && clamped.x1 == activeRect.x1 && clamped.y1 == activeRect.y1) {
+        return;
+    }
+    mark_uncovered(dirtyTracker, clamped, activeRect);
+    mark_uncovered(staticTracker, clamped, activeRect);
+    activeRect = clamped;
+}
+
+/**
+ * @brief Works out which parts of the grid the next lighting pass must compute.
+ *
+ * The lights are split into staticLights and dynamicLights. The static
+ * lightmap only needs rebuilding in staticRegions, where a static light
+ * changed or terrain it reaches was altered, whatever the update mode. The
+ * returned regions, where the dynamic lights and torch are combined with the
+ * static layer, are the dirty tiles in incremental mode and otherwise the
+ * whole grid. Both sets of regions are clipped to the active rectangle, and
+ * lights that cannot reach it are left out of the passes. The queued changed
+ * cells are consumed.
+ *
+ * @param lights The radial lights in the scene.
+ * @param torch The player's torch.
+ * @param torch_on Whether the torch is turned on.
+ * @return The regions to recompute.
+ */
+std::vector<GridRect> LightingBackend::collectLightingRegions(const std::vector<RadialLight>& lights, const Torch& torch, bool torch_on) {
+    staticLights.clear();
+    dynamicLights.clear();
+    for (const auto& light : lights) {
+        (light.is_static ? staticLights : dynamicLights).push_back(light);
+    }
+
+    staticTracker.update(staticLights, torch, false, changedCells);
+    dirtyTracker.update(dynamicLights, torch, torch_on, changedCells);
+    changedCells.clear();
+
+    staticRegions = staticTracker.takeDirtyRects();
+    clip_rects(staticRegions, activeRect);
+    for (const auto& region : staticRegions) {
+        dirtyTracker.markRect(region);
+    }
+    if (!options.incremental) {
+        dirtyTracker.markAll();
+    }
+
+    std::vector<GridRect> regions = dirtyTracker.takeDirtyRects();
+    clip_rects(regions, activeRect);
+    cull_lights(staticLights, activeRect);
+    cull_lights(dynamicLights, activeRect);
+    lastUpdatedCellCount = 0;
+    for (const auto& region : regions) {
+        lastUpdatedCellCount += (region.x1 - region.x0) * (region.y1 - region.y0);
+    }
+    return regions;
+}
+
+/**
+ * @brief Shades the current lighting into packed pixels on the lighting device.
+ *
+ * Backends without a device shading path return false and leave the caller to
+ * shade on the host.
+ *
+ * @param palette Packed colour per (height, light level), as built by ShadeTable.
+ * @param rect The cells to shade.
+ * @param pixels Receives one packed colour per cell of rect, row by row.
+ * @return True if the pixels were produced.
+ */
+bool LightingBackend::shadeOnDevice(const std::vector<uint32_t>&, const GridRect&, std::vector<uint32_t>&) const {
+    return false;
+}
+
+/**
+ * @brief Copies the current grid heights from the host mirror.
+ *
+ * @param heights Vector to store the heights.
+ */
+void LightingBackend::readGridHeights(std::vector<uint8_t>& heights) const {
+    heights = collisionGrid.getHeights();
+}
+
+/**
+ * @brief Tests a batch of segments against the host mirror of the grid.
+ *
+ * @param segments The segments to test.
+ * @param hits Receives one result per segment, in the same order.
+ */
+void LightingBackend::castRays(const std::vector<RaySegment>& segments, std::vector<RayHit>& hits) const {
+    hits.resize(segments.size());
+    for (size_t i = 0; i < segments.size(); ++i) {
+        hits[i] = collisionGrid.castRay(segments[i]);
+    }
+}
+
+/**
+ * @brief Performs a single raycast to find a collision point.
+ *
+ * @param start The start point of the ray.
+ * @param end The end point of the ray.
+ * @param hitPoint The resulting collision point, or (-1, -1) if nothing was hit.
+ */
+void LightingBackend::getCollisionPoint(const Vector2D& start, const Vector2D& end, Vector2D& hitPoint) const {
+    std::vector<RayHit> hits;
+    castRays({{start, end}}, hits);
+    hitPoint = hits[0].point;
+}
+
+/**
+ * @brief Creates radial lights at random positions.
+ *
+ * @param num_lights The number of lights to create.
+ * @param num_static How many of them are static; the first num_static lights never move.
+ * @param grid_width The width of the grid.
+ * @param grid_height The height of the grid.
+ * @param seed Seed for the light layout; the same seed always yields the same lights.
+ * @return The created lights.
+ */
+std::vector<RadialLight> create_radial_lights(int num_lights, int num_static, int grid_width, int grid_height, unsigned int seed) {
+    std::vector<RadialLight> lights;
+    std::mt19937 gen(seed);
+    std::uniform_int_distribution<> x_dis(0, grid_width - 1);
+    std::uniform_int_distribution<> y_dis(0, grid_height - 1);
+    std::uniform_int_distribution<> intensity_dis(1, LIGHT_LEVELS);
+    std::uniform_real_distribution<> radius_dis(10.0, 30.0);
+    std::uniform_int_distribution<> height_dis(static_cast<int>(HeightLevel::CEILING), static_cast<int>(HeightLevel::RADIAL));
+
+    for (int i = 0; i < num_lights; ++i) {
+        RadialLight light{
+                {static_cast<double>(x_dis(gen)), static_cast<double>(y_dis(gen))},
+                static_cast<double>(intensity_dis(gen)),
+                radius_dis(gen),
+                {1, 0.5},
+                height_dis(gen),
+                i < num_static
+        };
+        lights.push_back(light);
+    }
+
+    return lights;
+}
 
 /**
  * @brief Calculates the breathing effect for the torch radius.
@@ -41,17 +419,18 @@ void update_torch(Torch& torch, const Player& player, double total_time) {
  * @param lights The vector of radial lights.
  * @param torch The player's torch.
  * @param torch_on Whether the torch is turned on.
- * @param openclWrapper The OpenCL wrapper for GPU calculations.
+ * @param lightingBackend The lighting backend performing the calculations.
  */
-void update_grid_lighting(const std::vector<RadialLight>& lights, const Torch& torch, bool torch_on, OpenCLWrapper& openclWrapper) {
+void update_grid_lighting(const std::vector<RadialLight>& lights, const Torch& torch, bool torch_on, LightingBackend& lightingBackend) {
     try {
-        openclWrapper.calculateLighting(lights, torch, torch_on);
+        lightingBackend.calculateLighting(lights, torch, torch_on);
     } catch (const cl::Error& e) {
-        write_line("OpenCL error in update_grid_lighting: " + string(e.what()) + " (" + std::to_string(e.err()) + ")");
+        // This runs on the simulation thread, which makes no SplashKit calls.
+        std::cerr << "OpenCL error in update_grid_lighting: " << e.what() << " (" << e.err() << ")" << std::endl;
     } catch (const std::exception& e) {
-        write_line("Standard exception in update_grid_lighting: " + string(e.what()));
+        std::cerr << "Standard exception in update_grid_lighting: " << e.what() << std::endl;
     } catch (...) {
-        write_line("Unknown exception in update_grid_lighting");
+        std::cerr << "Unknown exception in update_grid_lighting" << std::endl;
     }
 }
 
@@ -96,7 +475,7 @@ void update_radial_light_mover(RadialLight& light, int gridWidth, int gridHeight
 }
 
 /**
- * @brief Updates the positions of all radial lights.
+ * @brief Updates the positions of all dynamic radial lights; static lights stay put.
  *
  * @param lights The vector of radial lights to update.
  * @param gridWidth The width of the grid.
@@ -105,6 +484,8 @@ void update_radial_light_mover(RadialLight& light, int gridWidth, int gridHeight
  */
 void update_radial_light_movers(std::vector<RadialLight>& lights, int gridWidth, int gridHeight, double deltaTime) {
     for (auto& light : lights) {
-        update_radial_light_mover(light, gridWidth, gridHeight, deltaTime);
+        if (!light.is_static) {
+            update_radial_light_mover(light, gridWidth, gridHeight, deltaTime);
+        }
     }
 }
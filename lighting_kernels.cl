@@ -1,34 +1,104 @@
+// Keep a * b + c as two roundings so the kernels match the host port exactly.
+#pragma OPENCL FP_CONTRACT OFF
+
 #define LIGHT_LEVELS 5
+#define LIGHT_TILE_SIZE 16
+#define HEIGHT_PYRAMID_LEVELS 4
+#define FLOOR_HEIGHT 1
 #define PLAYER_HEIGHT 10
 #define TORCH_HEIGHT 30
+#define SHADE_LEVELS (LIGHT_LEVELS + 1)
 #define M_PI 3.14159265358979323846f
 
+// Lights are packed to fp32 on the host (packed_lights.h), so no kernel needs
+// double support. Each struct starts with a float4, which also sets its alignment.
 typedef struct {
-    double x, y;
-} Vector2D;
+    float4 geometry;  // x, y, radius, radius squared
+    int level;
+    int cell_x;
+    int cell_y;
+    int height;
+} PackedLight;
 
 typedef struct {
-    Vector2D position;
-    double intensity;
-    double radius;
-    Vector2D velocity;
-    int height;
-} RadialLight;
+    float4 position_direction;  // x, y, direction x, direction y
+    float radius;
+    int cell_x;
+    int cell_y;
+    int padding;
+} PackedTorch;
+
+// A negative array size fails the build if a layout drifts from the host's.
+typedef char packed_light_layout_check[sizeof(PackedLight) == 32 ? 1 : -1];
+typedef char packed_torch_layout_check[sizeof(PackedTorch) == 32 ? 1 : -1];
 
 typedef struct {
-    Vector2D position;
-    Vector2D direction;
-    double base_radius;
-    double current_radius;
-} Torch;
+    int x, y;
+    int height;
+    int buckets;
+    int steps;
+    int offset;
+    int padding[2];
+} ShadowSource;
+
+// The max-height pyramid stores levels 1..HEIGHT_PYRAMID_LEVELS back to back;
+// cell (bx, by) of level l holds the tallest cell of the 2^l x 2^l block it covers.
+int pyramid_level_offset(int level, int grid_width, int grid_height) {
+    int offset = 0;
+    for (int l = 1; l < level; ++l) {
+        offset += ((grid_width + (1 << l) - 1) >> l) * ((grid_height + (1 << l) - 1) >> l);
+    }
+    return offset;
+}
+
+int pyramid_block_max(__global const uchar* height_pyramid, int level, int x, int y, int grid_width, int grid_height) {
+    int level_width = (grid_width + (1 << level) - 1) >> level;
+    return height_pyramid[pyramid_level_offset(level, grid_width, grid_height) + (y >> level) * level_width + (x >> level)];
+}
 
-bool has_clear_path(__global const int* grid_heights, int x1, int y1, int z1, int x2, int y2, int z2, int grid_width, int grid_height) {
+// Number of steps, counting from the current cell, until a Bresenham walk with
+// the given error term leaves the block of the given size, and the x- and y-steps
+// taken on the way. A step moves along x while error > 0, so the a-th x-step
+// comes after the y-steps that lift the error above zero, and vice versa.
+int steps_to_leave_block(int x, int y, int x_inc, int y_inc, int error, int dx2, int dy2, int size,
+                         int* x_steps, int* y_steps) {
+    const int never = 0x3fffffff;
+    int ax = x_inc > 0 ? size - (x & (size - 1)) : (x & (size - 1)) + 1;
+    int ay = y_inc > 0 ? size - (y & (size - 1)) : (y & (size - 1)) + 1;
+
+    int need = (ax - 1) * dy2 - error;
+    int by_x = need < 0 ? 0 : (dx2 == 0 ? never : need / dx2 + 1);
+    need = error + (ay - 1) * dx2;
+    int bx_y = need <= 0 ? 0 : (dy2 == 0 ? never : (need + dy2 - 1) / dy2);
+
+    if (by_x == never && bx_y == never) {
+        *x_steps = 0;
+        *y_steps = 0;
+        return never;
+    }
+    if (bx_y == never || (by_x != never && ax + by_x < bx_y + ay)) {
+        *x_steps = ax;
+        *y_steps = by_x;
+        return ax + by_x;
+    }
+    *x_steps = bx_y;
+    *y_steps = ay;
+    return bx_y + ay;
+}
+
+// Walks the cells between two points and checks that none rises above the line
+// of sight. z at step i is z1 + 0.1 + i * dz / n. At each cell inside the grid
+// the coarsest pyramid block whose tallest cell stays under the lowest z the
+// walk reaches inside it is skipped in one move, so open ground costs a few
+// steps per block rather than one per cell.
+bool has_clear_path(__global const uchar* grid_heights, __global const uchar* height_pyramid,
+                    int x1, int y1, int z1, int x2, int y2, int z2, int grid_width, int grid_height) {
     int dx = abs(x2 - x1);
     int dy = abs(y2 - y1);
     int dz = z2 - z1;
     int x = x1;
     int y = y1;
-    float z = (float)z1 + 0.1f;  // Start slightly above the terrain
+    float z_start = (float)z1 + 0.1f;  // Start slightly above the terrain
     int n = 1 + dx + dy;
     int x_inc = (x2 > x1) ? 1 : -1;
     int y_inc = (y2 > y1) ? 1 : -1;
@@ -37,10 +107,36 @@ bool has_clear_path(__global const int* grid_heights, int x1, int y1, int z1, in
     dx *= 2;
     dy *= 2;
 
-    for (int i = 0; i < n; ++i) {
+    int i = 0;
+    while (i < n) {
         if (x >= 0 && x < grid_width && y >= 0 && y < grid_height) {
-            int cell_height = grid_heights[y * grid_width + x];
-            if (z < cell_height) {
+            float z = z_start + (float)i * z_inc;
+            int skip = 0;
+            int skip_x = 0;
+            int skip_y = 0;
+            for (int level = 1; level <= HEIGHT_PYRAMID_LEVELS; ++level) {
+                int x_steps, y_steps;
+                int steps = steps_to_leave_block(x, y, x_inc, y_inc, error, dx, dy, 1 << level, &x_steps, &y_steps);
+                float z_low = z_inc >= 0.0f ? z : z_start + (float)(min(i + steps, n) - 1) * z_inc;
+                if (z_low < pyramid_block_max(height_pyramid, level, x, y, grid_width, grid_height)) {
+                    break;
+                }
+                skip = steps;
+                skip_x = x_steps;
+                skip_y = y_steps;
+            }
+
+            if (skip > 0) {
+                if (skip >= n - i) {
+                    return true;
+                }
+                x += skip_x * x_inc;
+                y += skip_y * y_inc;
+                error += skip_y * dx - skip_x * dy;
+                i += skip;
+                continue;
+            }
+            if (z < grid_heights[y * grid_width + x]) {
                 return false;
             }
         }
@@ -52,13 +148,61 @@ bool has_clear_path(__global const int* grid_heights, int x1, int y1, int z1, in
             y += y_inc;
             error += dx;
         }
-        z += z_inc;
+        ++i;
     }
 
     return true;
 }
 
-__kernel void update_heights(__global int* grid_heights,
+// One work-item per (bucket, source): march out along the bucket's centre ray
+// and store the steepest slope (L - H) / t to an occluder seen so far.
+__kernel void build_shadow_profiles(__global float* profiles,
+                                    __global const uchar* grid_heights,
+                                    __global const ShadowSource* sources,
+                                    const int num_sources,
+                                    const int grid_width,
+                                    const int grid_height) {
+    int b = get_global_id(0);
+    int s = get_global_id(1);
+    if (s >= num_sources) return;
+
+    ShadowSource source = sources[s];
+    if (b >= source.buckets) return;
+
+    float angle = -M_PI + (b + 0.5f) * 2.0f * M_PI / source.buckets;
+    float cos_angle = cos(angle);
+    float sin_angle = sin(angle);
+    __global float* profile = profiles + source.offset + b * source.steps;
+    float min_slope = FLT_MAX;
+    profile[0] = min_slope;
+
+    for (int t = 1; t < source.steps; ++t) {
+        int x = source.x + (int)floor(t * cos_angle + 0.5f);
+        int y = source.y + (int)floor(t * sin_angle + 0.5f);
+        if (x >= 0 && x < grid_width && y >= 0 && y < grid_height) {
+            min_slope = fmin(min_slope, (float)(source.height - grid_heights[y * grid_width + x]) / t);
+        }
+        profile[t] = min_slope;
+    }
+}
+
+bool shadow_map_is_lit(__global const float* profiles, __global const ShadowSource* sources, int s, int x, int y, int height) {
+    ShadowSource source = sources[s];
+    int dx = x - source.x;
+    int dy = y - source.y;
+    if (dx == 0 && dy == 0) {
+        return true;
+    }
+
+    float distance = sqrt((float)(dx * dx + dy * dy));
+    float angle = atan2((float)dy, (float)dx);
+    int bucket = min((int)((angle + M_PI) * source.buckets / (2.0f * M_PI)), source.buckets - 1);
+    int step = min((int)distance - 1, source.steps - 1);
+    float slope = ((float)(source.height - height) - 0.1f) / distance;
+    return profiles[source.offset + bucket * source.steps + step] >= slope;
+}
+
+__kernel void update_heights(__global uchar* grid_heights,
                              __global const int2* collision_points,
                              const int num_collisions,
                              const int grid_width) {
@@ -70,136 +214,179 @@ __kernel void update_heights(__global int* grid_heights,
     }
 }
 
-__kernel void calculate_radial_lighting(
-    __global int* light_levels,
-    __global const int* grid_heights,
-    __global const RadialLight* lights,
-    int num_lights,
-    int grid_width,
-    int grid_height
-) {
-    int x = get_global_id(0);
-    int y = get_global_id(1);
-
-    if (x >= grid_width || y >= grid_height) return;
-
-    int index = y * grid_width + x;
-    int cell_height = grid_heights[index];
-    int max_light_level = 0;
-
-    for (int i = 0; i < num_lights; ++i) {
-        float dx = (float)(x - lights[i].position.x);
-        float dy = (float)(y - lights[i].position.y);
-        float distance_squared = dx*dx + dy*dy;
-        float radius = (float)lights[i].radius;
+// Recomputes one pyramid level over the blocks holding the flattened cells,
+// from the level below (the heights themselves for level 1). Run once per
+// level, in order, after update_heights. Work-items that share a block write
+// the same value.
+__kernel void update_height_pyramid(__global uchar* height_pyramid,
+                                    __global const uchar* grid_heights,
+                                    __global const int2* collision_points,
+                                    const int num_collisions,
+                                    const int grid_width,
+                                    const int grid_height,
+                                    const int level) {
+    int gid = get_global_id(0);
+    if (gid >= num_collisions) return;
 
-        if (distance_squared > radius * radius) {
-            continue;
-        }
+    int2 collision = collision_points[gid];
+    int bx = collision.x >> level;
+    int by = collision.y >> level;
+    int below_width = (grid_width + (1 << (level - 1)) - 1) >> (level - 1);
+    int below_height = (grid_height + (1 << (level - 1)) - 1) >> (level - 1);
+    __global const uchar* below = level == 1
+            ? grid_heights
+            : height_pyramid + pyramid_level_offset(level - 1, grid_width, grid_height);
 
-        if (has_clear_path(grid_heights, x, y, cell_height,
-                           (int)lights[i].position.x, (int)lights[i].position.y, lights[i].height,
-                           grid_width, grid_height)) {
-            int light_level = (int)lights[i].intensity;
-            max_light_level = max(max_light_level, light_level);
+    uchar block_max = 0;
+    for (int cy = 2 * by; cy < min(2 * by + 2, below_height); ++cy) {
+        for (int cx = 2 * bx; cx < min(2 * bx + 2, below_width); ++cx) {
+            block_max = max(block_max, below[cy * below_width + cx]);
         }
     }
+    int level_width = (grid_width + (1 << level) - 1) >> level;
+    height_pyramid[pyramid_level_offset(level, grid_width, grid_height) + by * level_width + bx] = block_max;
+}
+
+// Both lighting kernels run over a compacted list of tiles, each an int4 of
+// (x0, y0, x1, y1) cells: work-item (i, j) takes cell (i % LIGHT_TILE_SIZE,
+// j) of tile first_tile + i / LIGHT_TILE_SIZE, and cells past the tile's
+// clipped edge do nothing.
+bool tile_cell(__global const int4* tiles, int first_tile, int* x, int* y) {
+    int4 tile = tiles[first_tile + (int)get_global_id(0) / LIGHT_TILE_SIZE];
+    *x = tile.x + (int)get_global_id(0) % LIGHT_TILE_SIZE;
+    *y = tile.y + (int)get_global_id(1);
+    return *x < tile.z && *y < tile.w;
+}
 
-    light_levels[index] = max_light_level;
+// Gives every cell of the dark tiles, which no light reaches, its base level.
+__kernel void fill_base_levels(__global uchar* light_levels,
+                               __global const uchar* base_levels,
+                               const int has_base,
+                               __global const int4* tiles,
+                               const int first_tile,
+                               const int grid_width) {
+    int x, y;
+    if (!tile_cell(tiles, first_tile, &x, &y)) return;
+
+    int index = y * grid_width + x;
+    light_levels[index] = has_base ? base_levels[index] : 0;
 }
 
-__kernel void calculate_torch_lighting(
-    __global int* light_levels,
-    __global const int* grid_heights,
-    __constant Torch* torch,
+// Computes each cell's final level in one pass: the base level (the cached
+// static lightmap when has_base is set, darkness otherwise), the radial lights
+// binned to the cell's tile and the torch are combined in registers and
+// written with one store. Bins list their lights brightest first, so the walk
+// stops at the first light that cannot raise the level. Only lit tiles are
+// launched; see LightBins::collectTiles.
+__kernel void calculate_lighting(
+    __global uchar* light_levels,
+    __global const uchar* base_levels,
+    int has_base,
+    __global const uchar* grid_heights,
+    __global const uchar* height_pyramid,
+    __global const PackedLight* lights,
+    int num_lights,
+    __global const int* bin_offsets,
+    __global const int* bin_indices,
+    int bin_tile_x0,
+    int bin_tile_y0,
+    int bin_tiles_x,
+    __constant PackedTorch* torch,
+    int torch_on,
     int grid_width,
-    int grid_height
+    int grid_height,
+    __global const float* shadow_profiles,
+    __global const ShadowSource* shadow_sources,
+    int use_shadow_map,
+    __global const int4* tiles,
+    int first_tile
 ) {
-    int x = get_global_id(0);
-    int y = get_global_id(1);
-
-    if (x >= grid_width || y >= grid_height) return;
+    int x, y;
+    if (!tile_cell(tiles, first_tile, &x, &y)) return;
 
     int index = y * grid_width + x;
     int cell_height = grid_heights[index];
+    int max_light_level = has_base ? base_levels[index] : 0;
 
-    float dx = (float)(x - torch->position.x);
-    float dy = (float)(y - torch->position.y);
-    float distance_squared = dx*dx + dy*dy;
-    float current_radius = (float)torch->current_radius;
-    float max_torch_radius = current_radius * 2.0f;
-
-    if (distance_squared <= max_torch_radius * max_torch_radius) {
-        float rotated_dx = dx * (float)torch->direction.x + dy * (float)torch->direction.y;
-        float rotated_dy = -dx * (float)torch->direction.y + dy * (float)torch->direction.x;
-
-        float ellipse_distance = current_radius * 1.2f;
-        float ellipse_width = current_radius * 1.2f;
-        float ellipse_height = current_radius * 0.8f;
-        float ellipse_factor = (float)(pow(rotated_dx - ellipse_distance, 2) / pow(ellipse_width / 2, 2)
-                               + pow(rotated_dy, 2) / pow(ellipse_height / 2, 2));
-
-        int torch_light_level = 0;
-        bool is_lit = false;
-
-        if (ellipse_factor <= 1.1f) {
-            torch_light_level = LIGHT_LEVELS;
-            is_lit = true;
-        } else if (sqrt(distance_squared) <= current_radius && rotated_dx >= 0) {
-            float angle = atan2(fabs(rotated_dy), rotated_dx);
-            float max_angle = atan2(ellipse_height / 2, ellipse_distance) + 0.05f;
-            if (angle <= max_angle) {
-                torch_light_level = cell_height <= PLAYER_HEIGHT ? LIGHT_LEVELS / 2 : LIGHT_LEVELS;
-                is_lit = true;
-            }
+    int bin = (y / LIGHT_TILE_SIZE - bin_tile_y0) * bin_tiles_x + (x / LIGHT_TILE_SIZE - bin_tile_x0);
+    int bin_end = bin_offsets[bin + 1];
+    for (int k = bin_offsets[bin]; k < bin_end; ++k) {
+        int i = bin_indices[k];
+        PackedLight light = lights[i];
+        if (light.level <= max_light_level) {
+            break;
         }
 
-        if (is_lit && has_clear_path(grid_heights, x, y, cell_height,
-                                     (int)torch->position.x, (int)torch->position.y, TORCH_HEIGHT,
-                                     grid_width, grid_height)) {
-            atomic_max(&light_levels[index], torch_light_level);
+        float dx = (float)x - light.geometry.x;
+        float dy = (float)y - light.geometry.y;
+        float distance_squared = dx*dx + dy*dy;
+        if (distance_squared > light.geometry.w) {
+            continue;
+        }
+
+        bool visible = use_shadow_map
+                ? shadow_map_is_lit(shadow_profiles, shadow_sources, i, x, y, cell_height)
+                : has_clear_path(grid_heights, height_pyramid, x, y, cell_height,
+                                 light.cell_x, light.cell_y, light.height, grid_width, grid_height);
+        if (visible) {
+            max_light_level = light.level;
         }
     }
-}
 
-__kernel void raycast(__global const int* grid_heights,
-                      __constant float2* start,
-                      __constant float2* end,
-                      __global float2* hit_point,
-                      const int grid_width,
-                      const int grid_height) {
-    float2 s = *start;
-    float2 e = *end;
-
-    float dx = fabs(e.x - s.x);
-    float dy = fabs(e.y - s.y);
-    int x = (int)s.x;
-    int y = (int)s.y;
-    int n = 1 + (int)(dx + dy);
-    int x_inc = (e.x > s.x) ? 1 : -1;
-    int y_inc = (e.y > s.y) ? 1 : -1;
-    float error = dx - dy;
-    dx *= 2;
-    dy *= 2;
+    if (torch_on && max_light_level < LIGHT_LEVELS) {
+        float4 position_direction = torch->position_direction;
+        float dx = (float)x - position_direction.x;
+        float dy = (float)y - position_direction.y;
+        float distance_squared = dx*dx + dy*dy;
+        float current_radius = torch->radius;
+        float max_torch_radius = current_radius * 2.0f;
 
-    for (; n > 0; --n) {
-        if (x >= 0 && x < grid_width && y >= 0 && y < grid_height) {
-            int cell_height = grid_heights[y * grid_width + x];
-            if (cell_height > 1) { // Assuming HeightLevel::FLOOR == 1
-                *hit_point = (float2)(x, y);
-                return;
+        if (distance_squared <= max_torch_radius * max_torch_radius) {
+            float rotated_dx = dx * position_direction.z + dy * position_direction.w;
+            float rotated_dy = -dx * position_direction.w + dy * position_direction.z;
+
+            float ellipse_distance = current_radius * 1.2f;
+            float ellipse_width = current_radius * 1.2f;
+            float ellipse_height = current_radius * 0.8f;
+            float ex = rotated_dx - ellipse_distance;
+            float ellipse_factor = ex * ex / ((ellipse_width / 2) * (ellipse_width / 2))
+                                 + rotated_dy * rotated_dy / ((ellipse_height / 2) * (ellipse_height / 2));
+
+            int torch_light_level = 0;
+
+            if (ellipse_factor <= 1.1f) {
+                torch_light_level = LIGHT_LEVELS;
+            } else if (sqrt(distance_squared) <= current_radius && rotated_dx >= 0) {
+                float angle = atan2(fabs(rotated_dy), rotated_dx);
+                float max_angle = atan2(ellipse_height / 2, ellipse_distance) + 0.05f;
+                if (angle <= max_angle) {
+                    torch_light_level = cell_height <= PLAYER_HEIGHT ? LIGHT_LEVELS / 2 : LIGHT_LEVELS;
+                }
             }
-        }
 
-        if (error > 0) {
-            x += x_inc;
-            error -= dy;
-        } else {
-            y += y_inc;
-            error += dx;
+            if (torch_light_level > max_light_level && (use_shadow_map
+                    ? shadow_map_is_lit(shadow_profiles, shadow_sources, num_lights, x, y, cell_height)
+                    : has_clear_path(grid_heights, height_pyramid, x, y, cell_height,
+                                     torch->cell_x, torch->cell_y, TORCH_HEIGHT,
+                                     grid_width, grid_height))) {
+                max_light_level = torch_light_level;
+            }
         }
     }
 
-    // No collision found
-    *hit_point = (float2)(-1, -1);
+    light_levels[index] = (uchar)max_light_level;
+}
+
+__kernel void shade_cells(__global const uchar* grid_heights,
+                          __global const uchar* light_levels,
+                          __constant uint* palette,
+                          __global uint* pixels,
+                          const int grid_width,
+                          const int rect_x0,
+                          const int rect_y0,
+                          const int rect_width) {
+    int x = get_global_id(0);
+    int y = get_global_id(1);
+    int idx = y * grid_width + x;
+    pixels[(y - rect_y0) * rect_width + (x - rect_x0)] = palette[grid_heights[idx] * SHADE_LEVELS + light_levels[idx]];
 }
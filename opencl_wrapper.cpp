@@ -4,52 +4,409 @@
  *
  * This file contains the implementation of the OpenCLWrapper class, which
  * handles initialization of OpenCL, kernel execution, and memory management
- * for GPU-accelerated lighting and collision detection.
+ * for GPU-accelerated lighting.
  */
 
 #include "./include/types.h"
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
 #include <fstream>
 #include <iostream>
+#include <unistd.h>
 
-OpenCLWrapper::OpenCLWrapper() : gridWidth(0), gridHeight(0) {}
+namespace {
+    const char* const KERNEL_SOURCE_PATH = "lighting_kernels.cl";
+    const char* const KERNEL_BUILD_OPTIONS = "";
+    const char* const KERNEL_CACHE_DIRECTORY = "kernel_cache";
 
-OpenCLWrapper::~OpenCLWrapper() {}
+    /**
+     * @brief 64-bit FNV-1a hash of a string, as 16 hex digits.
+     */
+    std::string hash_hex(const std::string& data) {
+        uint64_t hash = 14695981039346656037ull;
+        for (unsigned char c : data) {
+            hash = (hash ^ c) * 1099511628211ull;
+        }
+        char text[17];
+        std::snprintf(text, sizeof(text), "%016llx", static_cast<unsigned long long>(hash));
+        return text;
+    }
+
+    /**
+     * @brief Describes everything a compiled program depends on.
+     *
+     * A cached binary is only used when its stored description matches this one
+     * exactly, so a new driver, device, option set or kernel edit rebuilds it.
+     */
+    std::string describe_build(const std::vector<cl::Device>& devices, const std::string& source) {
+        std::string description;
+        for (const auto& device : devices) {
+            description += "device=" + device.getInfo<CL_DEVICE_NAME>() + "\n" +
+                           "vendor=" + device.getInfo<CL_DEVICE_VENDOR>() + "\n" +
+                           "version=" + device.getInfo<CL_DEVICE_VERSION>() + "\n" +
+                           "driver=" + device.getInfo<CL_DRIVER_VERSION>() + "\n" +
+                           "units=" + std::to_string(device.getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>()) + "\n";
+        }
+        return description + "options=" + KERNEL_BUILD_OPTIONS + "\n" + "source=" + hash_hex(source) + "\n";
+    }
+
+    /**
+     * @brief Reads cached program binaries, one per device, stored after their build description.
+     * @return True if the file exists, was written for the same description and holds count binaries.
+     */
+    bool read_cached_binaries(const std::string& path, const std::string& description, size_t count, cl::Binaries& binaries) {
+        std::ifstream file(path, std::ios::binary);
+        if (!file.is_open()) {
+            return false;
+        }
+        std::string stored(description.size(), '\0');
+        if (!file.read(&stored[0], stored.size()) || stored != description || file.get() != '\0') {
+            return false;
+        }
+        binaries.assign(count, {});
+        for (auto& binary : binaries) {
+            uint64_t size = 0;
+            if (!file.read(reinterpret_cast<char*>(&size), sizeof(size)) || size == 0) {
+                return false;
+            }
+            binary.resize(size);
+            if (!file.read(reinterpret_cast<char*>(binary.data()), size)) {
+                return false;
+            }
+        }
+        return file.peek() == std::ifstream::traits_type::eof();
+    }
+
+    /**
+     * @brief Stores program binaries after their build description, each prefixed with its size.
+     *
+     * Written to a temporary file named after this process and renamed, so
+     * instances starting together never write into one file and a concurrent
+     * start never reads a partial binary. Failures only cost the next start a
+     * rebuild.
+     */
+    void write_cached_binaries(const std::string& path, const std::string& description, const cl::Binaries& binaries) {
+        std::error_code error;
+        std::filesystem::create_directories(std::filesystem::path(path).parent_path(), error);
+        std::string temporary = path + "." + std::to_string(getpid()) + ".tmp";
+        {
+            std::ofstream file(temporary, std::ios::binary | std::ios::trunc);
+            file.write(description.data(), description.size());
+            file.put('\0');
+            for (const auto& binary : binaries) {
+                uint64_t size = binary.size();
+                file.write(reinterpret_cast<const char*>(&size), sizeof(size));
+                file.write(reinterpret_cast<const char*>(binary.data()), binary.size());
+            }
+            if (!file) {
+                std::cerr << "Could not write kernel cache " << temporary << std::endl;
+                file.close();
+                std::filesystem::remove(temporary, error);
+                return;
+            }
+        }
+        std::filesystem::rename(temporary, path, error);
+        if (error) {
+            std::cerr << "Could not write kernel cache " << path << ": " << error.message() << std::endl;
+            std::filesystem::remove(temporary, error);
+        }
+    }
+
+    /**
+     * @brief Which OpenCL devices to light with, read from the environment.
+     *
+     *     LIGHTING_CL_PLATFORM=<index>            only search this platform (default: all, in order)
+     *     LIGHTING_CL_DEVICE_TYPE=gpu|cpu|accelerator|all
+     *                                             only use this type (default: a GPU, else a CPU, else any)
+     *     LIGHTING_CL_DEVICE=<index>|all          the device of that type, or all of them (default: 0)
+     *     LIGHTING_CL_SUBDEVICES=<count>          split each device into this many sub-devices
+     */
+    struct DeviceSelection {
+        int platform = -1;
+        cl_device_type type = 0;
+        int device = 0;
+        bool allDevices = false;
+        int subDevices = 0;
+    };
+
+    /**
+     * @brief Parses a non-negative index or count from an environment variable.
+     * @throws std::invalid_argument Naming the variable, if the value is not one.
+     */
+    int parse_index(const char* name, const std::string& value) {
+        size_t end = 0;
+        int index = -1;
+        try {
+            index = std::stoi(value, &end);
+        } catch (const std::exception&) {
+        }
+        if (index < 0 || end != value.size()) {
+            throw std::invalid_argument(std::string("Bad ") + name + ": " + value + " (expected a non-negative integer)");
+        }
+        return index;
+    }
+
+    DeviceSelection read_device_selection() {
+        DeviceSelection selection;
+        auto read = [](const char* name) {
+            const char* value = std::getenv(name);
+            return std::string(value ? value : "");
+        };
+
+        std::string platform = read("LIGHTING_CL_PLATFORM");
+        if (!platform.empty()) {
+            selection.platform = parse_index("LIGHTING_CL_PLATFORM", platform);
+        }
+
+        std::string type = read("LIGHTING_CL_DEVICE_TYPE");
+        if (type == "gpu") selection.type = CL_DEVICE_TYPE_GPU;
+        else if (type == "cpu") selection.type = CL_DEVICE_TYPE_CPU;
+        else if (type == "accelerator") selection.type = CL_DEVICE_TYPE_ACCELERATOR;
+        else if (type == "all") selection.type = CL_DEVICE_TYPE_ALL;
+        else if (!type.empty()) throw std::invalid_argument("Unknown LIGHTING_CL_DEVICE_TYPE: " + type);
+
+        std::string device = read("LIGHTING_CL_DEVICE");
+        if (device == "all") {
+            selection.allDevices = true;
+        } else if (!device.empty()) {
+            selection.device = parse_index("LIGHTING_CL_DEVICE", device);
+        }
+
+        std::string subDevices = read("LIGHTING_CL_SUBDEVICES");
+        if (!subDevices.empty()) {
+            selection.subDevices = parse_index("LIGHTING_CL_SUBDEVICES", subDevices);
+        }
+        return selection;
+    }
+
+    /**
+     * @brief Finds the devices of one type on one platform.
+     * @return The devices, or nothing if the platform has none of the type.
+     */
+    std::vector<cl::Device> find_devices(const cl::Platform& platform, cl_device_type type) {
+        std::vector<cl::Device> devices;
+        try {
+            platform.getDevices(type, &devices);
+        } catch (cl::Error&) {
+            // CL_DEVICE_NOT_FOUND: the platform has no device of this type.
+            return {};
+        }
+        return devices;
+    }
+
+    /**
+     * @brief Splits each device into sub-devices of equal compute units.
+     *
+     * Devices that cannot be partitioned are kept whole.
+     */
+    std::vector<cl::Device> partition_devices(std::vector<cl::Device>& devices, int count) {
+        std::vector<cl::Device> partitioned;
+        for (auto& device : devices) {
+            cl_uint units = device.getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>();
+            std::vector<cl::Device> subDevices;
+            if (count > 1 && units >= static_cast<cl_uint>(count)) {
+                const cl_device_partition_property properties[] = {
+                        CL_DEVICE_PARTITION_EQUALLY, static_cast<cl_device_partition_property>(units / count), 0};
+                try {
+                    device.createSubDevices(properties, &subDevices);
+                } catch (cl::Error& e) {
+                    std::cerr << "Could not partition " << device.getInfo<CL_DEVICE_NAME>() << " (" << e.err() << "), using it whole" << std::endl;
+                    subDevices.clear();
+                }
+            }
+            if (subDevices.empty()) {
+                partitioned.push_back(device);
+            } else {
+                partitioned.insert(partitioned.end(), subDevices.begin(), subDevices.end());
+            }
+        }
+        return partitioned;
+    }
+}
+
+OpenCLWrapper::OpenCLWrapper() {}
+
+OpenCLWrapper::~OpenCLWrapper() {
+    // Pipelined frames may still be reading staged uploads or writing readback buffers.
+    try {
+        finishQueues();
+    } catch (...) {
+    }
+}
+
+/**
+ * @brief Creates the command queues, with profiling enabled when the options ask for it.
+ */
+void OpenCLWrapper::createQueues() {
+    cl_command_queue_properties properties = options.profiling ? CL_QUEUE_PROFILING_ENABLE : 0;
+    queue = cl::CommandQueue(context, devices[0], properties);
+    transferQueue = cl::CommandQueue(context, devices[0], properties);
+    bandQueues.clear();
+    for (size_t d = 1; d < devices.size(); ++d) {
+        bandQueues.emplace_back(context, devices[d], properties);
+    }
+}
+
+/**
+ * @brief Waits for every queue to drain.
+ */
+void OpenCLWrapper::finishQueues() const {
+    for (const auto& bandQueue : bandQueues) {
+        bandQueue.finish();
+    }
+    queue.finish();
+    transferQueue.finish();
+}
+
+/**
+ * @brief Changes the lighting options, recreating the queues when profiling is switched.
+ *
+ * Queues only take the profiling flag when they are created, so the current
+ * ones are drained first; commands already recorded are resolved.
+ *
+ * @param newOptions The options to use from now on.
+ */
+void OpenCLWrapper::setOptions(const LightingOptions& newOptions) {
+    bool profilingChanged = newOptions.profiling != options.profiling;
+    LightingBackend::setOptions(newOptions);
+    if (!profilingChanged) {
+        return;
+    }
+    try {
+        finishQueues();
+        profiler.finish();
+        createQueues();
+        profiler.setEnabled(options.profiling);
+    } catch (cl::Error& e) {
+        throw std::runtime_error("OpenCL error: " + std::string(e.what()) + " (" + std::to_string(e.err()) + ")");
+    }
+}
 
 /**
  * @brief Initializes the OpenCL environment and compiles the kernels.
+ *
+ * The devices are chosen as described by DeviceSelection: by default the
+ * first GPU on any platform, falling back to the first CPU device (such as
+ * PoCL) and then to any device. When several devices or sub-devices are
+ * selected, they share one context: the first one runs everything, and the
+ * others take row bands of the lighting passes. A device index past the
+ * devices of the first type found is an error, not a reason to try the next
+ * type.
+ *
+ * @throws std::invalid_argument If a LIGHTING_CL_* variable cannot be parsed.
+ * @throws std::runtime_error If no matching device is available or the kernels fail to build.
  */
 void OpenCLWrapper::initialize() {
     try {
+        DeviceSelection selection = read_device_selection();
         std::vector<cl::Platform> platforms;
         cl::Platform::get(&platforms);
-        cl::Platform platform = platforms[0];
+        if (selection.platform >= static_cast<int>(platforms.size())) {
+            throw std::runtime_error("No OpenCL platform " + std::to_string(selection.platform));
+        }
 
-        std::vector<cl::Device> devices;
-        platform.getDevices(CL_DEVICE_TYPE_GPU, &devices);
-        cl::Device device = devices[0];
+        std::vector<cl_device_type> types = selection.type != 0
+                ? std::vector<cl_device_type>{selection.type}
+                : std::vector<cl_device_type>{CL_DEVICE_TYPE_GPU, CL_DEVICE_TYPE_CPU, CL_DEVICE_TYPE_ALL};
+        devices.clear();
+        for (size_t t = 0; t < types.size() && devices.empty(); ++t) {
+            bool typeFound = false;
+            for (size_t p = 0; p < platforms.size() && devices.empty(); ++p) {
+                if (selection.platform >= 0 && selection.platform != static_cast<int>(p)) {
+                    continue;
+                }
+                std::vector<cl::Device> found = find_devices(platforms[p], types[t]);
+                typeFound = typeFound || !found.empty();
+                if (selection.allDevices) {
+                    devices = found;
+                } else if (selection.device < static_cast<int>(found.size())) {
+                    devices = {found[selection.device]};
+                }
+            }
+            // A device index names a device of the first type present, not of any type.
+            if (typeFound && devices.empty()) {
+                throw std::runtime_error("No OpenCL device " + std::to_string(selection.device) + " (LIGHTING_CL_DEVICE)");
+            }
+        }
+        if (devices.empty()) {
+            throw std::runtime_error("No matching OpenCL device found");
+        }
+        if (selection.subDevices > 1) {
+            devices = partition_devices(devices, selection.subDevices);
+        }
 
-        std::cout << "Using device: " << device.getInfo<CL_DEVICE_NAME>() << std::endl;
-        std::cout << "Device vendor: " << device.getInfo<CL_DEVICE_VENDOR>() << std::endl;
-        std::cout << "Device version: " << device.getInfo<CL_DEVICE_VERSION>() << std::endl;
+        for (const auto& device : devices) {
+            std::cout << "Using device: " << device.getInfo<CL_DEVICE_NAME>() << std::endl;
+            std::cout << "Device vendor: " << device.getInfo<CL_DEVICE_VENDOR>() << std::endl;
+            std::cout << "Device version: " << device.getInfo<CL_DEVICE_VERSION>() << std::endl;
+            std::cout << "Compute units: " << device.getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>() << std::endl;
+        }
 
-        context = cl::Context(device);
-        queue = cl::CommandQueue(context, device);
+        context = cl::Context(devices);
+        createQueues();
+        profiler.setEnabled(options.profiling);
 
-        std::string kernelSource = readKernelSource("lighting_kernels.cl");
-        program = cl::Program(context, kernelSource);
-        program.build({device});
+        program = buildProgram();
 
-        torchKernel = cl::Kernel(program, "calculate_torch_lighting");
-        radialKernel = cl::Kernel(program, "calculate_radial_lighting");
+        lightingKernel = cl::Kernel(program, "calculate_lighting");
+        fillBaseKernel = cl::Kernel(program, "fill_base_levels");
         updateHeightsKernel = cl::Kernel(program, "update_heights");
-        raycastKernel = cl::Kernel(program, "raycast");
+        updatePyramidKernel = cl::Kernel(program, "update_height_pyramid");
+        shadowProfileKernel = cl::Kernel(program, "build_shadow_profiles");
+        shadeKernel = cl::Kernel(program, "shade_cells");
 
         collisionBuffer = cl::Buffer(context, CL_MEM_READ_ONLY, MAX_COLLISIONS * sizeof(cl_int2));
 
     } catch (cl::Error& e) {
-        std::cerr << "OpenCL error: " << e.what() << " (" << e.err() << ")" << std::endl;
-        exit(1);
+        throw std::runtime_error("OpenCL error: " + std::string(e.what()) + " (" + std::to_string(e.err()) + ")");
+    }
+}
+
+/**
+ * @brief Builds the kernel program for the selected devices, from the on-disk binary cache when possible.
+ *
+ * Binaries live in KERNEL_CACHE_DIRECTORY, named by a hash of the devices,
+ * driver, build options and kernel source. A missing, stale or rejected
+ * binary falls back to building from source, and the fresh binaries replace
+ * the cached ones. The time taken is printed either way.
+ *
+ * @return The built program.
+ */
+cl::Program OpenCLWrapper::buildProgram() {
+    auto start = std::chrono::high_resolution_clock::now();
+    auto report = [&](const char* how) {
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+        std::cout << "Kernel program " << how << " in " << ms << " ms" << std::endl;
+    };
+
+    std::string kernelSource = readKernelSource(KERNEL_SOURCE_PATH);
+    std::string description = describe_build(devices, kernelSource);
+    std::string cachePath = std::string(KERNEL_CACHE_DIRECTORY) + "/lighting_kernels-" + hash_hex(description) + ".bin";
+
+    cl::Binaries binaries;
+    if (read_cached_binaries(cachePath, description, devices.size(), binaries)) {
+        try {
+            cl::Program cached(context, devices, binaries);
+            cached.build(devices, KERNEL_BUILD_OPTIONS);
+            report("loaded from cache");
+            return cached;
+        } catch (cl::Error& e) {
+            std::cerr << "Cached kernel binary rejected (" << e.err() << "), rebuilding from source" << std::endl;
+        }
+    }
+
+    cl::Program built(context, kernelSource);
+    built.build(devices, KERNEL_BUILD_OPTIONS);
+    binaries = built.getInfo<CL_PROGRAM_BINARIES>();
+    if (binaries.size() == devices.size() && std::none_of(binaries.begin(), binaries.end(), [](const cl::Binary& b) { return b.empty(); })) {
+        write_cached_binaries(cachePath, description, binaries);
     }
+    report("built from source");
+    return built;
 }
 
 /**
@@ -57,16 +414,61 @@ void OpenCLWrapper::initialize() {
  * @param initialGrid The initial grid state.
  */
 void OpenCLWrapper::initializeGrid(const Grid& initialGrid) {
-    gridWidth = initialGrid.width;
-    gridHeight = initialGrid.height;
+    initializeHostGrid(initialGrid);
     createBuffers(gridWidth, gridHeight);
 
-    std::vector<cl_int> gridHeights(gridWidth * gridHeight);
-    for (int i = 0; i < gridWidth * gridHeight; ++i) {
-        gridHeights[i] = static_cast<cl_int>(initialGrid.cells[i].height);
-    }
+    const std::vector<uint8_t>& gridHeights = collisionGrid.getHeights();
+    queue.enqueueWriteBuffer(gridHeightsBuffer, CL_TRUE, 0, gridHeights.size() * sizeof(cl_uchar), gridHeights.data());
+    const std::vector<uint8_t>& pyramid = collisionGrid.getPyramid();
+    queue.enqueueWriteBuffer(heightPyramidBuffer, CL_TRUE, 0, pyramid.size() * sizeof(cl_uchar), pyramid.data());
+}
+
+/**
+ * @brief Sets up the host grid and device buffers to stream from a level file.
+ *
+ * The device heights start as all floor, like the host mirror; chunks are
+ * written by uploadLevelChunk as they are loaded.
+ *
+ * @param level The level; it must stay open while the backend uses it.
+ */
+void OpenCLWrapper::initializeLevel(const LevelFile& level) {
+    initializeHostLevel(level);
+    createBuffers(gridWidth, gridHeight);
+
+    const cl_uchar floor = static_cast<cl_uchar>(HeightLevel::FLOOR);
+    queue.enqueueFillBuffer(gridHeightsBuffer, floor, 0, gridWidth * gridHeight * sizeof(cl_uchar));
+    queue.enqueueFillBuffer(heightPyramidBuffer, floor, 0, collisionGrid.getPyramid().size() * sizeof(cl_uchar));
+}
 
-    queue.enqueueWriteBuffer(gridHeightsBuffer, CL_TRUE, 0, gridWidth * gridHeight * sizeof(cl_int), gridHeights.data());
+/**
+ * @brief Writes a newly loaded level chunk to the device heights and height pyramid.
+ *
+ * The heights are copied straight from the level mapping, which stays valid,
+ * so that write does not block. The pyramid blocks over the chunk come from
+ * the host mirror, which later collisions change, so those writes do.
+ *
+ * @param rect The cells of the chunk.
+ * @param heights The chunk's heights in the level mapping, LEVEL_CHUNK_SIZE bytes per row.
+ */
+void OpenCLWrapper::uploadLevelChunk(const GridRect& rect, const uint8_t* heights) {
+    size_t rowPitch = gridWidth * sizeof(cl_uchar);
+    std::array<size_t, 3> origin = {static_cast<size_t>(rect.x0), static_cast<size_t>(rect.y0), 0};
+    std::array<size_t, 3> size = {static_cast<size_t>(rect.x1 - rect.x0), static_cast<size_t>(rect.y1 - rect.y0), 1};
+    queue.enqueueWriteBufferRect(gridHeightsBuffer, CL_FALSE, origin, {0, 0, 0}, size, rowPitch, 0, LEVEL_CHUNK_SIZE, 0, heights, nullptr,
+                                 profiler.record("write_level_chunk", DeviceCommandKind::WRITE, 0, size[0] * size[1]));
+
+    const std::vector<uint8_t>& pyramid = collisionGrid.getPyramid();
+    for (int level = 1; level <= HEIGHT_PYRAMID_LEVELS; ++level) {
+        size_t levelPitch = collisionGrid.getLevelWidth(level);
+        // A level's rows do not start on a multiple of its pitch, so its offset goes into the x origin.
+        std::array<size_t, 3> blockOrigin = {collisionGrid.getLevelOffset(level) + (static_cast<size_t>(rect.x0) >> level),
+                                             static_cast<size_t>(rect.y0) >> level, 0};
+        std::array<size_t, 3> blocks = {static_cast<size_t>((rect.x1 - 1) >> level) - (static_cast<size_t>(rect.x0) >> level) + 1,
+                                        static_cast<size_t>((rect.y1 - 1) >> level) - (static_cast<size_t>(rect.y0) >> level) + 1, 1};
+        queue.enqueueWriteBufferRect(heightPyramidBuffer, CL_TRUE, blockOrigin, blockOrigin, blocks, levelPitch, 0, levelPitch, 0,
+                                     pyramid.data(), nullptr,
+                                     profiler.record("write_level_chunk", DeviceCommandKind::WRITE, 0, blocks[0] * blocks[1]));
+    }
 }
 
 /**
@@ -76,74 +478,189 @@ void OpenCLWrapper::initializeGrid(const Grid& initialGrid) {
  */
 void OpenCLWrapper::createBuffers(int width, int height) {
     size_t gridSize = width * height;
-    gridHeightsBuffer = cl::Buffer(context, CL_MEM_READ_WRITE, gridSize * sizeof(int));
-    lightLevelsBuffer = cl::Buffer(context, CL_MEM_READ_WRITE, gridSize * sizeof(int));
-    torchBuffer = cl::Buffer(context, CL_MEM_READ_ONLY, sizeof(Torch));
-    radialLightsBuffer = cl::Buffer(context, CL_MEM_READ_ONLY, MAX_RADIAL_LIGHTS * sizeof(RadialLight));
+    gridHeightsBuffer = cl::Buffer(context, CL_MEM_READ_WRITE, gridSize * sizeof(cl_uchar));
+    heightPyramidBuffer = cl::Buffer(context, CL_MEM_READ_WRITE, collisionGrid.getPyramid().size() * sizeof(cl_uchar));
+    for (int slot = 0; slot < 2; ++slot) {
+        lightLevelsBuffers[slot] = cl::Buffer(context, CL_MEM_READ_WRITE, gridSize * sizeof(cl_uchar));
+        slotSubmitted[slot] = false;
+    }
+    currentSlot = 0;
+    bandLevelsBuffers.clear();
+    for (size_t d = 1; d < devices.size(); ++d) {
+        bandLevelsBuffers.emplace_back(context, CL_MEM_READ_WRITE, gridSize * sizeof(cl_uchar));
+    }
+    staticLevelsBuffer = cl::Buffer(context, CL_MEM_READ_WRITE, gridSize * sizeof(cl_uchar));
+    torchBuffer = cl::Buffer(context, CL_MEM_READ_ONLY, sizeof(PackedTorch));
+    // The lighting kernels always take these buffers, so keep placeholders until the first pass sizes them.
+    radialLightsCapacity = 0;
+    reserveBuffer(radialLightsBuffer, radialLightsCapacity, sizeof(PackedLight), CL_MEM_READ_ONLY);
+    binOffsetsCapacity = 0;
+    reserveBuffer(binOffsetsBuffer, binOffsetsCapacity, sizeof(cl_int), CL_MEM_READ_ONLY);
+    binIndicesCapacity = 0;
+    reserveBuffer(binIndicesBuffer, binIndicesCapacity, sizeof(cl_int), CL_MEM_READ_ONLY);
+    lightTilesCapacity = 0;
+    reserveBuffer(lightTilesBuffer, lightTilesCapacity, sizeof(cl_int4), CL_MEM_READ_ONLY);
+    shadowSourcesCapacity = 0;
+    reserveBuffer(shadowSourcesBuffer, shadowSourcesCapacity, sizeof(ShadowSource), CL_MEM_READ_ONLY);
+    shadowProfileCapacity = 0;
+    reserveBuffer(shadowProfilesBuffer, shadowProfileCapacity, sizeof(cl_float), CL_MEM_READ_WRITE);
 }
 
 /**
- * @brief Adds a collision point to be processed.
- * @param x The x-coordinate of the collision point.
- * @param y The y-coordinate of the collision point.
+ * @brief Makes sure a device buffer holds at least the given number of bytes.
+ *
+ * Buffers grow to at least double their size, so a scene whose light count
+ * creeps up reallocates rarely. The old contents are not kept.
+ *
+ * @param buffer The buffer to grow.
+ * @param capacity The buffer's current size in bytes; updated when it grows.
+ * @param bytes The number of bytes needed.
+ * @param flags Memory flags for a new buffer.
  */
-void OpenCLWrapper::addCollisionPoint(int x, int y) {
-    collisionPoints.push_back({static_cast<cl_int>(x), static_cast<cl_int>(y)});
+void OpenCLWrapper::reserveBuffer(cl::Buffer& buffer, size_t& capacity, size_t bytes, cl_mem_flags flags) {
+    if (bytes <= capacity) {
+        return;
+    }
+    capacity = std::max(bytes, capacity * 2);
+    buffer = cl::Buffer(context, flags, capacity);
 }
 
 /**
- * @brief Updates the grid heights based on collision points.
+ * @brief Lays out and builds the shadow profiles of the lights and torch on the device.
+ *
+ * The profile buffer grows as needed; one work-item runs per bucket of each source.
+ *
+ * @param lights The radial lights in the scene.
+ * @param torch The player's torch.
+ * @param torch_on Whether the torch is turned on.
+ */
+void OpenCLWrapper::buildShadowProfiles(const std::vector<RadialLight>& lights, const Torch& torch, bool torch_on) {
+    size_t profileSize = shadowMap.layout(lights, torch, torch_on);
+    const std::vector<ShadowSource>& sources = shadowMap.getSources();
+    if (sources.empty()) {
+        return;
+    }
+    reserveBuffer(shadowProfilesBuffer, shadowProfileCapacity, profileSize * sizeof(cl_float), CL_MEM_READ_WRITE);
+    reserveBuffer(shadowSourcesBuffer, shadowSourcesCapacity, sources.size() * sizeof(ShadowSource), CL_MEM_READ_ONLY);
+    writeBuffer(shadowSourcesBuffer, sources.data(), sources.size() * sizeof(ShadowSource), "write_shadow_sources");
+
+    int maxBuckets = 0;
+    for (const auto& source : sources) {
+        maxBuckets = std::max(maxBuckets, source.buckets);
+    }
+
+    shadowProfileKernel.setArg(0, shadowProfilesBuffer);
+    shadowProfileKernel.setArg(1, gridHeightsBuffer);
+    shadowProfileKernel.setArg(2, shadowSourcesBuffer);
+    shadowProfileKernel.setArg(3, static_cast<cl_int>(sources.size()));
+    shadowProfileKernel.setArg(4, static_cast<cl_int>(gridWidth));
+    shadowProfileKernel.setArg(5, static_cast<cl_int>(gridHeight));
+    queue.enqueueNDRangeKernel(shadowProfileKernel, cl::NullRange, cl::NDRange(maxBuckets, sources.size()), cl::NullRange, nullptr,
+                               profiler.record("build_shadow_profiles", DeviceCommandKind::KERNEL, 0));
+}
+
+/**
+ * @brief Pushes the cells flattened since the last pass to the device heights and height pyramid.
+ *
+ * The pyramid is rebuilt level by level over the affected blocks; the queue is
+ * in order, so each level sees the one below it finished.
  */
 void OpenCLWrapper::updateGridHeights() {
-    if (!collisionPoints.empty()) {
-        queue.enqueueWriteBuffer(collisionBuffer, CL_TRUE, 0,
-                                 collisionPoints.size() * sizeof(cl_int2), collisionPoints.data());
+    for (size_t first = 0; first < changedCells.size(); first += MAX_COLLISIONS) {
+        size_t count = std::min(changedCells.size() - first, static_cast<size_t>(MAX_COLLISIONS));
+        std::vector<cl_int2> collisionPoints(count);
+        for (size_t i = 0; i < count; ++i) {
+            collisionPoints[i] = {{static_cast<cl_int>(changedCells[first + i].first), static_cast<cl_int>(changedCells[first + i].second)}};
+        }
+
+        writeBuffer(collisionBuffer, collisionPoints.data(), collisionPoints.size() * sizeof(cl_int2), "write_collisions");
 
         updateHeightsKernel.setArg(0, gridHeightsBuffer);
         updateHeightsKernel.setArg(1, collisionBuffer);
         updateHeightsKernel.setArg(2, static_cast<int>(collisionPoints.size()));
         updateHeightsKernel.setArg(3, gridWidth);
 
-        queue.enqueueNDRangeKernel(updateHeightsKernel, cl::NullRange,
-                                   cl::NDRange(collisionPoints.size()));
+        queue.enqueueNDRangeKernel(updateHeightsKernel, cl::NullRange, cl::NDRange(collisionPoints.size()), cl::NullRange, nullptr,
+                                   profiler.record("update_heights", DeviceCommandKind::KERNEL, 0));
 
-        collisionPoints.clear();
+        updatePyramidKernel.setArg(0, heightPyramidBuffer);
+        updatePyramidKernel.setArg(1, gridHeightsBuffer);
+        updatePyramidKernel.setArg(2, collisionBuffer);
+        updatePyramidKernel.setArg(3, static_cast<int>(collisionPoints.size()));
+        updatePyramidKernel.setArg(4, gridWidth);
+        updatePyramidKernel.setArg(5, gridHeight);
+        for (int level = 1; level <= HEIGHT_PYRAMID_LEVELS; ++level) {
+            updatePyramidKernel.setArg(6, level);
+            queue.enqueueNDRangeKernel(updatePyramidKernel, cl::NullRange, cl::NDRange(collisionPoints.size()), cl::NullRange, nullptr,
+                                       profiler.record("update_height_pyramid", DeviceCommandKind::KERNEL, 0));
+        }
     }
 }
 
 /**
- * @brief Calculates lighting for the entire grid.
+ * @brief Calculates lighting for the entire grid, or only its dirty regions in incremental mode.
+ *
+ * Static lights are first baked into staticLevelsBuffer, only over the regions
+ * where that layer is stale. The dynamic lights and torch are then evaluated
+ * on top of it. Each region is dispatched with a global offset, so in
+ * incremental mode the kernels only run over the tiles whose light level can
+ * have changed.
+ *
+ * In pipelined mode the frame goes to the other light-level buffer and
+ * nothing blocks: uploads are staged, the kernels are followed by a marker
+ * event, and a readback into host memory waits on that event on the transfer
+ * queue. readLightLevels then hands out the previous frame while this one runs.
+ * Both the copy between slots and the readback only cover the active rectangle.
+ *
  * @param lights The radial lights in the scene.
  * @param torch The player's torch.
  * @param torch_on Whether the torch is turned on.
  */
 void OpenCLWrapper::calculateLighting(const std::vector<RadialLight>& lights, const Torch& torch, bool torch_on) {
     try {
-        updateGridHeights();
-
-        std::vector<cl_int> lightLevels(gridWidth * gridHeight, 0);
-        queue.enqueueWriteBuffer(lightLevelsBuffer, CL_TRUE, 0, gridWidth * gridHeight * sizeof(cl_int), lightLevels.data());
-        queue.enqueueWriteBuffer(radialLightsBuffer, CL_TRUE, 0, lights.size() * sizeof(RadialLight), lights.data());
-
-        radialKernel.setArg(0, lightLevelsBuffer);
-        radialKernel.setArg(1, gridHeightsBuffer);
-        radialKernel.setArg(2, radialLightsBuffer);
-        radialKernel.setArg(3, static_cast<cl_int>(lights.size()));
-        radialKernel.setArg(4, static_cast<cl_int>(gridWidth));
-        radialKernel.setArg(5, static_cast<cl_int>(gridHeight));
-
-        queue.enqueueNDRangeKernel(radialKernel, cl::NullRange, cl::NDRange(gridWidth, gridHeight));
-
-        if (torch_on) {
-            queue.enqueueWriteBuffer(torchBuffer, CL_TRUE, 0, sizeof(Torch), &torch);
+        profiler.beginFrame();
+        std::array<size_t, 3> activeOrigin = {static_cast<size_t>(activeRect.x0), static_cast<size_t>(activeRect.y0), 0};
+        std::array<size_t, 3> activeRegion = {static_cast<size_t>(activeRect.x1 - activeRect.x0),
+                                              static_cast<size_t>(activeRect.y1 - activeRect.y0), 1};
+        size_t rowPitch = gridWidth * sizeof(cl_uchar);
+        if (options.pipelined) {
+            int previousSlot = currentSlot;
+            currentSlot = 1 - currentSlot;
+            reclaimSlot(currentSlot);
+            if (options.incremental) {
+                // Cells outside the dirty regions keep the previous frame's levels.
+                queue.enqueueCopyBufferRect(lightLevelsBuffers[previousSlot], lightLevelsBuffers[currentSlot],
+                                            activeOrigin, activeOrigin, activeRegion, rowPitch, 0, rowPitch, 0, nullptr,
+                                            profiler.record("copy_previous_levels", DeviceCommandKind::COPY, 0, activeRegion[0] * activeRegion[1]));
+            }
+        }
 
-            torchKernel.setArg(0, lightLevelsBuffer);
-            torchKernel.setArg(1, gridHeightsBuffer);
-            torchKernel.setArg(2, torchBuffer);
-            torchKernel.setArg(3, static_cast<cl_int>(gridWidth));
-            torchKernel.setArg(4, static_cast<cl_int>(gridHeight));
+        updateGridHeights();
+        if (options.pipelined) {
+            // shadeOnDevice reads the heights from the transfer queue.
+            queue.enqueueMarkerWithWaitList(nullptr, &heightsUpdated);
+        }
+        std::vector<GridRect> regions = collectLightingRegions(lights, torch, torch_on);
+        if (!staticRegions.empty()) {
+            runLightingPass(staticRegions, staticLights, torch, false, staticLevelsBuffer, false);
+        }
+        if (!regions.empty()) {
+            runLightingPass(regions, dynamicLights, torch, torch_on, lightLevelsBuffers[currentSlot], true);
+        }
 
-            queue.enqueueNDRangeKernel(torchKernel, cl::NullRange, cl::NDRange(gridWidth, gridHeight));
+        if (options.pipelined) {
+            queue.enqueueMarkerWithWaitList(nullptr, &computeDone[currentSlot]);
+            std::vector<cl::Event> dependencies = {computeDone[currentSlot]};
+            readbackLevels[currentSlot].resize(gridWidth * gridHeight);
+            transferQueue.enqueueReadBufferRect(lightLevelsBuffers[currentSlot], CL_FALSE, activeOrigin, activeOrigin, activeRegion,
+                                                rowPitch, 0, rowPitch, 0, readbackLevels[currentSlot].data(),
+                                                &dependencies, &readbackDone[currentSlot]);
+            if (cl::Event* event = profiler.record("read_levels", DeviceCommandKind::READ, 1, activeRegion[0] * activeRegion[1])) {
+                *event = readbackDone[currentSlot];
+            }
+            slotSubmitted[currentSlot] = true;
+            queue.flush();
+            transferQueue.flush();
         }
 
     } catch (cl::Error& e) {
@@ -153,54 +670,350 @@ void OpenCLWrapper::calculateLighting(const std::vector<RadialLight>& lights, co
 }
 
 /**
- * @brief Reads the current grid heights from the GPU.
- * @param heights Vector to store the read heights.
+ * @brief Waits until a pipeline slot's last frame has been read back, then frees its staged uploads.
+ * @param slot The slot about to be reused.
  */
-void OpenCLWrapper::readGridHeights(std::vector<int>& heights) const {
-    heights.resize(gridWidth * gridHeight);
-    queue.enqueueReadBuffer(gridHeightsBuffer, CL_TRUE, 0, gridWidth * gridHeight * sizeof(int), heights.data());
+void OpenCLWrapper::reclaimSlot(int slot) {
+    if (slotSubmitted[slot]) {
+        readbackDone[slot].wait();
+    }
+    uploadStaging[slot].clear();
 }
 
 /**
- * @brief Reads the current light levels from the GPU.
- * @param levels Vector to store the read light levels.
+ * @brief Uploads host data to a device buffer.
+ *
+ * Blocking in synchronous mode. In pipelined mode the data is copied into the
+ * current slot's staging area and the write is queued without waiting; the
+ * copy lives until the slot is reclaimed two frames later.
+ *
+ * @param buffer The buffer to write, from offset 0.
+ * @param data The data to upload.
+ * @param bytes The number of bytes to upload.
+ * @param name What is uploaded, for the profiler.
  */
-void OpenCLWrapper::readLightLevels(std::vector<int>& levels) const {
-    levels.resize(gridWidth * gridHeight);
-    queue.enqueueReadBuffer(lightLevelsBuffer, CL_TRUE, 0, gridWidth * gridHeight * sizeof(int), levels.data());
+void OpenCLWrapper::writeBuffer(const cl::Buffer& buffer, const void* data, size_t bytes, const char* name) {
+    cl::Event* event = profiler.record(name, DeviceCommandKind::WRITE, 0, bytes);
+    if (!options.pipelined) {
+        queue.enqueueWriteBuffer(buffer, CL_TRUE, 0, bytes, data, nullptr, event);
+        return;
+    }
+    const unsigned char* first = static_cast<const unsigned char*>(data);
+    uploadStaging[currentSlot].emplace_back(first, first + bytes);
+    queue.enqueueWriteBuffer(buffer, CL_FALSE, 0, bytes, uploadStaging[currentSlot].back().data(), nullptr, event);
 }
 
 /**
- * @brief Performs a raycast to find a collision point.
- * @param start The start point of the ray.
- * @param end The end point of the ray.
- * @param hitPoint The resulting collision point (if any).
+ * @brief Splits a rectangle into one row band per device, sized by compute units.
+ *
+ * Band edges fall on lighting tile rows, so a tile is never computed by two
+ * devices. Bands can be empty when the rectangle is short.
+ *
+ * @param rect The cells to split.
+ * @return One band per entry of devices, top to bottom.
  */
-void OpenCLWrapper::getCollisionPoint(const Vector2D& start, const Vector2D& end, Vector2D& hitPoint) const {
-    cl_float2 clStart = {{static_cast<cl_float>(start.x), static_cast<cl_float>(start.y)}};
-    cl_float2 clEnd = {{static_cast<cl_float>(end.x), static_cast<cl_float>(end.y)}};
-    cl_float2 clHitPoint;
+std::vector<GridRect> OpenCLWrapper::splitRowBands(const GridRect& rect) const {
+    std::vector<long> units;
+    long totalUnits = 0;
+    for (const auto& device : devices) {
+        units.push_back(std::max<long>(device.getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>(), 1));
+        totalUnits += units.back();
+    }
+
+    std::vector<GridRect> bands;
+    long rows = rect.y1 - rect.y0;
+    long unitsAbove = 0;
+    int y0 = rect.y0;
+    for (size_t d = 0; d < devices.size(); ++d) {
+        unitsAbove += units[d];
+        long tileRows = (rows * unitsAbove / totalUnits + LIGHT_TILE_SIZE / 2) / LIGHT_TILE_SIZE;
+        int y1 = d + 1 == devices.size() ? rect.y1 : std::min(rect.y1, std::max(y0, rect.y0 + static_cast<int>(tileRows) * LIGHT_TILE_SIZE));
+        bands.push_back({rect.x0, y0, rect.x1, y1});
+        y0 = y1;
+    }
+    return bands;
+}
 
-    cl::Buffer startBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, sizeof(cl_float2), &clStart);
-    cl::Buffer endBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, sizeof(cl_float2), &clEnd);
-    cl::Buffer hitPointBuffer(context, CL_MEM_WRITE_ONLY, sizeof(cl_float2));
+/**
+ * @brief Runs the fused lighting kernel for one layer over a set of regions.
+ *
+ * The pass's lights are binned over the active rectangle first, and the
+ * light, bin and shadow buffers grow to fit them. The regions are then split
+ * into tiles: the lighting kernel is only launched over the lit tiles, and
+ * the dark ones, which no light or torch reaches, just take their base level.
+ * Each launch covers a run of the uploaded tile list, so one launch replaces
+ * a launch per region and its size follows the lit area.
+ *
+ * With several devices the active rectangle is split into row bands, each
+ * with its own run of lit and dark tiles. The extra devices start once
+ * everything queued so far on the main queue is done, write their part of
+ * each region into their own buffer, and the main queue copies those rows
+ * into the target after computing its own band.
+ *
+ * @param regions The cells to compute.
+ * @param passLights The radial lights to evaluate.
+ * @param torch The player's torch.
+ * @param torch_on Whether the torch is evaluated.
+ * @param target Receives the computed levels.
+ * @param onStaticLayer Whether each cell starts from the static lightmap rather than darkness.
+ */
+void OpenCLWrapper::runLightingPass(const std::vector<GridRect>& regions, const std::vector<RadialLight>& passLights,
+                                    const Torch& torch, bool torch_on, cl::Buffer& target, bool onStaticLayer) {
+    if (!passLights.empty()) {
+        pack_lights(passLights, packedLights);
+        reserveBuffer(radialLightsBuffer, radialLightsCapacity, packedLights.size() * sizeof(PackedLight), CL_MEM_READ_ONLY);
+        writeBuffer(radialLightsBuffer, packedLights.data(), packedLights.size() * sizeof(PackedLight), "write_lights");
+    }
 
-    cl::Kernel localRaycastKernel(raycastKernel);
+    lightBins.build(passLights, torch, torch_on, activeRect);
+    const std::vector<int32_t>& binOffsets = lightBins.getOffsets();
+    const std::vector<int32_t>& binIndices = lightBins.getIndices();
+    reserveBuffer(binOffsetsBuffer, binOffsetsCapacity, binOffsets.size() * sizeof(cl_int), CL_MEM_READ_ONLY);
+    writeBuffer(binOffsetsBuffer, binOffsets.data(), binOffsets.size() * sizeof(cl_int), "write_light_bins");
+    if (!binIndices.empty()) {
+        reserveBuffer(binIndicesBuffer, binIndicesCapacity, binIndices.size() * sizeof(cl_int), CL_MEM_READ_ONLY);
+        writeBuffer(binIndicesBuffer, binIndices.data(), binIndices.size() * sizeof(cl_int), "write_light_bins");
+    }
 
-    localRaycastKernel.setArg(0, gridHeightsBuffer);
-    localRaycastKernel.setArg(1, startBuffer);
-    localRaycastKernel.setArg(2, endBuffer);
-    localRaycastKernel.setArg(3, hitPointBuffer);
-    localRaycastKernel.setArg(4, static_cast<cl_int>(gridWidth));
-    localRaycastKernel.setArg(5, static_cast<cl_int>(gridHeight));
+    // One run of the tile list per band: its lit tiles, then its dark tiles.
+    struct TileRun {
+        size_t first;
+        size_t lit;
+        size_t dark;
+    };
+    auto band_part = [](const GridRect& region, const GridRect& band) {
+        return GridRect{region.x0, std::max(region.y0, band.y0), region.x1, std::min(region.y1, band.y1)};
+    };
+    std::vector<GridRect> bands = bandQueues.empty() ? std::vector<GridRect>{activeRect} : splitRowBands(activeRect);
+    std::vector<std::vector<GridRect>> bandParts(bands.size());
+    std::vector<TileRun> runs;
+    lightTiles.clear();
+    for (size_t b = 0; b < bands.size(); ++b) {
+        for (const auto& region : regions) {
+            GridRect part = band_part(region, bands[b]);
+            if (part.y0 < part.y1) {
+                bandParts[b].push_back(part);
+            }
+        }
+        size_t lit = lightBins.collectTiles(bandParts[b], bandTiles);
+        runs.push_back({lightTiles.size(), lit, bandTiles.size() - lit});
+        lightTiles.insert(lightTiles.end(), bandTiles.begin(), bandTiles.end());
+    }
+    if (lightTiles.empty()) {
+        return;
+    }
+    reserveBuffer(lightTilesBuffer, lightTilesCapacity, lightTiles.size() * sizeof(cl_int4), CL_MEM_READ_ONLY);
+    writeBuffer(lightTilesBuffer, lightTiles.data(), lightTiles.size() * sizeof(cl_int4), "write_light_tiles");
 
-    cl::CommandQueue localQueue(queue);
+    cl_int useShadowMap = options.occlusion == OcclusionMode::SHADOW_MAP ? 1 : 0;
+    if (useShadowMap) {
+        buildShadowProfiles(passLights, torch, torch_on);
+    }
 
-    localQueue.enqueueNDRangeKernel(localRaycastKernel, cl::NullRange, cl::NDRange(1));
-    localQueue.enqueueReadBuffer(hitPointBuffer, CL_TRUE, 0, sizeof(cl_float2), &clHitPoint);
+    if (torch_on) {
+        PackedTorch packedTorch = pack_torch(torch);
+        writeBuffer(torchBuffer, &packedTorch, sizeof(PackedTorch), "write_torch");
+    }
 
-    hitPoint.x = clHitPoint.s[0];
-    hitPoint.y = clHitPoint.s[1];
+    lightingKernel.setArg(1, staticLevelsBuffer);
+    lightingKernel.setArg(2, static_cast<cl_int>(onStaticLayer ? 1 : 0));
+    lightingKernel.setArg(3, gridHeightsBuffer);
+    lightingKernel.setArg(4, heightPyramidBuffer);
+    lightingKernel.setArg(5, radialLightsBuffer);
+    lightingKernel.setArg(6, static_cast<cl_int>(passLights.size()));
+    lightingKernel.setArg(7, binOffsetsBuffer);
+    lightingKernel.setArg(8, binIndicesBuffer);
+    lightingKernel.setArg(9, static_cast<cl_int>(lightBins.getTileX0()));
+    lightingKernel.setArg(10, static_cast<cl_int>(lightBins.getTileY0()));
+    lightingKernel.setArg(11, static_cast<cl_int>(lightBins.getTilesX()));
+    lightingKernel.setArg(12, torchBuffer);
+    lightingKernel.setArg(13, static_cast<cl_int>(torch_on ? 1 : 0));
+    lightingKernel.setArg(14, static_cast<cl_int>(gridWidth));
+    lightingKernel.setArg(15, static_cast<cl_int>(gridHeight));
+    lightingKernel.setArg(16, shadowProfilesBuffer);
+    lightingKernel.setArg(17, shadowSourcesBuffer);
+    lightingKernel.setArg(18, useShadowMap);
+    lightingKernel.setArg(19, lightTilesBuffer);
+    fillBaseKernel.setArg(1, staticLevelsBuffer);
+    fillBaseKernel.setArg(2, static_cast<cl_int>(onStaticLayer ? 1 : 0));
+    fillBaseKernel.setArg(3, lightTilesBuffer);
+    fillBaseKernel.setArg(5, static_cast<cl_int>(gridWidth));
+
+    // Queues both kernels over one run of tiles; each tile is LIGHT_TILE_SIZE work-items wide and tall.
+    auto enqueue_run = [&](cl::CommandQueue& runQueue, const TileRun& run, cl::Buffer& levels, const std::vector<cl::Event>* waitList,
+                           int queueIndex) {
+        if (run.lit > 0) {
+            lightingKernel.setArg(0, levels);
+            lightingKernel.setArg(20, static_cast<cl_int>(run.first));
+            runQueue.enqueueNDRangeKernel(lightingKernel, cl::NullRange, cl::NDRange(run.lit * LIGHT_TILE_SIZE, LIGHT_TILE_SIZE),
+                                          cl::NullRange, waitList, profiler.record("calculate_lighting", DeviceCommandKind::KERNEL, queueIndex));
+        }
+        if (run.dark > 0) {
+            fillBaseKernel.setArg(0, levels);
+            fillBaseKernel.setArg(4, static_cast<cl_int>(run.first + run.lit));
+            runQueue.enqueueNDRangeKernel(fillBaseKernel, cl::NullRange, cl::NDRange(run.dark * LIGHT_TILE_SIZE, LIGHT_TILE_SIZE),
+                                          cl::NullRange, waitList, profiler.record("fill_base_levels", DeviceCommandKind::KERNEL, queueIndex));
+        }
+    };
+
+    if (bandQueues.empty()) {
+        enqueue_run(queue, runs[0], target, nullptr, 0);
+        return;
+    }
+
+    cl::Event inputsReady;
+    queue.enqueueMarkerWithWaitList(nullptr, &inputsReady);
+    std::vector<cl::Event> waitForInputs = {inputsReady};
+    std::vector<cl::Event> bandDone(bandQueues.size());
+    for (size_t d = 0; d < bandQueues.size(); ++d) {
+        if (!bandParts[d + 1].empty()) {
+            enqueue_run(bandQueues[d], runs[d + 1], bandLevelsBuffers[d], &waitForInputs, static_cast<int>(d) + 2);
+            bandQueues[d].enqueueMarkerWithWaitList(nullptr, &bandDone[d]);
+            bandQueues[d].flush();
+        }
+    }
+
+    enqueue_run(queue, runs[0], target, nullptr, 0);
+
+    size_t rowPitch = gridWidth * sizeof(cl_uchar);
+    for (size_t d = 0; d < bandQueues.size(); ++d) {
+        std::vector<cl::Event> waitForBand = {bandDone[d]};
+        for (const auto& part : bandParts[d + 1]) {
+            std::array<size_t, 3> origin = {static_cast<size_t>(part.x0), static_cast<size_t>(part.y0), 0};
+            std::array<size_t, 3> size = {static_cast<size_t>(part.x1 - part.x0), static_cast<size_t>(part.y1 - part.y0), 1};
+            queue.enqueueCopyBufferRect(bandLevelsBuffers[d], target, origin, origin, size, rowPitch, 0, rowPitch, 0, &waitForBand,
+                                        profiler.record("copy_band", DeviceCommandKind::COPY, 0, size[0] * size[1]));
+        }
+    }
+}
+
+/**
+ * @brief Reads the light levels from the GPU.
+ *
+ * In pipelined mode this is the previous frame's result, one frame behind the
+ * last calculateLighting call (or that call's own result on the first frame).
+ *
+ * @param levels Vector to store the read light levels.
+ */
+void OpenCLWrapper::readLightLevels(std::vector<uint8_t>& levels) const {
+    if (!options.pipelined) {
+        levels.resize(gridWidth * gridHeight);
+        queue.enqueueReadBuffer(lightLevelsBuffers[currentSlot], CL_TRUE, 0, gridWidth * gridHeight * sizeof(cl_uchar), levels.data(), nullptr,
+                                profiler.record("read_levels", DeviceCommandKind::READ, 0, levels.size()));
+        return;
+    }
+
+    int slot = presentedSlot();
+    if (!slotSubmitted[slot]) {
+        levels.assign(gridWidth * gridHeight, 0);
+        return;
+    }
+    readbackDone[slot].wait();
+    levels.assign(readbackLevels[slot].begin(), readbackLevels[slot].end());
+}
+
+/**
+ * @brief Reads the light levels of a rectangle of cells from the GPU.
+ *
+ * Only the rectangle is transferred. In pipelined mode the rows come from the
+ * previous frame's readback, like readLightLevels.
+ *
+ * @param levels Receives the levels of rect, row by row.
+ * @param rect The cells to read.
+ */
+void OpenCLWrapper::readLightLevelRect(std::vector<uint8_t>& levels, const GridRect& rect) const {
+    size_t width = rect.x1 - rect.x0;
+    levels.resize(width * (rect.y1 - rect.y0));
+    if (levels.empty()) {
+        return;
+    }
+    if (!options.pipelined) {
+        std::array<size_t, 3> origin = {static_cast<size_t>(rect.x0), static_cast<size_t>(rect.y0), 0};
+        std::array<size_t, 3> hostOrigin = {0, 0, 0};
+        std::array<size_t, 3> region = {width, static_cast<size_t>(rect.y1 - rect.y0), 1};
+        queue.enqueueReadBufferRect(lightLevelsBuffers[currentSlot], CL_TRUE, origin, hostOrigin, region,
+                                    gridWidth * sizeof(cl_uchar), 0, width * sizeof(cl_uchar), 0, levels.data(), nullptr,
+                                    profiler.record("read_levels", DeviceCommandKind::READ, 0, levels.size()));
+        return;
+    }
+
+    int slot = presentedSlot();
+    if (!slotSubmitted[slot]) {
+        std::fill(levels.begin(), levels.end(), 0);
+        return;
+    }
+    readbackDone[slot].wait();
+    for (int y = rect.y0; y < rect.y1; ++y) {
+        std::copy_n(&readbackLevels[slot][y * gridWidth + rect.x0], width, &levels[(y - rect.y0) * width]);
+    }
+}
+
+/**
+ * @brief The slot whose frame is shown in pipelined mode: the previous frame,
+ * or the only submitted one on the first frame.
+ */
+int OpenCLWrapper::presentedSlot() const {
+    return slotSubmitted[1 - currentSlot] ? 1 - currentSlot : currentSlot;
+}
+
+/**
+ * @brief Shades the light levels into packed pixels on the device.
+ *
+ * Shades the same frame readLightLevels would return. In pipelined mode the
+ * kernel runs on the transfer queue after that frame's marker event and the
+ * height updates of the frame being computed, so it does not wait for that
+ * frame's lighting. The palette is only uploaded when it changes.
+ *
+ * @param palette Packed colour per (height, light level), as built by ShadeTable.
+ * @param rect The cells to shade.
+ * @param pixels Receives one packed colour per cell of rect, row by row.
+ * @return True; the pixels are always produced.
+ */
+bool OpenCLWrapper::shadeOnDevice(const std::vector<uint32_t>& palette, const GridRect& rect, std::vector<uint32_t>& pixels) const {
+    size_t cellCount = (rect.x1 - rect.x0) * (rect.y1 - rect.y0);
+    pixels.resize(cellCount);
+    if (cellCount == 0) {
+        return true;
+    }
+    if (pixelCapacity < cellCount) {
+        pixelCapacity = cellCount;
+        pixelBuffer = cl::Buffer(context, CL_MEM_WRITE_ONLY, pixelCapacity * sizeof(cl_uint));
+    }
+
+    int slot = options.pipelined ? presentedSlot() : currentSlot;
+    const cl::CommandQueue& shadeQueue = options.pipelined ? transferQueue : queue;
+    std::vector<cl::Event> dependencies;
+    if (options.pipelined && slotSubmitted[slot]) {
+        dependencies.push_back(computeDone[slot]);
+    }
+    if (options.pipelined && heightsUpdated() != nullptr) {
+        // The height updates of the frame being computed write the buffer the shade reads.
+        dependencies.push_back(heightsUpdated);
+    }
+
+    int shadeQueueIndex = options.pipelined ? 1 : 0;
+    if (palette != uploadedPalette) {
+        if (palette.size() != uploadedPalette.size()) {
+            paletteBuffer = cl::Buffer(context, CL_MEM_READ_ONLY, palette.size() * sizeof(cl_uint));
+        }
+        shadeQueue.enqueueWriteBuffer(paletteBuffer, CL_TRUE, 0, palette.size() * sizeof(cl_uint), palette.data(), nullptr,
+                                      profiler.record("write_palette", DeviceCommandKind::WRITE, shadeQueueIndex, palette.size() * sizeof(cl_uint)));
+        uploadedPalette = palette;
+    }
+    shadeKernel.setArg(0, gridHeightsBuffer);
+    shadeKernel.setArg(1, lightLevelsBuffers[slot]);
+    shadeKernel.setArg(2, paletteBuffer);
+    shadeKernel.setArg(3, pixelBuffer);
+    shadeKernel.setArg(4, static_cast<cl_int>(gridWidth));
+    shadeKernel.setArg(5, static_cast<cl_int>(rect.x0));
+    shadeKernel.setArg(6, static_cast<cl_int>(rect.y0));
+    shadeKernel.setArg(7, static_cast<cl_int>(rect.x1 - rect.x0));
+    shadeQueue.enqueueNDRangeKernel(shadeKernel, cl::NDRange(rect.x0, rect.y0), cl::NDRange(rect.x1 - rect.x0, rect.y1 - rect.y0),
+                                    cl::NullRange, dependencies.empty() ? nullptr : &dependencies,
+                                    profiler.record("shade_cells", DeviceCommandKind::KERNEL, shadeQueueIndex));
+    shadeQueue.enqueueReadBuffer(pixelBuffer, CL_TRUE, 0, cellCount * sizeof(cl_uint), pixels.data(), nullptr,
+                                 profiler.record("read_pixels", DeviceCommandKind::READ, shadeQueueIndex, cellCount * sizeof(cl_uint)));
+    return true;
 }
 
 /**
@@ -0,0 +1,54 @@
+/**
+ * @file packed_lights.cpp
+ * @brief Implements the packing of lights for the lighting passes.
+ */
+
+#include "./include/types.h"
+
+/**
+ * @brief Packs one radial light.
+ * @param light The light.
+ * @return The light with fp32 geometry and its level and cell precomputed.
+ */
+PackedLight pack_light(const RadialLight& light) {
+    PackedLight packed;
+    packed.x = static_cast<float>(light.position.x);
+    packed.y = static_cast<float>(light.position.y);
+    packed.radius = static_cast<float>(light.radius);
+    packed.radius_squared = packed.radius * packed.radius;
+    packed.level = static_cast<int32_t>(light.intensity);
+    packed.cell_x = static_cast<int32_t>(light.position.x);
+    packed.cell_y = static_cast<int32_t>(light.position.y);
+    packed.height = light.height;
+    return packed;
+}
+
+/**
+ * @brief Packs the lights of a pass, keeping their order so light bins still index them.
+ * @param lights The lights.
+ * @param packed Receives one packed light per light.
+ */
+void pack_lights(const std::vector<RadialLight>& lights, std::vector<PackedLight>& packed) {
+    packed.resize(lights.size());
+    for (size_t i = 0; i < lights.size(); ++i) {
+        packed[i] = pack_light(lights[i]);
+    }
+}
+
+/**
+ * @brief Packs the torch.
+ * @param torch The torch.
+ * @return The torch with fp32 geometry and its cell precomputed.
+ */
+PackedTorch pack_torch(const Torch& torch) {
+    PackedTorch packed;
+    packed.x = static_cast<float>(torch.position.x);
+    packed.y = static_cast<float>(torch.position.y);
+    packed.direction_x = static_cast<float>(torch.direction.x);
+    packed.direction_y = static_cast<float>(torch.direction.y);
+    packed.radius = static_cast<float>(torch.current_radius);
+    packed.cell_x = static_cast<int32_t>(torch.position.x);
+    packed.cell_y = static_cast<int32_t>(torch.position.y);
+    packed.padding = 0;
+    return packed;
+}
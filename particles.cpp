@@ -1,62 +1,163 @@
+/**
+ * @file particles.cpp
+ * @brief Implements the pooled ParticleSystem.
+ */
+
 #include "./include/types.h"
+#include <algorithm>
 #include <cmath>
 
+ParticleSystem::ParticleSystem(int capacity)
+        : capacity(capacity), count(0), dropped(0),
+          positionX(capacity), positionY(capacity), velocityX(capacity), velocityY(capacity), lifetime(capacity),
+          renderFrame(0) {}
 
-void create_particles(std::vector<Particle>& particles, const Vector2D& hit_point, const Vector2D& normal, int count) {
-    std::random_device rd;
-    std::mt19937 gen(rd());
+/**
+ * @brief Emits a burst of particles from a hit point, spread around the surface normal.
+ *
+ * The whole burst is written to the end of the pool in one go. Particles that
+ * do not fit are counted as dropped, but their random numbers are still drawn
+ * so the generator stays in step with an unbounded pool.
+ *
+ * @param hit_point Where the burst starts, in grid cells.
+ * @param normal The surface normal the particles fly along.
+ * @param count The number of particles in the burst.
+ * @param rng Random generator for the speed, angle and lifetime of each particle.
+ */
+void ParticleSystem::emit(const Vector2D& hit_point, const Vector2D& normal, int count, std::mt19937& rng) {
     std::uniform_real_distribution<> vel_dist(0.5, 2.5);
     std::uniform_int_distribution<> lifetime_dist(10, 25);
-    std::uniform_real_distribution<> angle_dist(-PI/25, PI/25);  // +/- 30 degrees
+    std::uniform_real_distribution<> angle_dist(-PI/25, PI/25);
 
-    // Calculate the base angle for the particles (now in the same direction as the normal)
     double base_angle = std::atan2(normal.y, normal.x);
+    int begin = this->count;
+    int fitting = std::min(count, capacity - begin);
 
     for (int i = 0; i < count; ++i) {
-        Particle p;
-        p.position = hit_point;
+        double angle = base_angle + angle_dist(rng);
+        double velocity_magnitude = vel_dist(rng);
+        int particle_lifetime = lifetime_dist(rng);
+        if (i >= fitting) {
+            continue;
+        }
+
+        int p = begin + i;
+        positionX[p] = static_cast<float>(hit_point.x);
+        positionY[p] = static_cast<float>(hit_point.y);
+        velocityX[p] = static_cast<float>(std::cos(angle) * velocity_magnitude);
+        velocityY[p] = static_cast<float>(std::sin(angle) * velocity_magnitude);
+        lifetime[p] = static_cast<int16_t>(particle_lifetime);
+    }
 
-        // Apply random angle deviation
-        double angle = base_angle + angle_dist(gen);
+    this->count += std::max(fitting, 0);
+    dropped += count - std::max(fitting, 0);
+}
+
+/**
+ * @brief Advances every particle by one frame and retires the expired ones.
+ *
+ * The integration is a branch-free loop over the field arrays; a second pass
+ * compacts the survivors to the front, keeping their order.
+ */
+void ParticleSystem::update() {
+    float* px = positionX.data();
+    float* py = positionY.data();
+    float* vx = velocityX.data();
+    float* vy = velocityY.data();
+    int16_t* life = lifetime.data();
+    const int n = count;
 
-        double velocity_magnitude = vel_dist(gen);
-        p.velocity.x = std::cos(angle) * velocity_magnitude;
-        p.velocity.y = std::sin(angle) * velocity_magnitude;
+    for (int i = 0; i < n; ++i) {
+        px[i] += vx[i];
+        py[i] += vy[i];
+        vx[i] *= PARTICLE_VELOCITY_DECAY;
+        vy[i] *= PARTICLE_VELOCITY_DECAY;
+        life[i] = static_cast<int16_t>(life[i] - 1);
+    }
 
-        p.lifetime = lifetime_dist(gen);
-        p.particle_color = rgba_color(255, 255, 255, 255);
-        p.velocity_decay = 0.7;  // 5% velocity decrease per frame
-        particles.push_back(p);
+    int kept = 0;
+    while (kept < n && life[kept] > 0) {
+        ++kept;
+    }
+    for (int i = kept + 1; i < n; ++i) {
+        if (life[i] > 0) {
+            px[kept] = px[i];
+            py[kept] = py[i];
+            vx[kept] = vx[i];
+            vy[kept] = vy[i];
+            life[kept] = life[i];
+            ++kept;
+        }
     }
+    count = kept;
 }
 
-void update_particles(std::vector<Particle>& particles) {
-    for (auto it = particles.begin(); it != particles.end();) {
-        it->position.x += it->velocity.x;
-        it->position.y += it->velocity.y;
-        it->lifetime--;
+/**
+ * @brief Copies the live particles of another system, such as into a snapshot for rendering.
+ *
+ * Only the first getCount() entries of each array are copied, and the storage
+ * is only reallocated when the capacities differ.
+ *
+ * @param other The system to copy.
+ */
+void ParticleSystem::copyFrom(const ParticleSystem& other) {
+    if (capacity != other.capacity) {
+        capacity = other.capacity;
+        positionX.resize(capacity);
+        positionY.resize(capacity);
+        velocityX.resize(capacity);
+        velocityY.resize(capacity);
+        lifetime.resize(capacity);
+    }
+    count = other.count;
+    dropped = other.dropped;
+    std::copy_n(other.positionX.begin(), count, positionX.begin());
+    std::copy_n(other.positionY.begin(), count, positionY.begin());
+    std::copy_n(other.velocityX.begin(), count, velocityX.begin());
+    std::copy_n(other.velocityY.begin(), count, velocityY.begin());
+    std::copy_n(other.lifetime.begin(), count, lifetime.begin());
+}
 
-        // Apply velocity decay
-        it->velocity.x *= it->velocity_decay;
-        it->velocity.y *= it->velocity_decay;
+/**
+ * @brief Draws the particles, fading them out as their lifetime runs down.
+ *
+ * Sparks from one hit pile up on the same screen pixel, so particles are first
+ * binned by screen pixel, keeping the brightest, and each covered pixel is
+ * drawn once. The number of draw calls is bounded by the pixels covered rather
+ * than the number of live particles, and sparks outside the view cost nothing.
+ */
+void ParticleSystem::render() const {
+    if (pixelStamp.empty()) {
+        pixelStamp.assign(SCREEN_WIDTH * SCREEN_HEIGHT, 0);
+        pixelLifetime.assign(SCREEN_WIDTH * SCREEN_HEIGHT, 0);
+    }
+    if (++renderFrame == 0) {
+        std::fill(pixelStamp.begin(), pixelStamp.end(), 0);
+        renderFrame = 1;
+    }
 
-        if (it->lifetime <= 0) {
-            it = particles.erase(it);
+    drawnPixels.clear();
+    double originX = camera_x();
+    double originY = camera_y();
+    for (int i = 0; i < count; ++i) {
+        int x = static_cast<int>(std::floor(positionX[i] * CELL_SIZE - originX));
+        int y = static_cast<int>(std::floor(positionY[i] * CELL_SIZE - originY));
+        if (x < 0 || x >= SCREEN_WIDTH || y < 0 || y >= SCREEN_HEIGHT) {
+            continue;
+        }
+        int pixel = y * SCREEN_WIDTH + x;
+        if (pixelStamp[pixel] != renderFrame) {
+            pixelStamp[pixel] = renderFrame;
+            pixelLifetime[pixel] = lifetime[i];
+            drawnPixels.push_back(pixel);
         } else {
-            ++it;
+            pixelLifetime[pixel] = std::max(pixelLifetime[pixel], lifetime[i]);
         }
     }
-}
 
-void render_particles(const std::vector<Particle>& particles) {
-    for (const auto& p : particles) {
-        double alpha = static_cast<double>(p.lifetime) / 40.0;
-        color particle_color = rgba_color(
-                red_of(p.particle_color),
-                green_of(p.particle_color),
-                blue_of(p.particle_color),
-                static_cast<int>(alpha * 255)
-        );
-        fill_circle(particle_color, p.position.x * CELL_SIZE, p.position.y * CELL_SIZE, 1);
+    for (int pixel : drawnPixels) {
+        double alpha = static_cast<double>(pixelLifetime[pixel]) / PARTICLE_FADE_FRAMES;
+        fill_circle(rgba_color(255, 255, 255, static_cast<int>(alpha * 255)),
+                    pixel % SCREEN_WIDTH, pixel / SCREEN_WIDTH, 1, option_to_screen());
     }
 }
@@ -13,12 +13,12 @@
  * @brief Updates the player's position and state based on input and game rules.
  *
  * @param player The player object to update.
- * @param openclWrapper The OpenCL wrapper for collision detection.
+ * @param input The input sampled for this frame.
+ * @param lightingBackend The lighting backend used for collision detection.
  */
-void update_player(Player& player, OpenCLWrapper& openclWrapper) {
-    point_2d mouse_pos = mouse_position();
-    double dx = mouse_pos.x / CELL_SIZE - player.position.x;
-    double dy = mouse_pos.y / CELL_SIZE - player.position.y;
+void update_player(Player& player, const InputState& input, LightingBackend& lightingBackend) {
+    double dx = input.mouse.x / CELL_SIZE - player.position.x;
+    double dy = input.mouse.y / CELL_SIZE - player.position.y;
     double target_heading = atan2(dy, dx);
 
     double angle_diff = target_heading - player.heading;
@@ -36,10 +36,10 @@ void update_player(Player& player, OpenCLWrapper& openclWrapper) {
     while (player.heading >= 2 * M_PI) player.heading -= 2 * M_PI;
 
     Vector2D acceleration = {0, 0};
-    if (key_down(W_KEY)) acceleration.y -= PLAYER_ACCELERATION;
-    if (key_down(S_KEY)) acceleration.y += PLAYER_ACCELERATION;
-    if (key_down(A_KEY)) acceleration.x -= PLAYER_ACCELERATION;
-    if (key_down(D_KEY)) acceleration.x += PLAYER_ACCELERATION;
+    if (input.up) acceleration.y -= PLAYER_ACCELERATION;
+    if (input.down) acceleration.y += PLAYER_ACCELERATION;
+    if (input.left) acceleration.x -= PLAYER_ACCELERATION;
+    if (input.right) acceleration.x += PLAYER_ACCELERATION;
 
     player.velocity.x += acceleration.x;
     player.velocity.y += acceleration.y;
@@ -56,14 +56,14 @@ void update_player(Player& player, OpenCLWrapper& openclWrapper) {
     double new_x = player.position.x + player.velocity.x;
     double new_y = player.position.y + player.velocity.y;
 
-    int gridWidth = openclWrapper.getGridWidth();
-    int gridHeight = openclWrapper.getGridHeight();
+    int gridWidth = lightingBackend.getGridWidth();
+    int gridHeight = lightingBackend.getGridHeight();
 
     if (new_x >= 0 && new_x < gridWidth && new_y >= 0 && new_y < gridHeight) {
         Vector2D start = player.position;
         Vector2D end = {new_x, new_y};
         Vector2D hit_point;
-        openclWrapper.getCollisionPoint(start, end, hit_point);
+        lightingBackend.getCollisionPoint(start, end, hit_point);
 
         if (hit_point.x < 0) {
             player.position.x = new_x;
@@ -146,5 +146,5 @@ void render_player(const Player& player) {
  */
 void draw_crosshair() {
     point_2d mouse_pos = mouse_position();
-    draw_circle(COLOR_WHITE, mouse_pos.x, mouse_pos.y, 10);
+    draw_circle(COLOR_WHITE, mouse_pos.x, mouse_pos.y, 10, option_to_screen());
 }
@@ -8,117 +8,423 @@
  */
 
 #include "include/types.h"
+#include "include/simulation.h"
 #include "splashkit.h"
-#include <deque>
-
-
-std::vector<RadialLight> create_radial_lights(int num_lights, int grid_width, int grid_height) {
-    std::vector<RadialLight> lights;
-    std::random_device rd;
-    std::mt19937 gen(rd());
-    std::uniform_int_distribution<> x_dis(0, grid_width - 1);
-    std::uniform_int_distribution<> y_dis(0, grid_height - 1);
-    std::uniform_int_distribution<> intensity_dis(1, LIGHT_LEVELS);
-    std::uniform_real_distribution<> radius_dis(10.0, 30.0);
-    std::uniform_int_distribution<> height_dis(static_cast<int>(HeightLevel::CEILING), static_cast<int>(HeightLevel::RADIAL));
-
-    for (int i = 0; i < num_lights; ++i) {
-        RadialLight light{
-                {static_cast<double>(x_dis(gen)), static_cast<double>(y_dis(gen))},
-                static_cast<double>(intensity_dis(gen)),
-                radius_dis(gen),
-                {1, 0.5},
-                height_dis(gen)
-        };
-        lights.push_back(light);
-    }
-
-    return lights;
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+
+
+/**
+ * @brief Returns the value of a "--name=value" command line argument.
+ *
+ * @return The value, or an empty string if the argument is not present.
+ */
+std::string find_argument(int argc, char* argv[], const std::string& name) {
+    const std::string prefix = "--" + name + "=";
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg.rfind(prefix, 0) == 0) {
+            return arg.substr(prefix.size());
+        }
+    }
+    return "";
+}
+
+/**
+ * @brief Picks the lighting backend from the command line, the LIGHTING_BACKEND variable or the level.
+ *
+ * A "--backend=<name>" argument takes precedence over the environment, and
+ * both over the backend an open level asks for; the default is AUTO, which
+ * prefers OpenCL and falls back to the CPU engine.
+ */
+LightingBackendType select_lighting_backend(int argc, char* argv[], const LevelFile& level) {
+    std::string name = find_argument(argc, argv, "backend");
+    if (name.empty()) {
+        const char* env = std::getenv("LIGHTING_BACKEND");
+        name = env ? env : "";
+    }
+    if (name.empty() && level.isOpen()) {
+        return level.getBackend();
+    }
+    return parse_lighting_backend_type(name);
+}
+
+/**
+ * @brief Reads the world size from a "--world=<width>x<height>" argument.
+ *
+ * @return The size in cells; GRID_WIDTH x GRID_HEIGHT when the argument is absent.
+ * @throws std::invalid_argument If the value is not of the form WxH.
+ */
+std::pair<int, int> select_world_size(int argc, char* argv[]) {
+    std::string value = find_argument(argc, argv, "world");
+    if (value.empty()) {
+        return {GRID_WIDTH, GRID_HEIGHT};
+    }
+    size_t x = value.find('x');
+    if (x == std::string::npos) {
+        throw std::invalid_argument("Expected --world=<width>x<height>, got: " + value);
+    }
+    return {std::stoi(value.substr(0, x)), std::stoi(value.substr(x + 1))};
+}
+
+/**
+ * @brief Lists the device time of each command in the last profiled frame.
+ */
+void draw_device_profile(const std::vector<DeviceCommandSummary>& commands) {
+    double y = 50;
+    double total_ms = 0.0;
+    for (const auto& command : commands) {
+        char line[96];
+        std::snprintf(line, sizeof(line), "%-22s %3dx %7.3f ms %8zu B", command.name.c_str(), command.count, command.device_ms, command.bytes);
+        draw_text(line, COLOR_WHITE, 10, y, option_to_screen());
+        total_ms += command.device_ms;
+        y += 14;
+    }
+    draw_text("Device total: " + std::to_string(total_ms) + " ms", COLOR_WHITE, 10, y, option_to_screen());
 }
 
-void render_frame(const OpenCLWrapper& openclWrapper, const Player& player, const std::vector<Particle>& particles, bool torch_on) {
+/**
+ * @brief Draws the frame time line at the bottom of the screen and, if asked, the p50, p95, p99 and max of each phase.
+ *
+ * @param phases The last window of every phase.
+ * @param threaded Whether the simulation runs on its own thread, which adds a line for ticks and input latency.
+ * @param show_phases Whether to list every phase.
+ */
+void draw_frame_statistics(const std::array<LatencySummary, FRAME_PHASE_COUNT>& phases, bool threaded, bool show_phases) {
+    const LatencySummary& frames = phases[static_cast<int>(FramePhase::FRAME)];
+    char line[128];
+    std::snprintf(line, sizeof(line), "Frame p50: %.2f ms | p99: %.2f ms | max: %.2f ms | FPS: %.1f",
+                  frames.p50, frames.p99, frames.max, frames.count > 0 ? 1000.0 / frames.mean : 0.0);
+    draw_text(line, COLOR_WHITE, 10, SCREEN_HEIGHT - 30, option_to_screen());
+
+    if (threaded) {
+        const LatencySummary& ticks = phases[static_cast<int>(FramePhase::TICK)];
+        const LatencySummary& latency = phases[static_cast<int>(FramePhase::INPUT_LATENCY)];
+        std::snprintf(line, sizeof(line), "Tick p50: %.2f ms | p99: %.2f ms | TPS: %.1f | Input latency p50: %.2f ms | p99: %.2f ms",
+                      ticks.p50, ticks.p99, ticks.count > 0 ? 1000.0 / ticks.mean : 0.0, latency.p50, latency.p99);
+        draw_text(line, COLOR_WHITE, 10, SCREEN_HEIGHT - 16, option_to_screen());
+    }
+
+    if (!show_phases) {
+        return;
+    }
+    const int listed = static_cast<int>(FramePhase::FRAME);
+    double y = SCREEN_HEIGHT - 30 - 14 * (listed + 1);
+    draw_text("phase                    p50     p95     p99     max (ms)", COLOR_WHITE, 10, y, option_to_screen());
+    for (int phase = 0; phase < listed; ++phase) {
+        const LatencySummary& summary = phases[phase];
+        std::snprintf(line, sizeof(line), "%-22s %7.3f %7.3f %7.3f %7.3f", frame_phase_name(static_cast<FramePhase>(phase)),
+                      summary.p50, summary.p95, summary.p99, summary.max);
+        y += 14;
+        draw_text(line, COLOR_WHITE, 10, y, option_to_screen());
+    }
+}
+
+void draw_player_status(const Player& player, bool torch_on) {
+    draw_text("Health: " + std::to_string(player.health), COLOR_WHITE, 10, 10, option_to_screen());
+    draw_text("Torch: " + std::string(torch_on ? "ON" : "OFF"), COLOR_WHITE, 10, 30, option_to_screen());
+}
+
+void play_game_sounds(long shots, long hits) {
+    for (long i = 0; i < hits; ++i) {
+        play_sound_effect("hit");
+    }
+    for (long i = 0; i < shots; ++i) {
+        play_sound_effect("gunshot", 1, 0.5);
+    }
+}
+
+void render_frame(const LightingBackend& lightingBackend, RenderMode renderMode, GridFramebuffer& framebuffer,
+                  const GridRect& activeRect, const Player& player, const ParticleSystem& particles, bool torch_on) {
     clear_screen(COLOR_BLACK);
-    render_grid(openclWrapper);
+    if (renderMode == RenderMode::CELLS) {
+        render_grid(lightingBackend, activeRect);
+    } else {
+        framebuffer.render(lightingBackend, activeRect, renderMode == RenderMode::DEVICE_FRAMEBUFFER);
+    }
     render_player(player);
-    render_particles(particles);
+    particles.render();
     draw_crosshair();
+    draw_player_status(player, torch_on);
 
-    draw_text("Health: " + std::to_string(player.health), COLOR_WHITE, 10, 10);
-    draw_text("Torch: " + std::string(torch_on ? "ON" : "OFF"), COLOR_WHITE, 10, 30);
+    const DeviceProfiler* profiler = lightingBackend.getDeviceProfiler();
+    if (profiler && profiler->isEnabled()) {
+        draw_device_profile(profiler->getLastFrame());
+    }
 }
 
-int main() {
-    try {
-        open_window("Lighting Demo", SCREEN_WIDTH, SCREEN_HEIGHT);
-        hide_mouse();
-        load_sound_effect("gunshot", "gun_shot_1.wav");
-        load_sound_effect("hit", "bullet_hit_1.wav");
+/**
+ * @brief Draws a snapshot published by the simulation thread.
+ *
+ * The player and camera are drawn alpha of the way from the previous tick to
+ * the snapshot's. The grid is shaded on the host from the snapshot's copy of
+ * the heights and light levels, as the backend belongs to the simulation
+ * thread; main runs RenderMode::DEVICE_FRAMEBUFFER on the serial loop instead.
+ */
+void render_snapshot(const WorldSnapshot& snapshot, double alpha, RenderMode renderMode, GridFramebuffer& framebuffer) {
+    apply_camera(interpolate_camera(snapshot.previousCamera, snapshot.camera, alpha));
+    clear_screen(COLOR_BLACK);
+    if (renderMode == RenderMode::CELLS) {
+        render_grid(snapshot.heights, snapshot.levels, snapshot.rect);
+    } else {
+        framebuffer.render(snapshot.rect, snapshot.heights, snapshot.levels);
+    }
+    render_player(interpolate_player(snapshot.previousPlayer, snapshot.player, alpha));
+    snapshot.particles.render();
+    draw_crosshair();
+    draw_player_status(snapshot.player, snapshot.torch_on);
 
-        OpenCLWrapper openclWrapper;
-        openclWrapper.initialize();
+    if (!snapshot.deviceProfile.empty()) {
+        draw_device_profile(snapshot.deviceProfile);
+    }
+}
 
-        Grid initialGrid = create_grid(GRID_WIDTH, GRID_HEIGHT);
-        openclWrapper.initializeGrid(initialGrid);
+/**
+ * @brief Runs the game with input, simulation and drawing in turn on this thread, one step per frame.
+ */
+void run_serial_loop(GameWorld& world, LightingBackend& lightingBackend, RenderMode renderMode, std::ostream* input_recording,
+                     FrameTelemetry& telemetry, bool show_phases) {
+    GridFramebuffer framebuffer;
+    auto start_time = std::chrono::steady_clock::now();
+    auto last_frame_time = start_time;
 
-        Player player = {{GRID_WIDTH / 2.0, GRID_HEIGHT / 2.0}, {0, 0}, 0, 100};
-        std::vector<RadialLight> radial_lights = create_radial_lights(MAX_RADIAL_LIGHTS, GRID_WIDTH, GRID_HEIGHT);
-        Torch torch = {{player.position.x, player.position.y}, {1, 0}, TORCH_RADIUS, TORCH_RADIUS};
+    while (!quit_requested() && world.player.health > 0) {
+        auto frame_start = std::chrono::steady_clock::now();
+
+        std::chrono::duration<double> delta_duration = frame_start - last_frame_time;
+        double delta_time = delta_duration.count();
+        last_frame_time = frame_start;
+
+        double total_time = std::chrono::duration<double>(frame_start - start_time).count();
+
+        // The frame phase spans one loop start to the next, so it includes the present.
+        if (frame_start != start_time) {
+            telemetry.record(FramePhase::FRAME, delta_duration.count() * 1000.0);
+            telemetry.endFrame();
+        }
+
+        {
+            ScopedPhaseTimer timer(telemetry, FramePhase::EVENTS);
+            process_events();
+        }
+        InputState input = read_input();
+        auto input_sampled = std::chrono::steady_clock::now();
+        if (input_recording) {
+            write_input_frame(*input_recording, input);
+        }
 
-        std::vector<Bullet> bullets;
-        std::vector<Particle> particles;
+        long shots = world.shots;
+        long hits = world.hits;
+        step_world(world, lightingBackend, input, total_time, delta_time, telemetry);
+        apply_camera(world.camera);
+        play_game_sounds(world.shots - shots, world.hits - hits);
 
-        auto start_time = std::chrono::high_resolution_clock::now();
-        auto last_frame_time = start_time;
+        {
+            ScopedPhaseTimer timer(telemetry, FramePhase::RENDER);
+            render_frame(lightingBackend, renderMode, framebuffer, world.activeRect, world.player, world.particles, world.torch_on);
+//            render_bullets(world.bullets);
+            draw_frame_statistics(telemetry.summarizeLastWindow(), false, show_phases);
+        }
 
-        const int BENCHMARK_FRAMES = 60;
-        std::deque<double> frame_times;
+        {
+            ScopedPhaseTimer timer(telemetry, FramePhase::PRESENT);
+            refresh_screen(100);
+        }
+        telemetry.record(FramePhase::INPUT_LATENCY,
+                         std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - input_sampled).count());
+    }
+}
 
-        bool torch_on = true;
+/**
+ * @brief Runs the simulation on its own thread at a fixed tick rate and draws its newest snapshot every frame.
+ *
+ * Input is sampled once per frame and posted to the simulation. The input
+ * latency phase runs from sampling an input to presenting the first frame
+ * simulated with it, so it covers the wait for the next tick as well.
+ */
+void run_threaded_loop(GameWorld& world, LightingBackend& lightingBackend, RenderMode renderMode, std::ostream* input_recording,
+                       FrameTelemetry& telemetry, bool show_phases, int tick_rate) {
+    GridFramebuffer framebuffer;
+    SimulationThread simulation(world, lightingBackend, tick_rate, input_recording);
+    TripleBuffer<WorldSnapshot>& snapshots = simulation.getSnapshots();
 
-        while (!quit_requested() && player.health > 0) {
-            auto frame_start = std::chrono::high_resolution_clock::now();
+    process_events();
+    simulation.getInput().post(read_input(), std::chrono::steady_clock::now());
+    simulation.start();
 
-            std::chrono::duration<double> delta_duration = frame_start - last_frame_time;
-            double delta_time = delta_duration.count();
-            last_frame_time = frame_start;
+    auto start_time = std::chrono::steady_clock::now();
+    auto last_frame_time = start_time;
+    long played_shots = 0;
+    long played_hits = 0;
+    auto last_measured_input = std::chrono::steady_clock::time_point();
 
-            double total_time = std::chrono::duration<double>(frame_start - start_time).count();
+    while (!quit_requested() && !simulation.isFinished()) {
+        auto frame_start = std::chrono::steady_clock::now();
+        if (frame_start != start_time) {
+            telemetry.record(FramePhase::FRAME, std::chrono::duration<double, std::milli>(frame_start - last_frame_time).count());
+            telemetry.endFrame();
+        }
+        last_frame_time = frame_start;
 
+        {
+            ScopedPhaseTimer timer(telemetry, FramePhase::EVENTS);
             process_events();
+        }
+        simulation.getInput().post(read_input(), std::chrono::steady_clock::now());
+
+        snapshots.acquire();
+        const WorldSnapshot& snapshot = snapshots.getReadSlot();
+        if (snapshot.tick >= 0) {
+            play_game_sounds(snapshot.shots - played_shots, snapshot.hits - played_hits);
+            played_shots = snapshot.shots;
+            played_hits = snapshot.hits;
 
-            update_player(player, openclWrapper);
-            update_torch(torch, player, total_time);
-            update_bullets(bullets, particles, openclWrapper);
-            update_particles(particles);
-            update_radial_light_movers(radial_lights, openclWrapper.getGridWidth(), openclWrapper.getGridHeight(), delta_time);
+            ScopedPhaseTimer timer(telemetry, FramePhase::RENDER);
+            double alpha = std::chrono::duration<double>(frame_start - snapshot.publishedAt).count() / simulation.getTickSeconds();
+            render_snapshot(snapshot, std::max(0.0, std::min(alpha, 1.0)), renderMode, framebuffer);
 
-            if (mouse_down(LEFT_BUTTON) && player.cooldown == 0) {
-                create_bullet(bullets, player);
+            // Phases the simulation thread times come from the snapshot.
+            std::array<LatencySummary, FRAME_PHASE_COUNT> phases = telemetry.summarizeLastWindow();
+            for (int phase = 0; phase < FRAME_PHASE_COUNT; ++phase) {
+                if (phases[phase].count == 0) {
+                    phases[phase] = snapshot.telemetry[phase];
+                }
             }
+            draw_frame_statistics(phases, true, show_phases);
+        }
 
-            if (key_typed(T_KEY)) {
-                torch_on = !torch_on;
+        {
+            ScopedPhaseTimer timer(telemetry, FramePhase::PRESENT);
+            refresh_screen(100);
+        }
+        if (snapshot.tick >= 0 && snapshot.inputSampledAt != last_measured_input) {
+            last_measured_input = snapshot.inputSampledAt;
+            telemetry.record(FramePhase::INPUT_LATENCY,
+                             std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - last_measured_input).count());
+        }
+    }
+
+    simulation.stop();
+    telemetry.mergeRun(simulation.getTelemetry());
+}
+
+int main(int argc, char* argv[]) {
+    try {
+        // Declared before the backend, which streams chunks from it until it is destroyed.
+        LevelFile level;
+        open_window("Lighting Demo", SCREEN_WIDTH, SCREEN_HEIGHT);
+        hide_mouse();
+        load_sound_effect("gunshot", "gun_shot_1.wav");
+        load_sound_effect("hit", "bullet_hit_1.wav");
+
+        // A "--level=<file>" argument loads a level file instead of generating a world.
+        std::string level_path = find_argument(argc, argv, "level");
+        if (!level_path.empty()) {
+            level.open(level_path);
+        }
+        LightingBackendType backendType = select_lighting_backend(argc, argv, level);
+        std::unique_ptr<LightingBackend> lightingBackend = create_lighting_backend(backendType);
+        LightingOptions lightingOptions;
+        lightingOptions.incremental = find_argument(argc, argv, "lighting-update") == "incremental";
+        lightingOptions.occlusion = parse_occlusion_mode(find_argument(argc, argv, "occlusion"));
+        lightingOptions.pipelined = find_argument(argc, argv, "lighting-pipeline") == "async";
+        std::string profile_path = find_argument(argc, argv, "cl-profile");
+        lightingOptions.profiling = !profile_path.empty();
+        lightingBackend->setOptions(lightingOptions);
+        // Commands are written to the profile as they resolve, so a long session does not pile them up.
+        DeviceProfiler* profiler = lightingBackend->getDeviceProfiler();
+        if (profiler && profiler->isEnabled()) {
+            profiler->openTrace(profile_path);
+        }
+        std::string telemetry_path = find_argument(argc, argv, "telemetry");
+
+        std::string threading = find_argument(argc, argv, "threading");
+        if (!threading.empty() && threading != "split" && threading != "serial") {
+            throw std::invalid_argument("Expected --threading=split|serial, got: " + threading);
+        }
+        // Device shading needs the backend, which the split loop leaves to the simulation thread.
+        RenderMode renderMode = parse_render_mode(find_argument(argc, argv, "render"));
+        if (renderMode == RenderMode::DEVICE_FRAMEBUFFER) {
+            if (threading == "split") {
+                throw std::invalid_argument("--render=device needs --threading=serial");
             }
+            threading = "serial";
+        }
+        std::string tick_rate_argument = find_argument(argc, argv, "tick-rate");
+        int tick_rate = tick_rate_argument.empty() ? DEFAULT_TICK_RATE : std::stoi(tick_rate_argument);
 
-            update_grid_lighting(radial_lights, torch, torch_on, openclWrapper);
+        std::string seed_argument = find_argument(argc, argv, "seed");
+        unsigned int seed = seed_argument.empty() ? std::random_device()() : static_cast<unsigned int>(std::stoul(seed_argument));
+        std::mt19937 rng(seed);
 
-            render_frame(openclWrapper, player, particles, torch_on);
-//            render_bullets(bullets);
+        std::ofstream input_recording;
+        std::string record_path = find_argument(argc, argv, "record-input");
+        if (!record_path.empty()) {
+            input_recording.open(record_path);
+            input_recording << "# seed " << seed << "\n";
+        }
 
-            auto frame_end = std::chrono::high_resolution_clock::now();
-            std::chrono::duration<double, std::milli> frame_duration = frame_end - frame_start;
+        std::pair<int, int> world_size;
+        Vector2D spawn;
+        Grid initialGrid;
+        unsigned int grid_seed = 0;
+        if (level.isOpen()) {
+            lightingBackend->initializeLevel(level);
+            world_size = {level.getWidth(), level.getHeight()};
+            spawn = {level.getHeader().spawn_x, level.getHeader().spawn_y};
+        } else {
+            world_size = select_world_size(argc, argv);
+            grid_seed = rng();
+            initialGrid = create_grid(world_size.first, world_size.second, grid_seed);
+            lightingBackend->initializeGrid(initialGrid);
+            spawn = {world_size.first / 2.0, world_size.second / 2.0};
+        }
 
-            frame_times.push_back(frame_duration.count());
-            if (frame_times.size() > BENCHMARK_FRAMES) {
-                frame_times.pop_front();
+        GameWorld world;
+        world.width = world_size.first;
+        world.height = world_size.second;
+        world.player = {spawn, {0, 0}, 0, 100};
+        world.previousPlayer = world.player;
+        world.camera = create_camera(SCREEN_WIDTH / CELL_SIZE, SCREEN_HEIGHT / CELL_SIZE);
+        update_camera(world.camera, world.player, world.width, world.height);
+        world.previousCamera = world.camera;
+        apply_camera(world.camera);
+        std::string static_argument = find_argument(argc, argv, "static-lights");
+        int num_static = static_argument.empty() ? 0 : std::stoi(static_argument);
+        std::string lights_argument = find_argument(argc, argv, "lights");
+        int num_lights = lights_argument.empty() ? DEFAULT_RADIAL_LIGHTS : std::stoi(lights_argument);
+        if (level.isOpen()) {
+            // The level's static lights replace --static-lights; the moving ones are still generated.
+            level.readLights(world.radial_lights);
+            std::vector<RadialLight> moving = create_radial_lights(num_lights, 0, world_size.first, world_size.second, rng());
+            world.radial_lights.insert(world.radial_lights.end(), moving.begin(), moving.end());
+        } else {
+            world.radial_lights = create_radial_lights(num_lights, num_static, world_size.first, world_size.second, rng());
+            // A "--save-level=<file>" argument keeps the generated world, its static lights and the chosen backend as a level file.
+            std::string save_path = find_argument(argc, argv, "save-level");
+            if (!save_path.empty()) {
+                write_level_file(save_path, initialGrid, world.radial_lights, spawn, grid_seed, backendType);
             }
+            initialGrid = Grid();
+        }
+        world.torch = {{world.player.position.x, world.player.position.y}, {1, 0}, TORCH_RADIUS, TORCH_RADIUS};
+        world.rng = rng;
 
-            double average_frame_time = std::accumulate(frame_times.begin(), frame_times.end(), 0.0) / frame_times.size();
-            double fps = 1000.0 / average_frame_time;
+        FrameTelemetry telemetry;
+        std::ostream* recording = input_recording.is_open() ? &input_recording : nullptr;
+        if (threading == "serial") {
+            run_serial_loop(world, *lightingBackend, renderMode, recording, telemetry, !telemetry_path.empty());
+        } else {
+            run_threaded_loop(world, *lightingBackend, renderMode, recording, telemetry, !telemetry_path.empty(), tick_rate);
+        }
 
-            draw_text("Avg Frame Time: " + std::to_string(average_frame_time) + " ms | FPS: " + std::to_string(fps), COLOR_WHITE, 10, SCREEN_HEIGHT - 30);
+        if (!telemetry_path.empty()) {
+            write_frame_telemetry(telemetry, telemetry_path);
+        }
 
-            refresh_screen(100);
+        if (profiler && profiler->isEnabled()) {
+            profiler->closeTrace();
         }
 
     } catch (const std::exception& e) {
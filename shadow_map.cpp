@@ -0,0 +1,168 @@
+/**
+ * @file shadow_map.cpp
+ * @brief Implements the ShadowMap profiles and the occlusion error report.
+ *
+ * Profiles are built from the integer cell and height that has_clear_path uses
+ * for a light. Along the centre ray of each bucket, the occluder at distance t
+ * with height H blocks a receiver of height h at distance d > t when
+ * (L - H) / t < (L - h - 0.1) / d, where L is the light height. Each profile
+ * entry stores the minimum of (L - H) / t over the steps before it, so the
+ * receiver test compares one stored slope with its own. build_shadow_profiles
+ * and shadow_map_is_lit in lighting_kernels.cl follow the same steps.
+ */
+
+#include "./include/types.h"
+#include <algorithm>
+#include <cfloat>
+
+namespace {
+    const float TWO_PI = 2.0f * PI;
+
+    /**
+     * @brief Sizes the profile of a light with the given reach.
+     *
+     * There is at least one bucket per cell on the light's outer edge, and the
+     * steps cover the reach measured from the light's cell rather than its
+     * exact position.
+     */
+    ShadowSource describe_source(int x, int y, int height, double reach, int offset) {
+        int buckets = SHADOW_MAP_MIN_BUCKETS + static_cast<int>(std::ceil(TWO_PI * reach));
+        int steps = static_cast<int>(std::ceil(reach)) + 3;
+        return {x, y, height, buckets, steps, offset, {0, 0}};
+    }
+}
+
+/**
+ * @brief Assigns each light, and the torch when it is on, a slice of the profile storage.
+ *
+ * Sources are stored in light order and the torch, if on, comes last.
+ *
+ * @param lights The radial lights in the scene.
+ * @param torch The player's torch.
+ * @param torch_on Whether the torch is turned on.
+ * @return The number of floats needed to hold every profile.
+ */
+int ShadowMap::layout(const std::vector<RadialLight>& lights, const Torch& torch, bool torch_on) {
+    sources.clear();
+    profileSize = 0;
+    for (const auto& light : lights) {
+        sources.push_back(describe_source(static_cast<int>(light.position.x), static_cast<int>(light.position.y),
+                                          light.height, light.radius, profileSize));
+        profileSize += sources.back().buckets * sources.back().steps;
+    }
+    if (torch_on) {
+        sources.push_back(describe_source(static_cast<int>(torch.position.x), static_cast<int>(torch.position.y),
+                                          static_cast<int>(HeightLevel::TORCH), torch.current_radius * 2.0, profileSize));
+        profileSize += sources.back().buckets * sources.back().steps;
+    }
+    return profileSize;
+}
+
+/**
+ * @brief Builds the profiles laid out by the last call to layout, one source per task.
+ * @param terrain The heights to cast shadows from.
+ * @param workerPool The threads to build on.
+ */
+void ShadowMap::build(const CollisionGrid& terrain, WorkerPool& workerPool) {
+    profiles.resize(profileSize);
+    const int width = terrain.getWidth();
+    const int height = terrain.getHeight();
+
+    workerPool.parallelFor(0, static_cast<int>(sources.size()), 1, [&](int begin, int end) {
+        for (int s = begin; s < end; ++s) {
+            const ShadowSource& source = sources[s];
+            for (int b = 0; b < source.buckets; ++b) {
+                float angle = -PI + (b + 0.5f) * TWO_PI / source.buckets;
+                float cos_angle = std::cos(angle);
+                float sin_angle = std::sin(angle);
+                float* profile = &profiles[source.offset + b * source.steps];
+                float min_slope = FLT_MAX;
+                profile[0] = min_slope;
+
+                for (int t = 1; t < source.steps; ++t) {
+                    int x = source.x + static_cast<int>(std::floor(t * cos_angle + 0.5f));
+                    int y = source.y + static_cast<int>(std::floor(t * sin_angle + 0.5f));
+                    if (x >= 0 && x < width && y >= 0 && y < height) {
+                        min_slope = std::min(min_slope, static_cast<float>(source.height - terrain.getHeightAt(x, y)) / t);
+                    }
+                    profile[t] = min_slope;
+                }
+            }
+        }
+    });
+}
+
+/**
+ * @brief Looks up whether a cell can see a source.
+ * @param source Index of the source in getSources().
+ * @param x The x-coordinate of the cell.
+ * @param y The y-coordinate of the cell.
+ * @param height The height of the cell.
+ * @return True if no profiled occluder lies between the cell and the source.
+ */
+bool ShadowMap::isLit(int source, int x, int y, int height) const {
+    const ShadowSource& s = sources[source];
+    int dx = x - s.x;
+    int dy = y - s.y;
+    if (dx == 0 && dy == 0) {
+        return true;
+    }
+
+    float distance = std::sqrt(static_cast<float>(dx * dx + dy * dy));
+    float angle = std::atan2(static_cast<float>(dy), static_cast<float>(dx));
+    int bucket = std::min(static_cast<int>((angle + PI) * s.buckets / TWO_PI), s.buckets - 1);
+    // Only occluders at least one cell closer than the receiver are considered,
+    // so a cell never shadows itself.
+    int step = std::min(static_cast<int>(distance) - 1, s.steps - 1);
+    float slope = (static_cast<float>(s.height - height) - 0.1f) / distance;
+    return profiles[s.offset + bucket * s.steps + step] >= slope;
+}
+
+/**
+ * @brief Lights the terrain with both occlusion modes on the CPU and compares the results.
+ *
+ * @param terrain The heights to light.
+ * @param lights The radial lights in the scene.
+ * @param torch The player's torch.
+ * @param torch_on Whether the torch is turned on.
+ * @return Per-cell differences of the shadow-map levels against the Bresenham levels.
+ */
+OcclusionErrorReport compare_occlusion_modes(const CollisionGrid& terrain, const std::vector<RadialLight>& lights,
+                                             const Torch& torch, bool torch_on) {
+    Grid grid = terrain.toGrid();
+    std::vector<uint8_t> reference;
+    std::vector<uint8_t> candidate;
+
+    CPULightingEngine engine;
+    LightingOptions options;
+    engine.initializeGrid(grid);
+    options.occlusion = OcclusionMode::RAYCAST;
+    engine.setOptions(options);
+    engine.calculateLighting(lights, torch, torch_on);
+    engine.readLightLevels(reference);
+
+    options.occlusion = OcclusionMode::SHADOW_MAP;
+    engine.setOptions(options);
+    engine.calculateLighting(lights, torch, torch_on);
+    engine.readLightLevels(candidate);
+
+    OcclusionErrorReport report;
+    long total_error = 0;
+    report.cells = static_cast<long>(reference.size());
+    for (size_t i = 0; i < reference.size(); ++i) {
+        int difference = static_cast<int>(candidate[i]) - reference[i];
+        if (difference == 0) {
+            continue;
+        }
+        ++report.mismatched_cells;
+        if (difference > 0) {
+            ++report.over_lit_cells;
+        } else {
+            ++report.under_lit_cells;
+        }
+        report.max_level_error = std::max(report.max_level_error, std::abs(difference));
+        total_error += std::abs(difference);
+    }
+    report.mean_abs_error = report.cells > 0 ? static_cast<double>(total_error) / report.cells : 0.0;
+    return report;
+}
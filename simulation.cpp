@@ -0,0 +1,268 @@
+/**
+ * @file simulation.cpp
+ * @brief Implements the world step, the snapshots and the simulation thread.
+ */
+
+#include "./include/types.h"
+#include "./include/simulation.h"
+#include <algorithm>
+#include <cmath>
+
+/**
+ * @brief Advances the world by one step.
+ *
+ * This is the body of the game loop short of input and drawing, shared by the
+ * single-threaded loop and the simulation thread. It makes no SplashKit calls:
+ * sounds are left to the caller, which can compare the shot and hit counters
+ * before and after.
+ *
+ * @param world The world to step.
+ * @param lightingBackend The lighting backend, for collisions and lighting.
+ * @param input The input for this step.
+ * @param total_time Seconds since the game started, for the torch.
+ * @param delta_time Seconds since the previous step, for the light movers.
+ * @param telemetry Receives the time of each phase.
+ */
+void step_world(GameWorld& world, LightingBackend& lightingBackend, const InputState& input, double total_time, double delta_time,
+                FrameTelemetry& telemetry) {
+    world.previousPlayer = world.player;
+    world.previousCamera = world.camera;
+
+    {
+        ScopedPhaseTimer timer(telemetry, FramePhase::PLAYER);
+        update_player(world.player, input, lightingBackend);
+    }
+    update_camera(world.camera, world.player, world.width, world.height);
+    world.activeRect = camera_active_rect(world.camera, world.width, world.height);
+    lightingBackend.setActiveRect(world.activeRect);
+    update_torch(world.torch, world.player, total_time);
+    {
+        ScopedPhaseTimer timer(telemetry, FramePhase::BULLETS);
+        world.hits += update_bullets(world.bullets, world.particles, world.rng, lightingBackend);
+    }
+    {
+        ScopedPhaseTimer timer(telemetry, FramePhase::PARTICLES);
+        world.particles.update();
+    }
+    {
+        ScopedPhaseTimer timer(telemetry, FramePhase::LIGHT_MOVERS);
+        update_radial_light_movers(world.radial_lights, lightingBackend.getGridWidth(), lightingBackend.getGridHeight(), delta_time);
+    }
+
+    if (input.fire && world.player.cooldown == 0) {
+        create_bullet(world.bullets, world.player);
+        ++world.shots;
+    }
+
+    if (input.toggle_torch) {
+        world.torch_on = !world.torch_on;
+    }
+
+    {
+        ScopedPhaseTimer timer(telemetry, FramePhase::LIGHTING);
+        update_grid_lighting(world.radial_lights, world.torch, world.torch_on, lightingBackend);
+    }
+}
+
+/**
+ * @brief Copies what the renderer needs from the world into a snapshot.
+ *
+ * The snapshot's vectors keep their storage between ticks, so once they have
+ * grown to size a capture does not allocate.
+ *
+ * @param world The world after a step.
+ * @param lightingBackend The backend to read heights and light levels from.
+ * @param snapshot The snapshot to fill.
+ */
+void capture_snapshot(const GameWorld& world, const LightingBackend& lightingBackend, WorldSnapshot& snapshot) {
+    snapshot.player = world.player;
+    snapshot.previousPlayer = world.previousPlayer;
+    snapshot.camera = world.camera;
+    snapshot.previousCamera = world.previousCamera;
+    snapshot.torch = world.torch;
+    snapshot.torch_on = world.torch_on;
+    snapshot.bullets.assign(world.bullets.begin(), world.bullets.end());
+    snapshot.particles.copyFrom(world.particles);
+    snapshot.radial_lights.assign(world.radial_lights.begin(), world.radial_lights.end());
+    snapshot.rect = world.activeRect;
+    lightingBackend.getCollisionGrid().readHeightRect(snapshot.heights, world.activeRect);
+    lightingBackend.readLightLevelRect(snapshot.levels, world.activeRect);
+    snapshot.shots = world.shots;
+    snapshot.hits = world.hits;
+
+    const DeviceProfiler* profiler = lightingBackend.getDeviceProfiler();
+    if (profiler && profiler->isEnabled()) {
+        snapshot.deviceProfile.assign(profiler->getLastFrame().begin(), profiler->getLastFrame().end());
+    } else {
+        snapshot.deviceProfile.clear();
+    }
+}
+
+/**
+ * @brief Blends two player states for drawing between ticks.
+ *
+ * @param from The player at the previous tick.
+ * @param to The player at the newest tick.
+ * @param alpha How far between the ticks to draw, from 0 to 1.
+ * @return The player to draw; everything but the position and heading comes from to.
+ */
+Player interpolate_player(const Player& from, const Player& to, double alpha) {
+    Player player = to;
+    player.position.x = from.position.x + (to.position.x - from.position.x) * alpha;
+    player.position.y = from.position.y + (to.position.y - from.position.y) * alpha;
+
+    double turn = to.heading - from.heading;
+    if (turn > M_PI) turn -= 2 * M_PI;
+    if (turn < -M_PI) turn += 2 * M_PI;
+    player.heading = from.heading + turn * alpha;
+    return player;
+}
+
+/**
+ * @brief Blends two camera positions for drawing between ticks.
+ *
+ * @param from The camera at the previous tick.
+ * @param to The camera at the newest tick.
+ * @param alpha How far between the ticks to draw, from 0 to 1.
+ * @return The camera to draw with.
+ */
+Camera interpolate_camera(const Camera& from, const Camera& to, double alpha) {
+    Camera camera = to;
+    camera.x = from.x + (to.x - from.x) * alpha;
+    camera.y = from.y + (to.y - from.y) * alpha;
+    return camera;
+}
+
+/**
+ * @brief Replaces the pending input with a new sample.
+ *
+ * @param input The input read by the render thread.
+ * @param sampledAt When it was read.
+ */
+void InputMailbox::post(const InputState& input, std::chrono::steady_clock::time_point sampledAt) {
+    std::lock_guard<std::mutex> lock(mutex);
+    latest = input;
+    latestSampledAt = sampledAt;
+    hasInput = true;
+    fireLatched = fireLatched || input.fire;
+    if (input.toggle_torch) {
+        ++pendingToggles;
+    }
+}
+
+/**
+ * @brief Takes the input for the next tick.
+ *
+ * @param input Receives the newest sample with latched presses applied.
+ * @param sampledAt Receives when the newest sample was read.
+ * @return False if nothing has been posted yet.
+ */
+bool InputMailbox::take(InputState& input, std::chrono::steady_clock::time_point& sampledAt) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!hasInput) {
+        return false;
+    }
+    input = latest;
+    input.fire = latest.fire || fireLatched;
+    input.toggle_torch = pendingToggles > 0;
+    sampledAt = latestSampledAt;
+    fireLatched = false;
+    pendingToggles = std::max(0, pendingToggles - 1);
+    return true;
+}
+
+/**
+ * @brief Prepares a simulation thread without starting it.
+ *
+ * @param world The world to simulate; the thread owns it from start() to stop().
+ * @param lightingBackend The lighting backend; likewise owned by the thread while it runs.
+ * @param tickRate Ticks per second.
+ * @param inputRecording If not null, receives the input of every tick in track format.
+ */
+SimulationThread::SimulationThread(GameWorld& world, LightingBackend& lightingBackend, int tickRate, std::ostream* inputRecording)
+        : world(world), lightingBackend(lightingBackend), tickSeconds(1.0 / std::max(1, tickRate)), inputRecording(inputRecording) {}
+
+SimulationThread::~SimulationThread() {
+    stopping.store(true, std::memory_order_relaxed);
+    if (thread.joinable()) {
+        thread.join();
+    }
+}
+
+/**
+ * @brief Starts ticking.
+ */
+void SimulationThread::start() {
+    thread = std::thread(&SimulationThread::run, this);
+}
+
+/**
+ * @brief Stops ticking and waits for the thread.
+ * @throws Whatever the simulation threw, if it stopped on an exception.
+ */
+void SimulationThread::stop() {
+    stopping.store(true, std::memory_order_relaxed);
+    if (thread.joinable()) {
+        thread.join();
+    }
+    if (failure) {
+        std::rethrow_exception(failure);
+    }
+}
+
+/**
+ * @brief The thread body: steps the world and publishes a snapshot once per tick.
+ *
+ * Ticks are scheduled on a fixed grid of times. A late tick runs as soon as it
+ * can, so short stalls are caught up; after MAX_CATCH_UP_TICKS the schedule
+ * restarts from now instead of running a burst of ticks.
+ */
+void SimulationThread::run() {
+    using clock = std::chrono::steady_clock;
+    const auto tickDuration = std::chrono::duration_cast<clock::duration>(std::chrono::duration<double>(tickSeconds));
+
+    try {
+        clock::time_point nextTick = clock::now();
+        clock::time_point lastTickStart = nextTick;
+        long tick = 0;
+        while (!stopping.load(std::memory_order_relaxed) && world.player.health > 0) {
+            clock::time_point tickStart = clock::now();
+            if (tick > 0) {
+                telemetry.record(FramePhase::TICK, std::chrono::duration<double, std::milli>(tickStart - lastTickStart).count());
+            }
+            lastTickStart = tickStart;
+
+            InputState tickInput;
+            clock::time_point sampledAt;
+            if (input.take(tickInput, sampledAt)) {
+                if (inputRecording) {
+                    write_input_frame(*inputRecording, tickInput);
+                }
+                step_world(world, lightingBackend, tickInput, tick * tickSeconds, tickSeconds, telemetry);
+
+                {
+                    ScopedPhaseTimer timer(telemetry, FramePhase::SNAPSHOT);
+                    WorldSnapshot& snapshot = snapshots.getWriteSlot();
+                    capture_snapshot(world, lightingBackend, snapshot);
+                    snapshot.tick = tick;
+                    snapshot.inputSampledAt = sampledAt;
+                    snapshot.telemetry = telemetry.summarizeLastWindow();
+                    snapshot.publishedAt = clock::now();
+                }
+                snapshots.publish();
+                telemetry.endFrame();
+                ++tick;
+            }
+
+            nextTick += tickDuration;
+            clock::time_point now = clock::now();
+            if (now - nextTick > MAX_CATCH_UP_TICKS * tickDuration) {
+                nextTick = now;
+            }
+            std::this_thread::sleep_until(nextTick);
+        }
+    } catch (...) {
+        failure = std::current_exception();
+    }
+    finished.store(true, std::memory_order_release);
+}
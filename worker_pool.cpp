@@ -0,0 +1,108 @@
+/**
+ * @file worker_pool.cpp
+ * @brief Implements the WorkerPool used by the CPU lighting engine.
+ *
+ * Work is handed out in chunks of rows through an atomic counter, so threads
+ * that finish cheap rows early pick up the remaining expensive ones.
+ */
+
+#include "./include/worker_pool.h"
+#include <algorithm>
+
+/**
+ * @brief Starts the worker threads.
+ * @param threadCount Total number of threads including the caller; 0 picks the hardware concurrency.
+ */
+WorkerPool::WorkerPool(unsigned int threadCount)
+        : currentTask(nullptr), rangeEnd(0), rangeChunk(1), nextIndex(0),
+          activeWorkers(0), generation(0), stopping(false) {
+    if (threadCount == 0) {
+        threadCount = std::max(1u, std::thread::hardware_concurrency());
+    }
+    for (unsigned int i = 1; i < threadCount; ++i) {
+        workers.emplace_back(&WorkerPool::workerLoop, this);
+    }
+}
+
+WorkerPool::~WorkerPool() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    wakeCondition.notify_all();
+    for (auto& worker : workers) {
+        worker.join();
+    }
+}
+
+/**
+ * @brief Runs a task over [begin, end) split into chunks, blocking until all chunks are done.
+ * @param begin The first index of the range.
+ * @param end One past the last index of the range.
+ * @param chunkSize The number of indices handed to a thread at a time.
+ * @param task Called with a [chunkBegin, chunkEnd) sub-range.
+ */
+void WorkerPool::parallelFor(int begin, int end, int chunkSize, const std::function<void(int, int)>& task) {
+    if (begin >= end) {
+        return;
+    }
+    if (workers.empty() || end - begin <= chunkSize) {
+        task(begin, end);
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        currentTask = &task;
+        rangeEnd = end;
+        rangeChunk = std::max(1, chunkSize);
+        nextIndex.store(begin);
+        activeWorkers = static_cast<int>(workers.size());
+        ++generation;
+    }
+    wakeCondition.notify_all();
+
+    runChunks();
+
+    std::unique_lock<std::mutex> lock(mutex);
+    doneCondition.wait(lock, [this] { return activeWorkers == 0; });
+    currentTask = nullptr;
+}
+
+/**
+ * @brief Claims and runs chunks of the current range until it is exhausted.
+ */
+void WorkerPool::runChunks() {
+    while (true) {
+        int chunkBegin = nextIndex.fetch_add(rangeChunk);
+        if (chunkBegin >= rangeEnd) {
+            break;
+        }
+        (*currentTask)(chunkBegin, std::min(chunkBegin + rangeChunk, rangeEnd));
+    }
+}
+
+/**
+ * @brief Main loop of each worker thread.
+ */
+void WorkerPool::workerLoop() {
+    unsigned long seenGeneration = 0;
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            wakeCondition.wait(lock, [&] { return stopping || generation != seenGeneration; });
+            if (stopping) {
+                return;
+            }
+            seenGeneration = generation;
+        }
+
+        runChunks();
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            --activeWorkers;
+        }
+        doneCondition.notify_one();
+    }
+}